@@ -0,0 +1,112 @@
+import asyncio
+import logging
+import struct
+from concurrent.futures import ThreadPoolExecutor
+from attiny_i2c import ATTiny
+
+# The asyncio interface of the ATTiny for clients that poll one or more ATTinys from an
+# event loop. The bus transfers of a device run in a dedicated executor thread, paced and
+# locked by the ATTiny class; the coroutines await them without blocking the loop:
+#
+#   async with AsyncATTiny(1, 0x37, 0.05, 10) as attiny:
+#       (snapshot, warn) = await asyncio.gather(attiny.get_snapshot(), attiny.get_16bit_value(ATTiny.REG_WARN_VOLTAGE))
+#
+# Only the transfer itself runs in the executor, the CRC check, the retries and the
+# decoding run in the event loop. Reads started together (e.g. with asyncio.gather())
+# are pipelined: the executor runs their transfers back to back while the loop checks
+# the data already read. The history is the exception, it is read as one sequence in
+# the executor. The values and error values are those of the ATTiny class.
+# The ATTinys of one bus can share an executor to use a single thread per bus.
+
+
+class AsyncATTiny:
+    def __init__(self, bus_number, address, time_const, num_retries, executor=None):
+        self._attiny = ATTiny(bus_number, address, time_const, num_retries)
+        self._num_retries = num_retries
+        self._own_executor = executor is None
+        if executor is None:
+            executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="attiny " + hex(address))
+        self._executor = executor
+
+    @property
+    def attiny(self):
+        # the blocking interface, it must not be used from the event loop
+        return self._attiny
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, exc_type, exc_value, traceback):
+        await self.close()
+
+    async def close(self):
+        await self.run(self._attiny.close)
+        if self._own_executor:
+            self._executor.shutdown(wait=False)
+
+    async def run(self, function, *args):
+        # runs a blocking function, e.g. any method of the ATTiny class, in the executor
+        return await asyncio.get_running_loop().run_in_executor(self._executor, function, *args)
+
+    async def _read_block(self, register, length, name):
+        # returns the data without the CRC or None if it couldn't be read
+        for x in range(self._num_retries):
+            try:
+                read = await self.run(self._attiny._read_raw, register, length, x)
+                read = self._attiny._check_block(register, read, length)
+                if read is not None:
+                    return read
+                logging.debug("Couldn't read " + name + " correctly.")
+            except Exception as e:
+                logging.debug("Couldn't read " + name + ". Exception: " + str(e))
+        logging.warning("Couldn't read " + name + " after " + str(x) + " retries.")
+        return None
+
+    async def get_8bit_value(self, register):
+        read = await self._read_block(register, 1, "8 bit register " + hex(register))
+        return 0xFFFF if read is None else read[0]
+
+    async def get_16bit_value(self, register, signed=True):
+        read = await self._read_block(register, 2, "16 bit register " + hex(register))
+        if read is None:
+            return 0xFFFFFFFF
+        # we interpret every value as a 16-bit signed value if not told otherwise
+        return int.from_bytes(read, byteorder='little', signed=signed)
+
+    async def get_snapshot(self):
+        length = struct.calcsize(ATTiny._SNAPSHOT_FORMAT)
+        read = await self._read_block(ATTiny.REG_SNAPSHOT, length, "snapshot")
+        if read is None:
+            return dict(zip(ATTiny._SNAPSHOT_FIELDS, ATTiny._SNAPSHOT_ERROR))
+        return dict(zip(ATTiny._SNAPSHOT_FIELDS, struct.unpack(ATTiny._SNAPSHOT_FORMAT, bytes(read))))
+
+    async def get_state_of_charge(self):
+        return await self.get_8bit_value(ATTiny.REG_STATE_OF_CHARGE)
+
+    async def get_time_to_shutdown(self):
+        return await self.get_16bit_value(ATTiny.REG_TIME_TO_SHUTDOWN)
+
+    async def get_should_shutdown(self):
+        return await self.get_8bit_value(ATTiny.REG_SHOULD_SHUTDOWN)
+
+    async def read_history_page(self, page):
+        # reads a history page and returns its entries or None, see read_history()
+        return await self.run(self._attiny.read_history_page, page)
+
+    async def read_history(self):
+        # reads the telemetry history, returns a list of dicts with the oldest
+        # entry first or None if the history couldn't be read. The page selection
+        # must not be interleaved with another history read (reading other registers
+        # doesn't change the selected page), so the history is read as one sequence
+        # in the executor under the lock of the ATTiny class, like the blocking calls
+        return await self.run(self._attiny.read_history)
+
+    async def set_8bit_value(self, register, value):
+        # the write and the verification run as one sequence in the executor
+        return await self.run(self._attiny.set_8bit_value, register, value)
+
+    async def set_16bit_value(self, register, value):
+        return await self.run(self._attiny.set_16bit_value, register, value)
+
+    async def set_values(self, values):
+        return await self.run(self._attiny.set_values, values)
@@ -0,0 +1,156 @@
+import json
+import logging
+import os
+import socket
+import socketserver
+import threading
+import time
+
+# The daemon is the only process reading the ATTiny. It keeps a timestamped image of
+# the registers and serves it to local clients over a unix socket. The protocol uses
+# one JSON object per line:
+#   request {"cmd": "get"}       answer {"timestamp": t, "values": {...}}
+#   request {"cmd": "subscribe"} answer the full image, followed by a line with the
+#                                changed values whenever the image changes
+# t is the time of the last successful refresh (seconds since the epoch). The registers
+# of the ATTinys of other nodes (see BusWorker in attiny_daemon.py) are a dict of their
+# own in the image, under the name of the node ("<bus>:<address>", e.g. "1:0x38").
+
+DEFAULT_SOCKET = "/tmp/attiny_daemon.sock"
+
+
+class RegisterCache:
+    def __init__(self):
+        self._changed = threading.Condition()
+        self._values = {}
+        self._timestamp = 0.0
+        self._generation = 0    # incremented whenever a value changes
+        self._closed = False
+
+    def update(self, values, node=None):
+        # only valid values should be passed, the daemon filters the error values
+        with self._changed:
+            image = self._values if node is None else self._values.setdefault(node, {})
+            changed = any(image.get(key) != value for key, value in values.items())
+            image.update(values)
+            self._timestamp = time.time()
+            if changed:
+                self._generation += 1
+                self._changed.notify_all()
+
+    def get(self):
+        with self._changed:
+            return (self._generation, self._timestamp, self._copy())
+
+    def wait_for_change(self, generation, timeout):
+        # returns the same as get(), after the image changed or the timeout passed
+        with self._changed:
+            self._changed.wait_for(lambda: self._generation != generation or self._closed, timeout)
+            return (self._generation, self._timestamp, self._copy())
+
+    def _copy(self):
+        # the images of the nodes are copied as well, they are changed in place
+        return {key: dict(value) if isinstance(value, dict) else value for key, value in self._values.items()}
+
+    def close(self):
+        with self._changed:
+            self._closed = True
+            self._changed.notify_all()
+
+    @property
+    def closed(self):
+        return self._closed
+
+
+class _CacheRequestHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        try:
+            for line in self.rfile:
+                try:
+                    request = json.loads(line)
+                    command = request.get('cmd')
+                except (ValueError, AttributeError):
+                    self._send({'error': 'invalid request'})
+                    continue
+                if command == 'get':
+                    (_, timestamp, values) = self.server.cache.get()
+                    self._send({'timestamp': timestamp, 'values': values})
+                elif command == 'subscribe':
+                    self._subscribe()
+                    return
+                else:
+                    self._send({'error': 'unknown command ' + str(command)})
+        except (BrokenPipeError, ConnectionResetError):
+            logging.debug("Cache client disconnected")
+
+    def _subscribe(self):
+        cache = self.server.cache
+        (generation, timestamp, values) = cache.get()
+        self._send({'timestamp': timestamp, 'values': values})
+        while not cache.closed:
+            (generation, timestamp, current) = cache.wait_for_change(generation, 1.0)
+            changed = {key: value for key, value in current.items() if values.get(key) != value}
+            if changed:
+                self._send({'timestamp': timestamp, 'values': changed})
+                values = current
+
+    def _send(self, message):
+        self.wfile.write((json.dumps(message) + "\n").encode())
+        self.wfile.flush()
+
+
+class CacheServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+    def __init__(self, path, cache):
+        self.cache = cache
+        self.path = path
+        if os.path.exists(path):
+            # left over from a daemon that was killed
+            os.unlink(path)
+        super().__init__(path, _CacheRequestHandler)
+        os.chmod(path, 0o660)
+        self._thread = threading.Thread(target=self.serve_forever, name="attiny cache", daemon=True)
+
+    def start(self):
+        self._thread.start()
+
+    def close(self):
+        self.cache.close()
+        self.shutdown()
+        self.server_close()
+        try:
+            os.unlink(self.path)
+        except OSError:
+            pass
+
+
+def _connect(path, timeout):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.settimeout(timeout)
+    sock.connect(path)
+    return sock
+
+
+def read_cache(path=DEFAULT_SOCKET, max_age=60, timeout=1.0):
+    # returns the register image of the daemon as a dict, None if the daemon
+    # cannot be reached or the image is older than max_age seconds
+    try:
+        with _connect(path, timeout) as sock:
+            sock.sendall(b'{"cmd": "get"}\n')
+            answer = json.loads(sock.makefile('r').readline())
+    except (OSError, ValueError) as e:
+        logging.debug("Cannot read the register cache: " + str(e))
+        return None
+    if 'values' not in answer or (max_age is not None and time.time() - answer['timestamp'] > max_age):
+        return None
+    return answer['values']
+
+
+def subscribe(path=DEFAULT_SOCKET):
+    # yields (timestamp, values) tuples, first the full image, then the changed values
+    with _connect(path, None) as sock:
+        sock.sendall(b'{"cmd": "subscribe"}\n')
+        for line in sock.makefile('r'):
+            answer = json.loads(line)
+            yield (answer['timestamp'], answer['values'])
@@ -5,12 +5,17 @@ import os
 import sys
 import time
 import struct
+import select
+import threading
 from typing import Tuple, Any
 from configparser import ConfigParser
 from argparse import ArgumentParser, Namespace
 from collections.abc import Mapping
 from pathlib import Path
 from attiny_i2c import ATTiny
+from attiny_cache import RegisterCache, CacheServer, DEFAULT_SOCKET
+from attiny_mqtt import MqttPublisher
+from attiny_metrics import MetricsServer
 #from attiny_i2c_new import ATTiny
 
 ### Global configuration of the daemon. You should know what you do if you change
@@ -18,15 +23,18 @@ from attiny_i2c import ATTiny
 
 # Version information
 major = 2
-minor = 14
+minor = 18
 patch = 0
 
 # config file is in the same directory as the script:
 _configfile_default = str(Path(__file__).parent.absolute()) + "/attiny_daemon.cfg"
 _shutdown_cmd = "sudo systemctl poweroff"  # sudo allows us to start as user 'pi'
 _reboot_cmd  = "sudo systemctl reboot"     # sudo allows us to start as user 'pi'
-_time_const  = 1.0 # used as a pause between i2c communications, the ATTiny is slow
+_time_const  = 0.05 # the minimum gap between i2c communications, the ATTiny is slow
 _num_retries = 10  # the number of retries when reading from or writing to the ATTiny
+_slow_refresh = 15 # the thresholds in the register cache are refreshed every _slow_refresh loops
+_error_values = (0xFFFF, 0xFFFFFFFF, 0xFFFFFFFFFFFF)  # returned by the ATTiny class if a read failed
+_min_power_level = 4700 # mV, above this the external voltage is on (MIN_POWER_LEVEL of the firmware)
 
 # These are the different values reported back by the ATTiny depending on its config
 button_level = 2**3
@@ -42,7 +50,8 @@ shutdown_levels = {
     2**7: "Battery is at warn level. Shutting down.",
     (2**7 + 2): "Battery is at warn level, we cannot shut down. Trying again. Please verify 'sudo' works without password.",
 }
-# Here we store the button functions that are called depending on the configuration
+# Here we store the button functions that are called depending on the configuration.
+# Each gesture of the button (see Config.GESTURE_FUNCTIONS) can call its own function
 button_functions = {
     "nothing": lambda: logging.info("Button pressed. Configured to do nothing."),
     "shutdown": lambda: os.system(_shutdown_cmd),
@@ -77,18 +86,76 @@ def main(*args):
     logging.info("ATTiny firmware version " + str(a_major) + "." + str(a_minor) + "." + str(a_patch))
 
     if major != a_major:
-        logging.error("Daemon and Firmware major version mismatch. This might lead to serious problems. Check both versions.")
+        logging.error("Daemon and Firmware major version mismatch. This might lead to serious problems. Check both versions, the firmware can be updated with uploadFirmware.py.")
 
-    config.merge_and_sync_values(attiny)
+    # the remaining values are synced in the background while the main loop runs
+    sync_thread = config.merge_and_sync_values(attiny)
 
-    logging.info("Merging completed")
+    logging.info("Merging of the safety-critical values completed")
+
+    # wait for the attention line of the ATTiny if configured, otherwise we poll
+    attention = None
+    if config[Config.ATTENTION_GPIO] >= 0:
+        try:
+            attention = AttentionLine(config[Config.ATTENTION_GPIO])
+            logging.info("Waiting for the attention line on GPIO " + str(config[Config.ATTENTION_GPIO]))
+        except Exception as e:
+            logging.warning("Cannot use the attention line, falling back to polling: " + str(e))
+
+    # serve the registers to local clients, so they don't need to access the ATTiny
+    cache = RegisterCache()
+    server = None
+    if config[Config.CACHE_SOCKET]:
+        try:
+            server = CacheServer(config[Config.CACHE_SOCKET], cache)
+            server.start()
+            logging.info("Serving the register cache on " + config[Config.CACHE_SOCKET])
+        except Exception as e:
+            logging.warning("Cannot create the register cache socket: " + str(e))
+            server = None
+
+    # export the register cache to Prometheus if a port is configured
+    metrics = None
+    if config[Config.METRICS_PORT] > 0:
+        try:
+            metrics = MetricsServer(config[Config.METRICS_PORT], cache, BusWorker.node_name(attiny))
+            metrics.start()
+            logging.info("Serving the metrics on port " + str(config[Config.METRICS_PORT]))
+        except Exception as e:
+            logging.warning("Cannot serve the metrics: " + str(e))
+            metrics = None
+
+    # publish the register cache to MQTT if a broker is configured
+    publisher = None
+    if config[Config.MQTT_HOST]:
+        try:
+            publisher = MqttPublisher(cache, attiny, config[Config.MQTT_HOST], config[Config.MQTT_PORT],
+                                      config[Config.MQTT_TOPIC], config[Config.MQTT_CLIENT_ID],
+                                      config[Config.MQTT_USER], config[Config.MQTT_PASSWORD],
+                                      config[Config.MQTT_INTERVAL], config[Config.MQTT_ON_CHANGE],
+                                      config[Config.MQTT_HISTORY])
+            publisher.start()
+            logging.info("Publishing to MQTT broker " + config[Config.MQTT_HOST])
+        except Exception as e:
+            logging.warning("Cannot set up the MQTT output: " + str(e))
+            publisher = None
+
+    # the ATTinys of the other nodes are polled by one worker per bus
+    workers = []
+    for (bus, addresses) in config.nodes_by_bus().items():
+        worker = BusWorker(bus, addresses, config, cache, sync_thread)
+        worker.start()
+        workers.append(worker)
 
     # loop until stopped or error
     fast_exit = False
     set_unprimed = False
+    loops = 0
     try:
         while True:
-            should_shutdown = attiny.should_shutdown()
+            snapshot = refresh_cache(attiny, cache, loops % _slow_refresh == 0)
+            loops += 1
+            should_shutdown = snapshot['should_shutdown']
             if should_shutdown == 0xFFFF:
                 # We have a big problem
                 logging.error("Lost connection to ATTiny.")
@@ -109,13 +176,33 @@ def main(*args):
                     attiny.set_should_shutdown(SL_INITIATED) # we are shutting down
                     logging.info("shutting down now...")
                     os.system(_shutdown_cmd)
-                elif (should_shutdown | button_level) != 0:
-                    # we are executing the button command and setting the level to normal
+                elif (should_shutdown & button_level) != 0:
+                    # we are executing the function of the gesture and setting the level to normal
+                    gesture = attiny.get_button_gesture()
+                    attiny.set_button_gesture(ATTiny.GESTURE_NONE)
                     attiny.set_should_shutdown(0)
-                    button_functions[config[Config.BUTTON_FUNCTION]]()
+                    run_button_function(config, gesture)
+
+            if config[Config.SHUTDOWN_TIME] > 0:
+                # shut down early if the estimated remaining runtime of the battery is too low.
+                # The ATTiny reports 0 for a low battery even if it is charging, so this only
+                # applies while we run from the battery
+                time_to_shutdown = snapshot['time_to_shutdown']
+                ext_voltage = snapshot['ext_voltage']
+                on_battery = ext_voltage != 0xFFFFFFFF and ext_voltage < _min_power_level
+                if on_battery and time_to_shutdown != 0xFFFFFFFF and time_to_shutdown <= config[Config.SHUTDOWN_TIME]:
+                    logging.warning("Battery will be empty in " + str(time_to_shutdown) + " minutes. Shutting down.")
+                    attiny.set_should_shutdown(SL_INITIATED) # we are shutting down
+                    logging.info("shutting down now...")
+                    os.system(_shutdown_cmd)
 
-            logging.debug("Sleeping for " + str(config[Config.SLEEPTIME]) + " seconds.")
-            time.sleep(config[Config.SLEEPTIME])
+            if attention is not None:
+                # the timeout guarantees the regular access needed for the ATTiny timeout
+                logging.debug("Waiting for attention for at most " + str(config[Config.SLEEPTIME]) + " seconds.")
+                attention.wait(config[Config.SLEEPTIME])
+            else:
+                logging.debug("Sleeping for " + str(config[Config.SLEEPTIME]) + " seconds.")
+                time.sleep(config[Config.SLEEPTIME])
 
     except KeyboardInterrupt:
         logging.info("Terminating daemon: cleaning up and exiting")
@@ -132,7 +219,48 @@ def main(*args):
             if primed == False:
                 logging.info("Trying to reset primed flag")
                 attiny.set_primed(primed)
+            for worker in workers:
+                worker.stop(primed)
             del attiny
+        if attention is not None:
+            attention.close()
+        if publisher is not None:
+            publisher.stop()
+        if metrics is not None:
+            metrics.close()
+        if server is not None:
+            server.close()
+
+
+def run_button_function(config, gesture):
+    # calls the function configured for the gesture. Without a function for the gesture,
+    # or with a firmware that doesn't report gestures, the button function is used
+    option = Config.GESTURE_FUNCTIONS.get(gesture)
+    function = config[option] if option is not None and config[option] else config[Config.BUTTON_FUNCTION]
+    if function not in button_functions:
+        logging.warning("Unknown button function '" + function + "' for gesture " + str(gesture))
+        return
+    logging.info("Button gesture " + str(gesture) + ", executing '" + function + "'")
+    button_functions[function]()
+
+
+def refresh_cache(attiny, cache, full, node=None):
+    # reads the telemetry (and if full is set the thresholds) and updates the
+    # register cache with the values read correctly, those of another node under
+    # its name. Returns the telemetry with the error values of the ATTiny class
+    # for registers that couldn't be read
+    snapshot = attiny.get_snapshot()
+    values = dict(snapshot)
+    if full:
+        values['warn_voltage'] = attiny.get_warn_voltage()
+        values['ups_shutdown_voltage'] = attiny.get_ups_shutdown_voltage()
+        values['restart_voltage'] = attiny.get_restart_voltage()
+        values['mcu_status_register'] = attiny.get_mcu_status_register()
+        # None if the firmware is built without statistics
+        values.update(attiny.get_statistics() or {})
+    values.update(attiny.bus_statistics())
+    cache.update({key: value for key, value in values.items() if value not in _error_values}, node)
+    return snapshot
 
 
 def parse_cmdline(args: Tuple[Any]) -> Namespace:
@@ -179,10 +307,165 @@ class SystemdHandler(logging.Handler):
             self.handleError(record)
 
 
+class BusWorker(threading.Thread):
+    """
+    Polls the ATTinys of the other nodes on one I2C bus (option 'i2c nodes'), the ATTiny
+    of this RPi is handled by the main loop. The workers of different buses run
+    concurrently, a worker walks its ATTinys round-robin and spreads the polls evenly
+    over the sleeptime. This way every ATTiny is polled once per sleeptime (which resets
+    its timeout) independent of the number of nodes, and there is only one transfer of
+    the worker on the bus at a time. A node only gets the configuration written and its
+    shutdown levels logged, acting on them is up to the node itself.
+    """
+
+    def __init__(self, bus, addresses, config, cache, sync_thread):
+        super().__init__(name="i2c bus " + str(bus), daemon=True)
+        self._config = config
+        self._cache = cache
+        self._sync_thread = sync_thread
+        self._nodes = [ATTiny(bus, address, _time_const, _num_retries) for address in addresses]
+        self._should_shutdown = {}
+        self._stopped = threading.Event()
+
+    @staticmethod
+    def node_name(attiny):
+        return str(attiny.bus_number) + ":" + hex(attiny.address)
+
+    def run(self):
+        # the configuration is complete when the sync with the ATTiny of this RPi is done
+        if self._sync_thread is not None:
+            self._sync_thread.join()
+        for attiny in self._nodes:
+            try:
+                self._config.sync_node(attiny)
+            except Exception as e:
+                logging.warning("Couldn't sync node " + self.node_name(attiny) + ": " + str(e))
+
+        interval = self._config[Config.SLEEPTIME] / len(self._nodes)
+        loops = 0
+        while not self._stopped.is_set():
+            for attiny in self._nodes:
+                try:
+                    self._poll(attiny, loops % _slow_refresh == 0)
+                except Exception as e:
+                    logging.warning("Couldn't poll node " + self.node_name(attiny) + ": " + str(e))
+                if self._stopped.wait(interval):
+                    return
+            loops += 1
+
+    def _poll(self, attiny, full):
+        name = self.node_name(attiny)
+        should_shutdown = refresh_cache(attiny, self._cache, full, name)['should_shutdown']
+        if should_shutdown == self._should_shutdown.get(name):
+            return
+        self._should_shutdown[name] = should_shutdown
+        if should_shutdown == 0xFFFF:
+            logging.error("Lost connection to node " + name)
+        elif should_shutdown > SL_INITIATED:
+            fallback = "Unknown shutdown_level " + str(should_shutdown) + "."
+            logging.warning("Node " + name + ": " + shutdown_levels.get(should_shutdown, fallback))
+
+    def stop(self, primed):
+        # without primed the nodes must not be reset when they miss our polls
+        self._stopped.set()
+        self.join(_time_const * _num_retries + 1)
+        for attiny in self._nodes:
+            if primed == False:
+                logging.info("Trying to reset primed flag of node " + self.node_name(attiny))
+                attiny.set_primed(primed)
+            attiny.close()
+
+
+class AttentionLine:
+    """
+    The active-low attention line of the ATTiny (firmware option ATTENTION_LINE).
+    The ATTiny pulls the line low when should_shutdown or its state changes and
+    releases it when we read should_shutdown. We use gpiod (v1 or v2 API) if it
+    is installed, otherwise the sysfs interface. With sysfs the pull-up has to be
+    configured externally, e.g. with "gpio=<n>=ip,pu" in config.txt.
+    """
+    _CONSUMER = "attiny_daemon"
+    _SYSFS = "/sys/class/gpio/"
+
+    def __init__(self, gpio, chip="gpiochip0"):
+        self._gpio = gpio
+        self._request = None
+        self._line = None
+        self._value_file = None
+        try:
+            import gpiod
+        except ImportError:
+            gpiod = None
+
+        if gpiod is None:
+            self._open_sysfs()
+        elif hasattr(gpiod, "request_lines"):
+            # libgpiod v2
+            from gpiod.line import Bias, Edge
+            settings = gpiod.LineSettings(edge_detection=Edge.FALLING, bias=Bias.PULL_UP)
+            self._request = gpiod.request_lines("/dev/" + chip, consumer=self._CONSUMER,
+                                                config={gpio: settings})
+        else:
+            # libgpiod v1
+            self._line = gpiod.Chip(chip).get_line(gpio)
+            self._line.request(consumer=self._CONSUMER, type=gpiod.LINE_REQ_EV_FALLING_EDGE,
+                               flags=gpiod.LINE_REQ_FLAG_BIAS_PULL_UP)
+
+    def _open_sysfs(self):
+        if not os.path.isdir(self._SYSFS + "gpio" + str(self._gpio)):
+            with open(self._SYSFS + "export", "w") as f:
+                f.write(str(self._gpio))
+            time.sleep(0.1)  # udev needs some time to set the permissions
+        base = self._SYSFS + "gpio" + str(self._gpio) + "/"
+        with open(base + "direction", "w") as f:
+            f.write("in")
+        with open(base + "edge", "w") as f:
+            f.write("falling")
+        self._value_file = open(base + "value", "r")
+        self._poll = select.poll()
+        self._poll.register(self._value_file, select.POLLPRI | select.POLLERR)
+
+    def is_active(self):
+        if self._request is not None:
+            from gpiod.line import Value
+            return self._request.get_value(self._gpio) == Value.INACTIVE
+        if self._line is not None:
+            return self._line.get_value() == 0
+        self._value_file.seek(0)
+        return self._value_file.read().strip() == "0"
+
+    def wait(self, timeout):
+        # returns True if the ATTiny signals attention, False after the timeout.
+        # The line is level-triggered, so an edge we missed is no problem.
+        if self.is_active():
+            return True
+        if self._request is not None:
+            if self._request.wait_edge_events(timeout):
+                self._request.read_edge_events()
+        elif self._line is not None:
+            if self._line.event_wait(sec=int(timeout), nsec=int((timeout % 1) * 1e9)):
+                self._line.event_read()
+        else:
+            self._poll.poll(timeout * 1000)
+        return self.is_active()
+
+    def close(self):
+        try:
+            if self._request is not None:
+                self._request.release()
+            elif self._line is not None:
+                self._line.release()
+            elif self._value_file is not None:
+                self._value_file.close()
+        except Exception as e:
+            logging.debug("Couldn't release the attention line: " + str(e))
+
+
 class Config(Mapping):
     DAEMON_SECTION = "attinydaemon"
     I2C_BUS = 'i2c bus'
     I2C_ADDRESS = 'i2c address'
+    I2C_NODES = 'i2c nodes'
     TIMEOUT = 'timeout'
     SLEEPTIME = 'sleeptime'
     PRIMED = 'primed'
@@ -199,18 +482,39 @@ class Config(Mapping):
     RESTART_VOLTAGE = 'restart voltage'
     LOG_LEVEL = 'loglevel'
     BUTTON_FUNCTION = 'button function'
+    BUTTON_SHORT = 'button short press'
+    BUTTON_LONG = 'button long press'
+    BUTTON_DOUBLE = 'button double press'
     UPS_CONFIG = 'ups configuration'
     VEXT_SHUTDOWN = 'vext off is shutdown'
     PULSE_LENGTH = 'pulse length'
     PULSE_LENGTH_ON = 'pulse length on'
     PULSE_LENGTH_OFF = 'pulse length off'
     SW_RECOVERY_DELAY = 'switch recovery delay'
+    ATTENTION_GPIO = 'attention gpio'
+    DISCHARGE_CURVE = 'discharge curve'
+    SHUTDOWN_TIME = 'shutdown time'
+    BAT_V_FILTER = 'battery voltage filter'
+    CACHE_SOCKET = 'cache socket'
+    EXT_V_FILTER = 'external voltage filter'
+    T_FILTER = 'temperature filter'
+    METRICS_PORT = 'metrics port'
+    MQTT_HOST = 'mqtt host'
+    MQTT_PORT = 'mqtt port'
+    MQTT_TOPIC = 'mqtt topic'
+    MQTT_CLIENT_ID = 'mqtt client id'
+    MQTT_USER = 'mqtt user'
+    MQTT_PASSWORD = 'mqtt password'
+    MQTT_INTERVAL = 'mqtt interval'
+    MQTT_ON_CHANGE = 'mqtt on change'
+    MQTT_HISTORY = 'mqtt history'
 
     MAX_INT = sys.maxsize
     DEFAULT_CONFIG = {
         DAEMON_SECTION: {
             I2C_ADDRESS: '0x37',
             I2C_BUS: '1',
+            I2C_NODES: '',
             TIMEOUT: str(MAX_INT),
             SLEEPTIME: str(MAX_INT),
             PRIMED: 'False',
@@ -226,12 +530,32 @@ class Config(Mapping):
             UPS_SHUTDOWN_VOLTAGE: str(MAX_INT),
             RESTART_VOLTAGE: str(MAX_INT),
             BUTTON_FUNCTION: "nothing",
+            BUTTON_SHORT: "",
+            BUTTON_LONG: "",
+            BUTTON_DOUBLE: "",
             UPS_CONFIG: "0",
             VEXT_SHUTDOWN: 'False',
             PULSE_LENGTH: "200",
             PULSE_LENGTH_ON: "0",
             PULSE_LENGTH_OFF: "0",
             SW_RECOVERY_DELAY: "1000",
+            ATTENTION_GPIO: "-1",
+            DISCHARGE_CURVE: "",
+            SHUTDOWN_TIME: "0",
+            BAT_V_FILTER: str(MAX_INT),
+            CACHE_SOCKET: DEFAULT_SOCKET,
+            EXT_V_FILTER: str(MAX_INT),
+            T_FILTER: str(MAX_INT),
+            METRICS_PORT: "0",
+            MQTT_HOST: "",
+            MQTT_PORT: "1883",
+            MQTT_TOPIC: "attiny_daemon",
+            MQTT_CLIENT_ID: "",
+            MQTT_USER: "",
+            MQTT_PASSWORD: "",
+            MQTT_INTERVAL: "60",
+            MQTT_ON_CHANGE: 'False',
+            MQTT_HISTORY: 'True',
             LOG_LEVEL: 'DEBUG'
         }
     }
@@ -271,6 +595,8 @@ class Config(Mapping):
         try:
             self._storage[self.I2C_ADDRESS] = int(self.parser.get(self.DAEMON_SECTION, self.I2C_ADDRESS), 0)
             self._storage[self.I2C_BUS] = self.parser.getint(self.DAEMON_SECTION, self.I2C_BUS)
+            nodes = self.parser.get(self.DAEMON_SECTION, self.I2C_NODES)
+            self._storage[self.I2C_NODES] = [self._parse_node(node) for node in nodes.split(",") if node.strip()]
             self._storage[self.TIMEOUT] = self.parser.getint(self.DAEMON_SECTION, self.TIMEOUT)
             self._storage[self.SLEEPTIME] = self.parser.getint(self.DAEMON_SECTION, self.SLEEPTIME)
             self._storage[self.PRIMED] = self.parser.getboolean(self.DAEMON_SECTION, self.PRIMED)
@@ -286,18 +612,52 @@ class Config(Mapping):
             self._storage[self.UPS_SHUTDOWN_VOLTAGE] = self.parser.getint(self.DAEMON_SECTION, self.UPS_SHUTDOWN_VOLTAGE)
             self._storage[self.RESTART_VOLTAGE] = self.parser.getint(self.DAEMON_SECTION, self.RESTART_VOLTAGE)
             self._storage[self.BUTTON_FUNCTION] = self.parser.get(self.DAEMON_SECTION, self.BUTTON_FUNCTION)
+            self._storage[self.BUTTON_SHORT] = self.parser.get(self.DAEMON_SECTION, self.BUTTON_SHORT)
+            self._storage[self.BUTTON_LONG] = self.parser.get(self.DAEMON_SECTION, self.BUTTON_LONG)
+            self._storage[self.BUTTON_DOUBLE] = self.parser.get(self.DAEMON_SECTION, self.BUTTON_DOUBLE)
             self._storage[self.UPS_CONFIG] = int(self.parser.get(self.DAEMON_SECTION, self.UPS_CONFIG), 0)
             self._storage[self.VEXT_SHUTDOWN] = self.parser.getboolean(self.DAEMON_SECTION, self.VEXT_SHUTDOWN)
             self._storage[self.PULSE_LENGTH] = self.parser.getint(self.DAEMON_SECTION, self.PULSE_LENGTH)
             self._storage[self.PULSE_LENGTH_ON] = self.parser.getint(self.DAEMON_SECTION, self.PULSE_LENGTH_ON)
             self._storage[self.PULSE_LENGTH_OFF] = self.parser.getint(self.DAEMON_SECTION, self.PULSE_LENGTH_OFF)
             self._storage[self.SW_RECOVERY_DELAY] = self.parser.getint(self.DAEMON_SECTION, self.SW_RECOVERY_DELAY)
+            self._storage[self.ATTENTION_GPIO] = self.parser.getint(self.DAEMON_SECTION, self.ATTENTION_GPIO)
+            curve = self.parser.get(self.DAEMON_SECTION, self.DISCHARGE_CURVE)
+            self._storage[self.DISCHARGE_CURVE] = [int(v, 0) for v in curve.split(",")] if curve.strip() else None
+            self._storage[self.SHUTDOWN_TIME] = self.parser.getint(self.DAEMON_SECTION, self.SHUTDOWN_TIME)
+            self._storage[self.CACHE_SOCKET] = self.parser.get(self.DAEMON_SECTION, self.CACHE_SOCKET)
+            self._storage[self.BAT_V_FILTER] = int(self.parser.get(self.DAEMON_SECTION, self.BAT_V_FILTER), 0)
+            self._storage[self.EXT_V_FILTER] = int(self.parser.get(self.DAEMON_SECTION, self.EXT_V_FILTER), 0)
+            self._storage[self.T_FILTER] = int(self.parser.get(self.DAEMON_SECTION, self.T_FILTER), 0)
+            self._storage[self.METRICS_PORT] = self.parser.getint(self.DAEMON_SECTION, self.METRICS_PORT)
+            self._storage[self.MQTT_HOST] = self.parser.get(self.DAEMON_SECTION, self.MQTT_HOST)
+            self._storage[self.MQTT_PORT] = self.parser.getint(self.DAEMON_SECTION, self.MQTT_PORT)
+            self._storage[self.MQTT_TOPIC] = self.parser.get(self.DAEMON_SECTION, self.MQTT_TOPIC)
+            self._storage[self.MQTT_CLIENT_ID] = self.parser.get(self.DAEMON_SECTION, self.MQTT_CLIENT_ID)
+            self._storage[self.MQTT_USER] = self.parser.get(self.DAEMON_SECTION, self.MQTT_USER)
+            self._storage[self.MQTT_PASSWORD] = self.parser.get(self.DAEMON_SECTION, self.MQTT_PASSWORD)
+            self._storage[self.MQTT_INTERVAL] = self.parser.getint(self.DAEMON_SECTION, self.MQTT_INTERVAL)
+            self._storage[self.MQTT_ON_CHANGE] = self.parser.getboolean(self.DAEMON_SECTION, self.MQTT_ON_CHANGE)
+            self._storage[self.MQTT_HISTORY] = self.parser.getboolean(self.DAEMON_SECTION, self.MQTT_HISTORY)
             logging.getLogger().setLevel(self.parser.get(self.DAEMON_SECTION, self.LOG_LEVEL))
             logging.debug("config variables are set")
         except Exception as e:
             logging.error("Cannot convert option: " + str(e))
             exit(1)
 
+    def _parse_node(self, node):
+        # a node is "<address>" on the i2c bus or "<bus>:<address>"
+        (bus, _, address) = node.strip().rpartition(":")
+        bus = int(bus) if bus else self._storage[self.I2C_BUS]
+        return (bus, int(address, 0))
+
+    def nodes_by_bus(self):
+        # the addresses of the other nodes for each bus, in the configured order
+        buses = {}
+        for (bus, address) in self._storage[self.I2C_NODES]:
+            buses.setdefault(bus, []).append(address)
+        return buses
+
     def write_config(self):
         try:
             cfgfile = open(self.configfile_name, 'w')
@@ -318,149 +678,178 @@ class Config(Mapping):
             logging.warning("Sleeptime is low. Ensure that the Raspberry can boot in " + str(sleeptime) + " seconds or change the config file.")
         return sleeptime
 
+    # The options with the button function of each gesture, empty options use the button function
+    GESTURE_FUNCTIONS = {
+        ATTiny.GESTURE_SHORT: BUTTON_SHORT,
+        ATTiny.GESTURE_LONG: BUTTON_LONG,
+        ATTiny.GESTURE_DOUBLE: BUTTON_DOUBLE,
+    }
+
+    # The registers synced with the ATTiny as (config key, register, size, with timeout).
+    # Registers marked with timeout are taken from the ATTiny if the timeout is not
+    # configured, the others if their own value is not configured.
+    # The safety and threshold registers are needed for the shutdown protection and
+    # are synced before the main loop starts, the voltage thresholds in their own batch
+    # to never have a mix of old and new thresholds. The others are synced in the background.
+    SAFETY_REGISTERS = (
+        (TIMEOUT, ATTiny.REG_TIMEOUT, 1, True),
+        (PRIMED, ATTiny.REG_PRIMED, 1, True),
+        (FORCE_SHUTDOWN, ATTiny.REG_FORCE_SHUTDOWN, 1, True),
+    )
+    THRESHOLD_REGISTERS = (
+        (WARN_VOLTAGE, ATTiny.REG_WARN_VOLTAGE, 2, False),
+        (UPS_SHUTDOWN_VOLTAGE, ATTiny.REG_UPS_SHUTDOWN_VOLTAGE, 2, False),
+        (RESTART_VOLTAGE, ATTiny.REG_RESTART_VOLTAGE, 2, False),
+    )
+    BACKGROUND_REGISTERS = (
+        (LED_OFF_MODE, ATTiny.REG_LED_OFF_MODE, 1, True),
+        (UPS_CONFIG, ATTiny.REG_UPS_CONFIG, 1, True),
+        (PULSE_LENGTH, ATTiny.REG_PULSE_LENGTH, 2, True),
+        (PULSE_LENGTH_ON, ATTiny.REG_PULSE_LENGTH_ON, 2, True),
+        (PULSE_LENGTH_OFF, ATTiny.REG_PULSE_LENGTH_OFF, 2, True),
+        (SW_RECOVERY_DELAY, ATTiny.REG_SW_RECOVERY_DELAY, 2, True),
+        (VEXT_SHUTDOWN, ATTiny.REG_VEXT_OFF_IS_SHUTDOWN, 1, True),
+        (BAT_V_COEFFICIENT, ATTiny.REG_BAT_V_COEFFICIENT, 2, False),
+        (BAT_V_CONSTANT, ATTiny.REG_BAT_V_CONSTANT, 2, False),
+        (EXT_V_COEFFICIENT, ATTiny.REG_EXT_V_COEFFICIENT, 2, False),
+        (EXT_V_CONSTANT, ATTiny.REG_EXT_V_CONSTANT, 2, False),
+        (T_COEFFICIENT, ATTiny.REG_T_COEFFICIENT, 2, False),
+        (T_CONSTANT, ATTiny.REG_T_CONSTANT, 2, False),
+        (BAT_V_FILTER, ATTiny.REG_BAT_V_FILTER, 1, False),
+        (EXT_V_FILTER, ATTiny.REG_EXT_V_FILTER, 1, False),
+        (T_FILTER, ATTiny.REG_T_FILTER, 1, False),
+    )
+
     # not the perfect place for the method, but good enough
     def merge_and_sync_values(self, attiny):
+        # syncs the registers needed for the shutdown protection and returns the
+        # started thread syncing the others, None if the ATTiny already has the
+        # configured values
         logging.debug("Merge Values and save if necessary")
-        changed_config = False
-
-        attiny_primed = attiny.get_primed()
-        attiny_timeout = attiny.get_timeout()
-        attiny_force_shutdown = attiny.get_force_shutdown()
-        attiny_led_off_mode = attiny.get_led_off_mode()
-        attiny_ups_configuration = attiny.get_ups_configuration()
-        attiny_pulse_length = attiny.get_pulse_length()
-        attiny_pulse_length_on = attiny.get_pulse_length_on()
-        attiny_pulse_length_off = attiny.get_pulse_length_off()
-        attiny_switch_recovery_delay = attiny.get_switch_recovery_delay()
-        attiny_vext_off_is_shutdown = attiny.get_vext_off_is_shutdown()
-
-
-        if self._storage[self.TIMEOUT] == self.MAX_INT:
-            # timeout was not set in the config file
-            # we will get timeout, primed, ups configuration, 
-            # pulse length, pulse length on, pulse length off,
-            # switch recovery delay, vext_is_shutdown and
-            # force_shutdown from the ATTiny
-            logging.debug("Getting Timeout from ATTiny")
-            self._storage[self.PRIMED] = attiny_primed
-            self._storage[self.TIMEOUT] = attiny_timeout
-            self._storage[self.FORCE_SHUTDOWN] = attiny_force_shutdown
-            self._storage[self.LED_OFF_MODE] = attiny_led_off_mode
-            self._storage[self.UPS_CONFIG] = attiny_ups_configuration
-            self._storage[self.PULSE_LENGTH] = attiny_pulse_length
-            self._storage[self.PULSE_LENGTH_ON] = attiny_pulse_length_on
-            self._storage[self.PULSE_LENGTH_OFF] = attiny_pulse_length_off
-            self._storage[self.SW_RECOVERY_DELAY] = attiny_switch_recovery_delay
-            self._storage[self.VEXT_SHUTDOWN] = attiny_vext_off_is_shutdown
-
-            self.parser.set(self.DAEMON_SECTION, self.TIMEOUT,
-                            str(self._storage[self.TIMEOUT]))
-            self.parser.set(self.DAEMON_SECTION, self.PRIMED,
-                            str(self._storage[self.PRIMED]))
-            self.parser.set(self.DAEMON_SECTION, self.FORCE_SHUTDOWN,
-                            str(self._storage[self.FORCE_SHUTDOWN]))
-            self.parser.set(self.DAEMON_SECTION, self.LED_OFF_MODE,
-                            str(self._storage[self.LED_OFF_MODE]))
-            self.parser.set(self.DAEMON_SECTION, self.UPS_CONFIG,
-                            str(self._storage[self.UPS_CONFIG]))
-            self.parser.set(self.DAEMON_SECTION, self.PULSE_LENGTH,
-                            str(self._storage[self.PULSE_LENGTH]))
-            self.parser.set(self.DAEMON_SECTION, self.PULSE_LENGTH_ON,
-                            str(self._storage[self.PULSE_LENGTH_ON]))
-            self.parser.set(self.DAEMON_SECTION, self.PULSE_LENGTH_OFF,
-                            str(self._storage[self.PULSE_LENGTH_OFF]))
-            self.parser.set(self.DAEMON_SECTION, self.SW_RECOVERY_DELAY,
-                            str(self._storage[self.SW_RECOVERY_DELAY]))
-            self.parser.set(self.DAEMON_SECTION, self.VEXT_SHUTDOWN,
-                            str(self._storage[self.VEXT_SHUTDOWN]))
-            changed_config = True
-        else:
-            if attiny_timeout != self._storage[self.TIMEOUT]:
-                logging.debug("Writing Timeout to ATTiny")
-                attiny.set_timeout(self._storage[self.TIMEOUT])
-            if attiny_primed != self._storage[self.PRIMED]:
-                logging.debug("Writing Primed to ATTiny")
-                attiny.set_primed(self._storage[self.PRIMED])
-            if attiny_force_shutdown != self._storage[self.FORCE_SHUTDOWN]:
-                logging.debug("Writing Force_Shutdown to ATTiny")
-                attiny.set_force_shutdown(self._storage[self.FORCE_SHUTDOWN])
-            if attiny_led_off_mode != self._storage[self.LED_OFF_MODE]:
-                logging.debug("Writing LED_Off_Mode to ATTiny")
-                attiny.set_led_off_mode(self._storage[self.LED_OFF_MODE])
-            if attiny_ups_configuration != self._storage[self.UPS_CONFIG]:
-                logging.debug("Writing UPS Configuration to ATTiny")
-                attiny.set_ups_configuration(self._storage[self.UPS_CONFIG])
-            if attiny_pulse_length != self._storage[self.PULSE_LENGTH]:
-                logging.debug("Writing Pulse Length to ATTiny")
-                attiny.set_pulse_length(self._storage[self.PULSE_LENGTH])
-            if attiny_pulse_length_on != self._storage[self.PULSE_LENGTH_ON]:
-                logging.debug("Writing Pulse Length On to ATTiny")
-                attiny.set_pulse_length_on(self._storage[self.PULSE_LENGTH_ON])
-            if attiny_pulse_length_off != self._storage[self.PULSE_LENGTH_OFF]:
-                logging.debug("Writing Pulse Length Off to ATTiny")
-                attiny.set_pulse_length_off(self._storage[self.PULSE_LENGTH_OFF])
-            if attiny_switch_recovery_delay != self._storage[self.SW_RECOVERY_DELAY]:
-                logging.debug("Writing Switch Recovery Delay to ATTiny")
-                attiny.set_switch_recovery_delay(self._storage[self.SW_RECOVERY_DELAY])
-            if attiny_vext_off_is_shutdown != self._storage[self.VEXT_SHUTDOWN]:
-                logging.debug("Writing Vext off is Shutdown to ATTiny")
-                attiny.set_vext_off_is_shutdown(self._storage[self.VEXT_SHUTDOWN])
-
-        # check for max_int and only set if sleeptime is set to that value
-        if self._storage[self.SLEEPTIME] == self.MAX_INT:
-            logging.debug("Sleeptime not set, calculating from timeout value")
-            self._storage[self.SLEEPTIME] = self.calc_sleeptime(self._storage[self.TIMEOUT])
-            self.parser.set(self.DAEMON_SECTION, self.SLEEPTIME,
-                            str(self._storage[self.SLEEPTIME]))
-            logging.debug(self._storage[self.SLEEPTIME])
+        config_hash = self.config_hash(attiny)
+        if config_hash is not None and config_hash == attiny.get_config_hash():
+            logging.debug("Config hash " + hex(config_hash) + " matches, nothing to sync")
+            # the timeout is configured if the hash exists, the sleeptime may still be open
+            if self._derive_sleeptime():
+                self.write_config()
+            return None
+
+        timeout_unset = self._storage[self.TIMEOUT] == self.MAX_INT
+        changed_config = self._sync_registers(attiny, self.SAFETY_REGISTERS, timeout_unset)
+        if self._sync_registers(attiny, self.THRESHOLD_REGISTERS, timeout_unset):
             changed_config = True
-
-        if self._sync_Voltage(self.WARN_VOLTAGE, attiny, attiny.REG_WARN_VOLTAGE):
-            changed_config = True
-
-        if self._sync_Voltage(self.UPS_SHUTDOWN_VOLTAGE, attiny, attiny.REG_UPS_SHUTDOWN_VOLTAGE):
-            changed_config = True
-
-        if self._sync_Voltage(self.RESTART_VOLTAGE, attiny, attiny.REG_RESTART_VOLTAGE):
-            changed_config = True
-
-        if self._sync_Voltage(self.BAT_V_COEFFICIENT, attiny, attiny.REG_BAT_V_COEFFICIENT):
+        if self._derive_sleeptime():
             changed_config = True
 
-        if self._sync_Voltage(self.BAT_V_CONSTANT, attiny, attiny.REG_BAT_V_CONSTANT):
-            changed_config = True
-
-        if self._sync_Voltage(self.EXT_V_COEFFICIENT, attiny, attiny.REG_EXT_V_COEFFICIENT):
-            changed_config = True
-
-        if self._sync_Voltage(self.EXT_V_CONSTANT, attiny, attiny.REG_EXT_V_CONSTANT):
-            changed_config = True
-
-        if self._sync_Voltage(self.T_COEFFICIENT, attiny, attiny.REG_T_COEFFICIENT):
-            changed_config = True
-
-        if self._sync_Voltage(self.T_CONSTANT, attiny, attiny.REG_T_CONSTANT):
-            changed_config = True
+        thread = threading.Thread(target=self._sync_background, args=(attiny, timeout_unset, changed_config),
+                                  name="config sync", daemon=True)
+        thread.start()
+        return thread
+
+    def _derive_sleeptime(self):
+        # check for max_int and only set if sleeptime is set to that value,
+        # needs the timeout. Returns True if the config has been changed
+        if self._storage[self.SLEEPTIME] != self.MAX_INT:
+            return False
+        logging.debug("Sleeptime not set, calculating from timeout value")
+        self._storage[self.SLEEPTIME] = self.calc_sleeptime(self._storage[self.TIMEOUT])
+        self.parser.set(self.DAEMON_SECTION, self.SLEEPTIME,
+                        str(self._storage[self.SLEEPTIME]))
+        logging.debug(self._storage[self.SLEEPTIME])
+        return True
+
+    def _sync_background(self, attiny, timeout_unset, changed_config):
+        try:
+            if self._sync_registers(attiny, self.BACKGROUND_REGISTERS, timeout_unset):
+                changed_config = True
+            if self._sync_Discharge_Curve(attiny):
+                changed_config = True
+            logging.debug("Background sync completed")
+        except Exception as e:
+            logging.warning("Background sync failed: " + str(e))
 
         if changed_config:
             logging.debug("Writing new config file")
             self.write_config()
 
-    def _sync_Voltage(self, voltage_type, attiny, attiny_reg):
-        attiny_voltage = attiny.get_16bit_value(attiny_reg)
-        if self._storage[voltage_type] == self.MAX_INT:
-            logging.debug("Getting Register " + hex(attiny_reg) + " from ATTiny")
-            self._storage[voltage_type] = attiny_voltage
-            self.parser.set(self.DAEMON_SECTION, voltage_type,
-                            str(self._storage[voltage_type]))
-            changed_config = True
-        else:
-            changed_config = False
-            if attiny_voltage != self._storage[voltage_type]:
-                logging.debug("Writing Register " + hex(attiny_reg) + " to ATTiny")
-                attiny.set_16bit_value(attiny_reg, self._storage[voltage_type])
+    def _sync_registers(self, attiny, registers, timeout_unset):
+        # takes the values that are not configured from the ATTiny and writes the
+        # configured values that differ. Returns True if the config has been changed
+        changed_config = False
+        writes = []
+        for (key, register, size, with_timeout) in registers:
+            if size == 1:
+                attiny_value = attiny.get_8bit_value(register)
+            else:
+                attiny_value = attiny.get_16bit_value(register)
+            if (with_timeout and timeout_unset) or self._storage[key] == self.MAX_INT:
+                if attiny_value in (0xFFFF, 0xFFFFFFFF):
+                    logging.warning("Couldn't get " + key + " from ATTiny")
+                    continue
+                logging.debug("Getting " + key + " from ATTiny")
+                self._storage[key] = attiny_value
+                self.parser.set(self.DAEMON_SECTION, key, str(attiny_value))
+                changed_config = True
+            elif attiny_value != self._storage[key]:
+                logging.debug("Writing " + key + " to ATTiny")
+                writes.append((register, int(self._storage[key]), size))
+
+        if writes:
+            logging.debug("Writing " + str(len(writes)) + " values to ATTiny")
+            if not attiny.set_values(writes):
+                logging.warning("Couldn't write the configuration to the ATTiny")
         return changed_config
 
+    def sync_node(self, attiny):
+        # writes the configuration to the ATTiny of another node. Called after the sync
+        # with the ATTiny of this RPi, which provided the values that aren't configured
+        config_hash = self.config_hash(attiny)
+        if config_hash is not None and config_hash == attiny.get_config_hash():
+            logging.debug("Config hash of node " + hex(attiny.address) + " matches, nothing to sync")
+            return
+        writes = [(register, int(self._storage[key]), size)
+                  for (key, register, size, _) in self.SAFETY_REGISTERS + self.THRESHOLD_REGISTERS + self.BACKGROUND_REGISTERS
+                  if self._storage[key] != self.MAX_INT]
+        curve = self._storage[self.DISCHARGE_CURVE]
+        if curve is not None and len(curve) == attiny.DISCHARGE_CURVE_POINTS:
+            writes += [(attiny.REG_DISCHARGE_CURVE + i, value, 2) for i, value in enumerate(curve)]
+        logging.debug("Writing " + str(len(writes)) + " values to node " + hex(attiny.address))
+        if not attiny.set_values(writes):
+            logging.warning("Couldn't write the configuration to node " + hex(attiny.address))
+
+    def config_hash(self, attiny):
+        # the checksum the ATTiny calculates over its EEPROM registers, calculated
+        # over the configured values. None if a value is not configured
+        values = [(attiny.REG_I2C_ADDRESS, attiny.address, 1)]
+        for (key, register, size, _) in self.SAFETY_REGISTERS + self.THRESHOLD_REGISTERS + self.BACKGROUND_REGISTERS:
+            if self._storage[key] == self.MAX_INT:
+                return None
+            values.append((register, self._storage[key], size))
+        curve = self._storage[self.DISCHARGE_CURVE]
+        if curve is None or len(curve) != attiny.DISCHARGE_CURVE_POINTS:
+            return None
+        values += [(attiny.REG_DISCHARGE_CURVE + i, value, 2) for i, value in enumerate(curve)]
+        return attiny.calc_config_hash(values)
+
+    def _sync_Discharge_Curve(self, attiny):
+        attiny_curve = attiny.get_discharge_curve()
+        if self._storage[self.DISCHARGE_CURVE] is None:
+            logging.debug("Getting Discharge Curve from ATTiny")
+            self._storage[self.DISCHARGE_CURVE] = attiny_curve
+            self.parser.set(self.DAEMON_SECTION, self.DISCHARGE_CURVE,
+                            ", ".join(str(v) for v in attiny_curve))
+            return True
+        if len(self._storage[self.DISCHARGE_CURVE]) != attiny.DISCHARGE_CURVE_POINTS:
+            logging.warning("The discharge curve needs " + str(attiny.DISCHARGE_CURVE_POINTS) + " values, ignoring it")
+            return False
+        writes = []
+        for i, value in enumerate(self._storage[self.DISCHARGE_CURVE]):
+            if attiny_curve[i] != value:
+                logging.debug("Writing Discharge Curve point " + str(i) + " to ATTiny")
+                writes.append((attiny.REG_DISCHARGE_CURVE + i, value, 2))
+        if writes and not attiny.set_values(writes):
+            logging.warning("Couldn't write the discharge curve to the ATTiny")
+        return False
 
 if __name__ == '__main__':
     main(*sys.argv[1:])
@@ -5,11 +5,14 @@ import paho.mqtt.client as mqtt
 import logging
 
 from attiny_i2c import ATTiny
+from attiny_cache import read_cache
 
 # This short script logs the current temperature and battery voltage to MQTT in JSON-format.
 # Change the following settings to your needs and add the following line to the
 # crontab of the user pi (without the leading hash-sign):
 # * * * * * /opt/attiny_daemon/attiny_daemon_mqtt_status.py
+# The daemon has a built-in MQTT output with a persistent connection (see the mqtt options
+# in attiny_daemon.cfg and attiny_mqtt.py), this script is only needed without the daemon.
 
 # Settings specific to MQTT
 _topic = "topic"
@@ -22,7 +25,7 @@ _password = None
 _additional_info = None
 
 # Settings specific to ATTiny_Daemon
-_time_const = 1.0   # used as a pause between i2c communications, the ATTiny is slow
+_time_const = 0.05   # the minimum gap between i2c communications, the ATTiny is slow
 _num_retries = 10   # the number of retries when reading from or writing to the ATTiny_Daemon
 _i2c_address = 0x37 # the I2C address that is used for the ATTiny_Daemon
 
@@ -37,13 +40,15 @@ def get_uptime():
 root_log = logging.getLogger()
 root_log.setLevel("INFO")
 
-# set up communication to the ATTiny_Daemon
-bus = 1
-attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
-
 # access data, an error is signalled by a return value of 0xFFFFFFFF/4294967295
-temperature = str(attiny.get_temperature())
-voltage = str(attiny.get_bat_voltage())
+# use the register cache of the daemon and only if it isn't running access the ATTiny
+snapshot = read_cache()
+if snapshot is None:
+    bus = 1
+    attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
+    snapshot = attiny.get_snapshot()
+temperature = str(snapshot.get('temperature', 0xFFFFFFFF))
+voltage = str(snapshot.get('bat_voltage', 0xFFFFFFFF))
 uptime = str(get_uptime())
 
 #build output
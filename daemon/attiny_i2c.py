@@ -4,12 +4,51 @@ import sys
 import time
 import smbus
 import struct
+import threading
 from typing import Tuple, Any
 from configparser import ConfigParser
 from argparse import ArgumentParser, Namespace
 from collections.abc import Mapping
 from pathlib import Path
 
+def _crc8_table(polynome):
+    # precompute the CRC register for every possible byte value
+    table = []
+    for crc in range(0, 256):
+      for bitnumber in range(0,8):
+        if crc & 0x80 : crc = ( crc << 1 ) ^ polynome
+        else          : crc = ( crc << 1 )
+      table.append(crc & 0xFF)
+    return bytes(table)
+
+def read_hex_file(path):
+    # reads a firmware image in the Intel HEX format (as written by the Arduino IDE),
+    # returns the bytes from address 0 with the gaps filled with 0xFF
+    image = bytearray()
+    with open(path, 'r') as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            if not line.startswith(':'):
+                raise ValueError("Not an Intel HEX record: " + line)
+            record = bytes.fromhex(line[1:])
+            if len(record) < 5 or len(record) != record[0] + 5 or sum(record) & 0xFF != 0:
+                raise ValueError("Broken Intel HEX record: " + line)
+            address = int.from_bytes(record[1:3], byteorder='big')
+            record_type = record[3]
+            data = record[4:-1]
+            if record_type == 0x00:
+                if len(image) < address + len(data):
+                    image += b'\xFF' * (address + len(data) - len(image))
+                image[address:address + len(data)] = data
+            elif record_type == 0x01:
+                break
+            elif record_type in (0x02, 0x04) and any(data):
+                # extended addresses are beyond the 8K of the ATTiny
+                raise ValueError("Address out of range: " + line)
+    return bytes(image)
+
 class ATTiny:
     REG_LAST_ACCESS          = 0x01
     REG_BAT_VOLTAGE          = 0x11
@@ -18,23 +57,31 @@ class ATTiny:
     REG_BAT_V_CONSTANT       = 0x14
     REG_EXT_V_COEFFICIENT    = 0x15
     REG_EXT_V_CONSTANT       = 0x16
+    REG_BAT_V_FILTER         = 0x17
+    REG_EXT_V_FILTER         = 0x18
     REG_TIMEOUT              = 0x21
     REG_PRIMED               = 0x22
     REG_SHOULD_SHUTDOWN      = 0x23
     REG_FORCE_SHUTDOWN       = 0x24
     REG_LED_OFF_MODE         = 0x25
+    REG_BUTTON_GESTURE       = 0x26
     REG_RESTART_VOLTAGE      = 0x31
     REG_WARN_VOLTAGE         = 0x32
     REG_UPS_SHUTDOWN_VOLTAGE = 0x33
     REG_TEMPERATURE          = 0x41
     REG_T_COEFFICIENT        = 0x42
     REG_T_CONSTANT           = 0x43
+    REG_T_FILTER             = 0x44
     REG_UPS_CONFIG           = 0x51
     REG_PULSE_LENGTH         = 0x52
     REG_SW_RECOVERY_DELAY    = 0x53
     REG_VEXT_OFF_IS_SHUTDOWN = 0x54
     REG_PULSE_LENGTH_ON      = 0x55
     REG_PULSE_LENGTH_OFF     = 0x56
+    REG_I2C_ADDRESS          = 0x57
+    REG_DISCHARGE_CURVE      = 0x61
+    REG_STATE_OF_CHARGE      = 0x69
+    REG_TIME_TO_SHUTDOWN     = 0x6A
     REG_VERSION              = 0x80
     REG_FUSE_LOW             = 0x81
     REG_FUSE_HIGH            = 0x82
@@ -42,27 +89,214 @@ class ATTiny:
     REG_INTERNAL_STATE       = 0x84
     REG_UPTIME               = 0x85
     REG_MCU_STATUS_REG       = 0x86
+    REG_SNAPSHOT             = 0x87
+    REG_HISTORY_COUNT        = 0x88
+    REG_HISTORY              = 0x89
+    REG_WAKEUP_INTERVAL      = 0x8A
+    REG_BATCH_WRITE          = 0x8B
+    REG_STATISTICS           = 0x8C
+    REG_CONFIG_HASH          = 0x8D
+    REG_BOOTLOADER           = 0x8E
     REG_INIT_EEPROM          = 0xFF
 
     _POLYNOME = 0x31
+    _CRC_TABLE = _crc8_table(_POLYNOME)
+
+    # layout of the snapshot register: bat voltage, ext voltage, temperature, seconds,
+    # state, should_shutdown, uptime, state of charge and time to shutdown (little
+    # endian, 16-bit values are signed)
+    _SNAPSHOT_FORMAT = '<hhhhBBIBh'
+    _SNAPSHOT_FIELDS = ('bat_voltage', 'ext_voltage', 'temperature', 'last_access',
+                        'internal_state', 'should_shutdown', 'uptime', 'state_of_charge',
+                        'time_to_shutdown')
+    _SNAPSHOT_ERROR = (0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF,
+                       0xFFFF, 0xFFFF, 0xFFFFFFFFFFFF, 0xFFFF, 0xFFFFFFFF)
+
+    # a history page is the page number followed by 5 entries (bat, ext, temperature)
+    _HISTORY_PAGE_ENTRIES = 5
+    _HISTORY_ENTRY_SIZE = 3
+
+    # a batch write frame (register, count, pairs, crc) has to fit into the I2C buffer
+    # of the ATTiny. Reading the batch register returns the status of the last batch
+    _BATCH_FRAME_SIZE = 16
+    _BATCH_APPLIED = 1
+
+    # layout of the statistics register: wake time avg/max, I2C callback time avg/max (us),
+    # I2C transactions, crc errors, oversized frames and EEPROM writes
+    _STATISTICS_FORMAT = '<HHHHHBBH'
+    _STATISTICS_FIELDS = ('wake_time_avg', 'wake_time_max', 'isr_time_avg', 'isr_time_max',
+                          'i2c_transactions', 'crc_errors', 'oversized_frames', 'eeprom_writes')
+
+    # the I2C bootloader (see firmware/ATTinyBoot), the firmware starts it in the running
+    # (or unclear) state if _BOOTLOADER_MAGIC is written to REG_BOOTLOADER. It takes the
+    # firmware in chunks and writes a page when its CRC matches. The reset page is the last
+    # page of the firmware, it holds the reset vector and is written last
+    _BOOTLOADER_MAGIC = 0xB7
+    _BOOT_IDENT = 0xB0
+    _BOOT_CHUNK = 0xB1
+    _BOOT_PAGE = 0xB2
+    _BOOT_EXIT = 0xB3
+    _BOOT_SIGNATURE = 0xB7
+    _BOOT_WRITTEN = 1
+    _BOOTLOADER_START = 0x1C00
+    _FLASH_PAGE_SIZE = 64
+    _BOOT_CHUNK_SIZE = 16
+    _WARN_STATE = 8
+
+    # the filter registers hold the mode in bits 7-6 and the parameter in bits 3-0
+    FILTER_NONE = 0x00
+    FILTER_EMA = 0x40
+    FILTER_MEDIAN = 0x80
+    FILTER_FAST_ATTACK = 0xC0
+
+    # the discharge curve consists of 8 voltages (registers 0x61 - 0x68) from a full
+    # to an empty battery. The time to shutdown is TIME_UNKNOWN if the battery is
+    # not discharging
+    DISCHARGE_CURVE_POINTS = 8
+    TIME_UNKNOWN = 0x7FFF
+
+    # the gestures reported in the button gesture register, we write GESTURE_NONE
+    # after acting on a gesture
+    GESTURE_NONE = 0
+    GESTURE_SHORT = 1
+    GESTURE_LONG = 2
+    GESTURE_DOUBLE = 3
+
+    # the ATTiny takes over a new I2C address with the first access on it, without this
+    # access it drops the new address after the handover timeout (5s)
+    I2C_MIN_ADDRESS = 0x08
+    I2C_MAX_ADDRESS = 0x77
+    I2C_DEFAULT_ADDRESS = 0x37
+
+    # the compile options of the firmware reported in the highest byte of the version register
+    OPTION_STATISTICS = 0x01
+    OPTION_EXT_VOLTAGE_COMPARATOR = 0x02
+    OPTION_I2C_BOOTLOADER = 0x04
+
+    # the counters of bus_statistics(): all transfers, the retries among them, the
+    # transfers that failed on the bus and the reads with a wrong CRC
+    _BUS_STATISTICS_FIELDS = ('i2c_transfers', 'i2c_retries', 'i2c_bus_errors', 'i2c_crc_errors')
+
+    # the upper limit for the pause between retries (exponential backoff)
+    _MAX_BACKOFF = 2.0
 
     def __init__(self, bus_number, address, time_const, num_retries):
         self._bus_number = bus_number
         self._address = address
         self._time_const = time_const
         self._num_retries = num_retries
+        self._bus = None
+        self._last_transfer = 0.0
+        # the daemon uses the ATTiny from several threads, the lock guarantees
+        # that transfers and sequences of transfers are not interleaved
+        self._lock = threading.RLock()
+        # the counters of the transfers, see bus_statistics()
+        self._statistics = dict.fromkeys(self._BUS_STATISTICS_FIELDS, 0)
+        self._statistics_lock = threading.Lock()
+        # the compile options of the firmware from the version register, see get_build_options()
+        self._build_options = None
+
+    @property
+    def bus_number(self):
+        return self._bus_number
+
+    @property
+    def address(self):
+        return self._address
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    def close(self):
+        if self._bus is not None:
+            try:
+                self._bus.close()
+            except Exception as e:
+                logging.debug("Couldn't close the I2C bus. Exception: " + str(e))
+            self._bus = None
+
+    def _pace(self, attempt):
+        # the ATTiny is slow, we guarantee a minimum gap since the last transfer
+        # which is doubled with every retry
+        gap = max(self._time_const, min(self._time_const * (2 ** attempt), self._MAX_BACKOFF))
+        wait = self._last_transfer + gap - time.monotonic()
+        if wait > 0:
+            time.sleep(wait)
+
+    def _transfer(self, attempt, function, *args):
+        # execute a transfer on the long-lived bus handle. On errors the handle is
+        # closed and reopened with the next transfer
+        with self._lock:
+            self._pace(attempt)
+            self._count('i2c_transfers')
+            if attempt > 0:
+                self._count('i2c_retries')
+            try:
+                if self._bus is None:
+                    self._bus = smbus.SMBus(self._bus_number)
+                return function(self._bus, *args)
+            except Exception:
+                self._count('i2c_bus_errors')
+                self.close()
+                raise
+            finally:
+                self._last_transfer = time.monotonic()
+
+    def _probe(self, address):
+        # True if a device acknowledges the address (a single byte read like i2cdetect).
+        # No answer is the expected result, so it is not counted as bus error
+        with self._lock:
+            self._pace(0)
+            try:
+                if self._bus is None:
+                    self._bus = smbus.SMBus(self._bus_number)
+                self._bus.read_byte(address)
+                return True
+            except Exception:
+                return False
+            finally:
+                self._last_transfer = time.monotonic()
+
+    def _write_block(self, register, data, attempt=0):
+        self._transfer(attempt, lambda bus: bus.write_i2c_block_data(self._address, register, data))
+
+    def _read_block(self, register, length, attempt=0):
+        # returns the data without the CRC or None if the CRC is wrong
+        return self._check_block(register, self._read_raw(register, length, attempt), length)
+
+    def _read_raw(self, register, length, attempt=0):
+        # returns the data followed by the CRC, which is not checked
+        return self._transfer(attempt, lambda bus: bus.read_i2c_block_data(self._address, register, length + 1))
+
+    def _check_block(self, register, read, length):
+        if read[length] == self.calcCRC(register, read, length):
+            return read[0:length]
+        self._count('i2c_crc_errors')
+        return None
+
+    def _count(self, counter):
+        with self._statistics_lock:
+            self._statistics[counter] += 1
+
+    def bus_statistics(self):
+        # returns the counters of the transfers since the start as a dict (no bus access)
+        with self._statistics_lock:
+            return dict(self._statistics)
 
     def addCrc(self, crc, n):
-      for bitnumber in range(0,8):
-        if ( n ^ crc ) & 0x80 : crc = ( crc << 1 ) ^ self._POLYNOME
-        else                  : crc = ( crc << 1 )
-        n = n << 1
-      return crc & 0xFF
+      return self._CRC_TABLE[crc ^ (n & 0xFF)]
 
     def calcCRC(self, register, read, len):
-      crc = self.addCrc(0, register)
+      table = self._CRC_TABLE
+      crc = table[register]
       for elem in range(0, len):
-        crc = self.addCrc(crc, read[elem])
+        crc = table[crc ^ read[elem]]
       return crc
 
     def set_timeout(self, timeout):
@@ -83,30 +317,105 @@ class ATTiny:
     def set_led_off_mode(self, value):
         return self.set_8bit_value(self.REG_LED_OFF_MODE, value)
 
+    def set_button_gesture(self, value):
+        return self.set_8bit_value(self.REG_BUTTON_GESTURE, value)
+
+    def set_i2c_address(self, address):
+        # moves the ATTiny to a new address. The write only makes it the pending address,
+        # reading the register on the new address confirms it. Returns True if the
+        # ATTiny answers on the new address, otherwise the old one is kept. The new
+        # address has to be free, the confirmation can't tell the ATTiny from another
+        # device answering there
+        if not self.I2C_MIN_ADDRESS <= address <= self.I2C_MAX_ADDRESS:
+            logging.warning("Invalid I2C address " + hex(address))
+            return False
+        with self._lock:
+            old_address = self._address
+            if address == old_address:
+                return True
+            if self._probe(address):
+                logging.warning("Another device answers on " + hex(address) + ", keeping " + hex(old_address))
+                return False
+            if not self._write_command(self.REG_I2C_ADDRESS, address):
+                return False
+            self._address = address
+            if self.get_8bit_value(self.REG_I2C_ADDRESS) == address:
+                logging.info("Moved ATTiny from " + hex(old_address) + " to " + hex(address))
+                return True
+            self._address = old_address
+        logging.warning("ATTiny didn't answer on " + hex(address) + ", keeping " + hex(old_address))
+        return False
+
     def set_ups_configuration(self, value):
         return self.set_8bit_value(self.REG_UPS_CONFIG, value)
 
     def set_vext_off_is_shutdown(self, value):
         return self.set_8bit_value(self.REG_VEXT_OFF_IS_SHUTDOWN, value)
 
+    def set_bat_v_filter(self, value):
+        return self.set_8bit_value(self.REG_BAT_V_FILTER, value)
+
+    def set_ext_v_filter(self, value):
+        return self.set_8bit_value(self.REG_EXT_V_FILTER, value)
+
+    def set_t_filter(self, value):
+        return self.set_8bit_value(self.REG_T_FILTER, value)
+
     def set_8bit_value(self, register, value):
         crc = self.addCrc(0, register)
         crc = self.addCrc(crc, value)
 
         arg_list = [value, crc]
         for x in range(self._num_retries):
-            bus = smbus.SMBus(self._bus_number)
-            time.sleep(self._time_const)
             try:
-                bus.write_i2c_block_data(self._address, register, arg_list)
-                bus.close()
-                if (self.get_8bit_value(register)) == value:
+                with self._lock:
+                    self._write_block(register, arg_list, x)
+                    read = self._read_block(register, 1)
+                if read == [value]:
                     return True
             except Exception as e:
                 logging.debug("Couldn't set 8 bit register " + hex(register) + ". Exception: " + str(e))
         logging.warning("Couldn't set 8 bit register after " + str(x) + " retries.")
         return False
 
+    def set_values(self, values):
+        # writes a list of (register, value, size) tuples, size is 1 or 2 bytes.
+        # The values are sent in as few batch frames as possible, the ATTiny applies
+        # every frame as a whole. Returns True if all values have been written
+        frames = []
+        data = [0]
+        for (register, value, size) in values:
+            # we interpret every 16-bit value as signed
+            pair = [register] + list(int(value).to_bytes(size, byteorder='little', signed=(size == 2)))
+            # register, data and crc have to fit into the frame
+            if len(data) + len(pair) + 2 > self._BATCH_FRAME_SIZE:
+                frames.append(data)
+                data = [0]
+            data[0] += 1
+            data += pair
+        if data[0] > 0:
+            frames.append(data)
+
+        for data in frames:
+            if not self._write_batch(data):
+                return False
+        return True
+
+    def _write_batch(self, data):
+        arg_list = data + [self.calcCRC(self.REG_BATCH_WRITE, data, len(data))]
+        for x in range(self._num_retries):
+            try:
+                with self._lock:
+                    self._write_block(self.REG_BATCH_WRITE, arg_list, x)
+                    status = self._read_block(self.REG_BATCH_WRITE, 1)
+                if status == [self._BATCH_APPLIED]:
+                    return True
+                logging.debug("Batch write not applied, status " + str(status))
+            except Exception as e:
+                logging.debug("Couldn't write batch. Exception: " + str(e))
+        logging.warning("Couldn't write batch after " + str(x) + " retries.")
+        return False
+
     def set_restart_voltage(self, value):
         return self.set_16bit_value(self.REG_RESTART_VOLTAGE, value)
 
@@ -146,6 +455,9 @@ class ATTiny:
     def set_pulse_length_off(self, value):
         return self.set_16bit_value(self.REG_PULSE_LENGTH_OFF, value)
 
+    def set_discharge_curve(self, curve):
+        return self.set_values([(self.REG_DISCHARGE_CURVE + i, value, 2) for i, value in enumerate(curve)])
+
     def set_16bit_value(self, register, value):
         # we interpret every value as a 16-bit signed value
         vals = value.to_bytes(2, byteorder='little', signed=True)
@@ -154,12 +466,11 @@ class ATTiny:
         arg_list = [vals[0], vals[1], crc]
 
         for x in range(self._num_retries):
-            bus = smbus.SMBus(self._bus_number)
-            time.sleep(self._time_const)
             try:
-                bus.write_i2c_block_data(self._address, register, arg_list)
-                bus.close()
-                if (self.get_16bit_value(register)) == value:
+                with self._lock:
+                    self._write_block(register, arg_list, x)
+                    read = self._read_block(register, 2)
+                if read == [vals[0], vals[1]]:
                     return True
             except Exception as e:
                 logging.debug("Couldn't set 16 bit register " + hex(register) + ". Exception: " + str(e))
@@ -217,17 +528,33 @@ class ATTiny:
     def get_pulse_length_off(self):
         return self.get_16bit_value(self.REG_PULSE_LENGTH_OFF)
 
-    def get_16bit_value(self, register):
+    def get_time_to_shutdown(self):
+        return self.get_16bit_value(self.REG_TIME_TO_SHUTDOWN)
+
+    def get_discharge_curve(self):
+        return [self.get_16bit_value(self.REG_DISCHARGE_CURVE + i) for i in range(self.DISCHARGE_CURVE_POINTS)]
+
+    def get_config_hash(self):
+        return self.get_16bit_value(self.REG_CONFIG_HASH, signed=False)
+
+    def calc_config_hash(self, values):
+        # calculates the Fletcher-16 checksum of the firmware over a list of
+        # (register, value, size) tuples, see config_hash_Int() of the firmware
+        sum1 = 0
+        sum2 = 0
+        for (register, value, size) in sorted(values):
+            for byte in [register] + list((int(value) & 0xFFFF).to_bytes(2, byteorder='little')[0:size]):
+                sum1 = (sum1 + byte) % 255
+                sum2 = (sum2 + sum1) % 255
+        return (sum2 << 8) | sum1
+
+    def get_16bit_value(self, register, signed=True):
         for x in range(self._num_retries):
-            bus = smbus.SMBus(self._bus_number)
-            time.sleep(self._time_const)
             try:
-                read = bus.read_i2c_block_data(self._address, register, 3)
-                # we interpret every value as a 16-bit signed value
-                val = int.from_bytes(read[0:2], byteorder='little', signed=True)
-                bus.close()
-                if read[2] == self.calcCRC(register, read, 2):
-                    return val
+                read = self._read_block(register, 2, x)
+                if read is not None:
+                    # we interpret every value as a 16-bit signed value if not told otherwise
+                    return int.from_bytes(read, byteorder='little', signed=signed)
                 logging.debug("Couldn't read 16 bit register " + hex(register) + " correctly.")
             except Exception as e:
                 logging.debug("Couldn't read 16 bit register " + hex(register) + ". Exception: " + str(e))
@@ -249,12 +576,27 @@ class ATTiny:
     def get_led_off_mode(self):
         return self.get_8bit_value(self.REG_LED_OFF_MODE)
 
+    def get_button_gesture(self):
+        return self.get_8bit_value(self.REG_BUTTON_GESTURE)
+
+    def get_i2c_address(self):
+        return self.get_8bit_value(self.REG_I2C_ADDRESS)
+
     def get_ups_configuration(self):
         return self.get_8bit_value(self.REG_UPS_CONFIG)
 
     def get_vext_off_is_shutdown(self):
         return self.get_8bit_value(self.REG_VEXT_OFF_IS_SHUTDOWN)
 
+    def get_bat_v_filter(self):
+        return self.get_8bit_value(self.REG_BAT_V_FILTER)
+
+    def get_ext_v_filter(self):
+        return self.get_8bit_value(self.REG_EXT_V_FILTER)
+
+    def get_t_filter(self):
+        return self.get_8bit_value(self.REG_T_FILTER)
+
     def get_fuse_low(self):
         return self.get_8bit_value(self.REG_FUSE_LOW)
 
@@ -270,17 +612,22 @@ class ATTiny:
     def get_mcu_status_register(self):
         return self.get_8bit_value(self.REG_MCU_STATUS_REG)
 
+    def get_history_count(self):
+        return self.get_8bit_value(self.REG_HISTORY_COUNT)
+
+    def get_wakeup_interval(self):
+        return self.get_8bit_value(self.REG_WAKEUP_INTERVAL)
+
+    def get_state_of_charge(self):
+        return self.get_8bit_value(self.REG_STATE_OF_CHARGE)
+
     def get_8bit_value(self, register):
         for x in range(self._num_retries):
-            bus = smbus.SMBus(self._bus_number)
-            time.sleep(self._time_const)
             try:
-                read = bus.read_i2c_block_data(self._address, register, 2)
-                val = read[0]
-                bus.close()
-                if read[1] == self.calcCRC(register, read, 1):
-                    return val
-                logging.debug("Couldn't read register " + hex(register) + " correctly: " + hex(val))
+                read = self._read_block(register, 1, x)
+                if read is not None:
+                    return read[0]
+                logging.debug("Couldn't read register " + hex(register) + " correctly.")
             except Exception as e:
                 logging.debug("Couldn't read 8 bit register " + hex(register) + ". Exception: " + str(e))
         logging.warning("Couldn't read 8 bit register after " + str(x) + " retries.")
@@ -288,12 +635,10 @@ class ATTiny:
 
     def get_version(self):
         for x in range(self._num_retries):
-            bus = smbus.SMBus(self._bus_number)
-            time.sleep(self._time_const)
             try:
-                read = bus.read_i2c_block_data(self._address, self.REG_VERSION, 5)
-                bus.close()
-                if read[4] == self.calcCRC(self.REG_VERSION, read, 4):
+                read = self._read_block(self.REG_VERSION, 4, x)
+                if read is not None:
+                    self._build_options = read[3]
                     major = read[2]
                     minor = read[1]
                     patch = read[0]
@@ -304,14 +649,18 @@ class ATTiny:
         logging.warning("Couldn't read version information after " + str(x) + " retries.")
         return (0xFFFF, 0xFFFF, 0xFFFF)
 
+    def get_build_options(self):
+        # returns the compile options of the firmware (OPTION_*) or None if the version
+        # couldn't be read. They are read with the version only once
+        if self._build_options is None:
+            self.get_version()
+        return self._build_options
+
     def get_uptime(self):
         for x in range(self._num_retries):
-            bus = smbus.SMBus(self._bus_number)
-            time.sleep(self._time_const)
             try:
-                read = bus.read_i2c_block_data(self._address, self.REG_UPTIME, 5)
-                bus.close()
-                if read[4] == self.calcCRC(self.REG_UPTIME, read, 4):
+                read = self._read_block(self.REG_UPTIME, 4, x)
+                if read is not None:
                     uptime = int.from_bytes(read[0:3], byteorder='little', signed=False)
                     return uptime
                 logging.debug("Couldn't read uptime information correctly.")
@@ -320,3 +669,241 @@ class ATTiny:
         logging.warning("Couldn't read uptime information after " + str(x) + " retries.")
         return 0xFFFFFFFFFFFF
 
+    def get_snapshot(self):
+        # reads all telemetry values in one transaction, returns a dict
+        # with the same error values as the single register accessors
+        length = struct.calcsize(self._SNAPSHOT_FORMAT)
+        for x in range(self._num_retries):
+            try:
+                read = self._read_block(self.REG_SNAPSHOT, length, x)
+                if read is not None:
+                    values = struct.unpack(self._SNAPSHOT_FORMAT, bytes(read))
+                    return dict(zip(self._SNAPSHOT_FIELDS, values))
+                logging.debug("Couldn't read snapshot correctly.")
+            except Exception as e:
+                logging.debug("Couldn't read snapshot. Exception: " + str(e))
+        logging.warning("Couldn't read snapshot after " + str(x) + " retries.")
+        return dict(zip(self._SNAPSHOT_FIELDS, self._SNAPSHOT_ERROR))
+
+    def _write_command(self, register, value):
+        # writes an 8 bit value to a register that doesn't read back the value written,
+        # so the write is not verified
+        arg_list = [value, self.calcCRC(register, [value], 1)]
+        for x in range(self._num_retries):
+            try:
+                self._write_block(register, arg_list, x)
+                return True
+            except Exception as e:
+                logging.debug("Couldn't write register " + hex(register) + ". Exception: " + str(e))
+        logging.warning("Couldn't write register " + hex(register) + " after " + str(x) + " retries.")
+        return False
+
+    def select_history_page(self, page):
+        return self._write_command(self.REG_HISTORY, page)
+
+    def read_history(self):
+        # reads the telemetry history, returns a list of dicts with the oldest
+        # entry first or None if the history couldn't be read
+        with self._lock:
+            # the page selection must not be interleaved with another history read
+            # (reading other registers doesn't change the selected page), the lock
+            # keeps the whole sequence together
+            count = self.get_history_count()
+            if count == 0xFFFF:
+                return None
+            entries = []
+            page = 0
+            while len(entries) < count:
+                page_entries = self.read_history_page(page, selected=page > 0)
+                if page_entries is None:
+                    return None
+                entries += page_entries[0:count - len(entries)]
+                page += 1
+            return entries
+
+    def read_history_page(self, page, selected=False):
+        # reads a history page and returns its entries (including the unused ones of the
+        # last page) or None if it couldn't be read. The page is selected first unless the
+        # previous read already advanced the ATTiny to it
+        length = 1 + self._HISTORY_PAGE_ENTRIES * self._HISTORY_ENTRY_SIZE
+        with self._lock:
+            for x in range(self._num_retries):
+                if not selected and not self.select_history_page(page):
+                    return None
+                # the page is advanced with every read, a retry selects it again
+                selected = False
+                try:
+                    read = self._read_block(self.REG_HISTORY, length, x)
+                    if read is not None and read[0] == page:
+                        return self._history_entries(read)
+                    logging.debug("Couldn't read history page " + str(page) + " correctly.")
+                except Exception as e:
+                    logging.debug("Couldn't read history page " + str(page) + ". Exception: " + str(e))
+            logging.warning("Couldn't read history page after " + str(x) + " retries.")
+            return None
+
+    def _history_entries(self, read):
+        # the entries of a history page (without the page number)
+        entries = []
+        for i in range(1, len(read), self._HISTORY_ENTRY_SIZE):
+            entries.append({'bat_voltage': read[i] * 10 + 2000,
+                            'ext_voltage': read[i + 1] * 25,
+                            'temperature': int.from_bytes(read[i + 2:i + 3], byteorder='little', signed=True)})
+        return entries
+
+    def get_statistics(self):
+        # reads the statistics of the firmware, returns a dict or None if the
+        # statistics couldn't be read or the firmware is built without them
+        # (see get_build_options(), the register is not read then)
+        options = self.get_build_options()
+        if options is not None and not options & self.OPTION_STATISTICS:
+            return None
+        length = struct.calcsize(self._STATISTICS_FORMAT)
+        for x in range(self._num_retries):
+            try:
+                read = self._read_block(self.REG_STATISTICS, length, x)
+                if read is not None:
+                    values = struct.unpack(self._STATISTICS_FORMAT, bytes(read))
+                    return dict(zip(self._STATISTICS_FIELDS, values))
+                logging.debug("Couldn't read statistics correctly.")
+            except Exception as e:
+                logging.debug("Couldn't read statistics. Exception: " + str(e))
+        logging.warning("Couldn't read statistics after " + str(x) + " retries.")
+        return None
+
+    def reset_statistics(self):
+        return self._write_command(self.REG_STATISTICS, 0)
+
+    def upload_firmware(self, image):
+        # writes a firmware image (see read_hex_file()) with the I2C bootloader and starts
+        # it. It is refused if the ATTiny is in the warn state or shuts down the RPi. The
+        # daemon must not access the ATTiny during the upload. Returns True if the firmware
+        # has been written and verified. A new minor version resets the configuration
+        # stored in the EEPROM except for the I2C address, address tells where the ATTiny
+        # answers after the upload
+        with self._lock:
+            return self._upload_firmware(image)
+
+    def _upload_firmware(self, image):
+        page_size = self._FLASH_PAGE_SIZE
+        reset_page = self._BOOTLOADER_START // page_size - 1
+        if len(image) < 2 or len(image) > reset_page * page_size:
+            logging.error("The firmware has to fit below " + hex(reset_page * page_size) + ", it has " +
+                          str(len(image)) + " bytes")
+            return False
+        reset_vector = int.from_bytes(image[0:2], byteorder='little')
+        if reset_vector & 0xF000 != 0xC000:
+            logging.error("The firmware doesn't start with a jump (rjmp) to the reset handler")
+            return False
+
+        pages = self._boot_ident(1)
+        old_version = None
+        if pages is None:
+            # an interrupted upload leaves the bootloader active, otherwise we have to start it
+            old_version = self.get_version()
+            state = self.get_internal_state()
+            if state == 0xFFFF or state >= self._WARN_STATE:
+                logging.error("The ATTiny is in state " + hex(state) + ", not starting the bootloader")
+                return False
+            if not self._write_command(self.REG_BOOTLOADER, self._BOOTLOADER_MAGIC):
+                return False
+            pages = self._boot_ident(self._num_retries)
+            if pages is None:
+                logging.error("The bootloader didn't start")
+                return False
+        if pages != reset_page:
+            logging.error("The bootloader reports " + str(pages) + " pages, expected " + str(reset_page))
+            return False
+
+        # the erased reset page keeps the bootloader active until all pages are written
+        erased = bytes([0xFF] * page_size)
+        if not self._write_page(reset_page, erased, erased):
+            return False
+        image = image + bytes([0xFF] * (-len(image) % page_size))
+        for page in range(len(image) // page_size):
+            data = image[page * page_size:(page + 1) * page_size]
+            flash = data
+            if page == 0:
+                # the bootloader replaces the reset vector with rjmp BOOTLOADER_START
+                rjmp = 0xC000 | ((self._BOOTLOADER_START // 2 - 1) & 0x0FFF)
+                flash = rjmp.to_bytes(2, byteorder='little') + data[2:]
+            if not self._write_page(page, data, flash):
+                return False
+            logging.debug("Wrote page " + str(page))
+
+        # the last word of the reset page jumps to the reset handler of the firmware,
+        # the rjmp of the image is relative to address 0
+        target = reset_vector + 1
+        reset_word = (reset_page * page_size + page_size - 2) // 2
+        rjmp = 0xC000 | ((target - reset_word - 1) & 0x0FFF)
+        data = erased[0:page_size - 2] + rjmp.to_bytes(2, byteorder='little')
+        if not self._write_page(reset_page, data, data):
+            return False
+
+        if not self._write_command(self._BOOT_EXIT, self._BOOTLOADER_MAGIC):
+            return False
+        # the watchdog resets the ATTiny after 15ms, the firmware starts with the reset
+        time.sleep(0.5)
+        (major, minor, patch) = self.get_version()
+        moved = False
+        if major == 0xFFFF and self._address != self.I2C_DEFAULT_ADDRESS:
+            # a firmware that doesn't keep the address initializes the EEPROM with the
+            # default address if its minor version differs
+            address = self._address
+            self._address = self.I2C_DEFAULT_ADDRESS
+            (major, minor, patch) = self.get_version()
+            moved = major != 0xFFFF
+            if not moved:
+                self._address = address
+            else:
+                logging.warning("The firmware answers on the default address " + hex(self._address) +
+                                " instead of " + hex(address))
+        if major == 0xFFFF:
+            logging.error("The firmware didn't start after the upload")
+            return False
+        logging.info("Uploaded firmware version " + str(major) + "." + str(minor) + "." + str(patch))
+        if old_version is None or old_version[0:2] != (major, minor):
+            # the EEPROM init value is derived from the major and minor version
+            logging.warning("A firmware with another minor version initializes the EEPROM with the "
+                            "defaults" + (", the I2C address as well" if moved else ", only the I2C address is kept") +
+                            ". The daemon writes its configuration again when it starts")
+        return True
+
+    def _boot_ident(self, attempts):
+        # returns the number of pages of the firmware reported by the bootloader or None if
+        # the bootloader doesn't answer
+        for x in range(attempts):
+            try:
+                read = self._read_block(self._BOOT_IDENT, 3, x)
+                if read is not None and read[0] == self._BOOT_SIGNATURE:
+                    return read[2]
+                logging.debug("Couldn't read the bootloader identification correctly.")
+            except Exception as e:
+                logging.debug("Couldn't read the bootloader identification. Exception: " + str(e))
+        return None
+
+    def _write_page(self, page, data, flash):
+        # writes a page in chunks and verifies the CRC of the page read back from the flash
+        # against the expected content (flash)
+        page_crc = 0
+        for value in data:
+            page_crc = self.addCrc(page_crc, value)
+        flash_crc = 0
+        for value in flash:
+            flash_crc = self.addCrc(flash_crc, value)
+        commit = [page, page_crc]
+        commit += [self.calcCRC(self._BOOT_PAGE, commit, len(commit))]
+        for x in range(self._num_retries):
+            try:
+                for offset in range(0, len(data), self._BOOT_CHUNK_SIZE):
+                    chunk = [offset] + list(data[offset:offset + self._BOOT_CHUNK_SIZE])
+                    self._write_block(self._BOOT_CHUNK, chunk + [self.calcCRC(self._BOOT_CHUNK, chunk, len(chunk))], x)
+                self._write_block(self._BOOT_PAGE, commit, x)
+                status = self._read_block(self._BOOT_PAGE, 3)
+                if status == [self._BOOT_WRITTEN, page, flash_crc]:
+                    return True
+                logging.debug("Page " + str(page) + " not written, status " + str(status))
+            except Exception as e:
+                logging.debug("Couldn't write page " + str(page) + ". Exception: " + str(e))
+        logging.error("Couldn't write page " + str(page) + " after " + str(x) + " retries.")
+        return False
@@ -0,0 +1,111 @@
+import http.server
+import logging
+import threading
+
+# The Prometheus exporter of the daemon. GET /metrics renders the register cache (see
+# attiny_cache.py) in the Prometheus text format, so scrapes never access the ATTiny. Every
+# metric has the label node, the ATTinys of other nodes are labelled with their name.
+# Values missing in the cache (e.g. not read yet, or the firmware statistics of a firmware
+# built without them) are left out.
+
+# (metric, type, help, cache key, scale) of the values taken from the cache
+_METRICS = (
+    ('attiny_bat_voltage_volts', 'gauge', 'The battery voltage.', 'bat_voltage', 0.001),
+    ('attiny_ext_voltage_volts', 'gauge', 'The external voltage.', 'ext_voltage', 0.001),
+    ('attiny_temperature_celsius', 'gauge', 'The temperature of the ATTiny.', 'temperature', 1),
+    ('attiny_state', 'gauge', 'The internal state of the ATTiny.', 'internal_state', 1),
+    ('attiny_should_shutdown', 'gauge', 'The shutdown levels as a bit field.', 'should_shutdown', 1),
+    ('attiny_last_access_seconds', 'gauge', 'The seconds since the last I2C access before the refresh.', 'last_access', 1),
+    ('attiny_uptime_seconds', 'gauge', 'The millis() of the ATTiny, it stops while sleeping.', 'uptime', 0.001),
+    ('attiny_state_of_charge_percent', 'gauge', 'The estimated state of charge of the battery.', 'state_of_charge', 1),
+    ('attiny_warn_voltage_volts', 'gauge', 'The battery voltage of the warn state.', 'warn_voltage', 0.001),
+    ('attiny_ups_shutdown_voltage_volts', 'gauge', 'The battery voltage of the shutdown state.', 'ups_shutdown_voltage', 0.001),
+    ('attiny_restart_voltage_volts', 'gauge', 'The battery voltage of the restart.', 'restart_voltage', 0.001),
+    ('attiny_mcu_status_register', 'gauge', 'The MCUSR with the cause of the last reset.', 'mcu_status_register', 1),
+    # the statistics of the firmware (option STATISTICS), reset over I2C or by a reset of the ATTiny
+    ('attiny_firmware_wake_time_avg_seconds', 'gauge', 'The average time awake per wake-up.', 'wake_time_avg', 1e-6),
+    ('attiny_firmware_wake_time_max_seconds', 'gauge', 'The maximum time awake per wake-up.', 'wake_time_max', 1e-6),
+    ('attiny_firmware_isr_time_avg_seconds', 'gauge', 'The average time of the I2C callbacks.', 'isr_time_avg', 1e-6),
+    ('attiny_firmware_isr_time_max_seconds', 'gauge', 'The maximum time of the I2C callbacks.', 'isr_time_max', 1e-6),
+    ('attiny_firmware_i2c_transactions_total', 'counter', 'The I2C transactions counted by the firmware.', 'i2c_transactions', 1),
+    ('attiny_firmware_crc_errors_total', 'counter', 'The frames with a wrong CRC received by the firmware.', 'crc_errors', 1),
+    ('attiny_firmware_oversized_frames_total', 'counter', 'The frames too long for the buffer of the firmware.', 'oversized_frames', 1),
+    ('attiny_firmware_eeprom_writes_total', 'counter', 'The EEPROM bytes written by the firmware.', 'eeprom_writes', 1),
+    # the counters of the ATTiny class in the daemon
+    ('attiny_i2c_transfers_total', 'counter', 'The I2C transfers of the daemon.', 'i2c_transfers', 1),
+    ('attiny_i2c_retries_total', 'counter', 'The retried I2C transfers of the daemon.', 'i2c_retries', 1),
+    ('attiny_i2c_bus_errors_total', 'counter', 'The I2C transfers of the daemon that failed on the bus.', 'i2c_bus_errors', 1),
+    ('attiny_i2c_crc_errors_total', 'counter', 'The reads of the daemon with a wrong CRC.', 'i2c_crc_errors', 1),
+)
+
+# the bits of should_shutdown and the MCUSR that are exported as their own metric
+_SHUTDOWN_CAUSES = ((1, 'rpi_initiated'), (2, 'ext_voltage'), (3, 'button'), (7, 'bat_voltage'))
+_RESET_CAUSES = ((0, 'power_on'), (1, 'external'), (2, 'brown_out'), (3, 'watchdog'))
+
+_TIME_UNKNOWN = 0x7FFF
+
+
+def render_metrics(cache, local_node):
+    # renders the cache in the Prometheus text format
+    (_, timestamp, values) = cache.get()
+    nodes = [(local_node, values)]
+    nodes += [(name, node_values) for (name, node_values) in sorted(values.items()) if isinstance(node_values, dict)]
+
+    lines = []
+
+    def add(metric, metric_type, help_text, samples):
+        if samples:
+            lines.append('# HELP ' + metric + ' ' + help_text)
+            lines.append('# TYPE ' + metric + ' ' + metric_type)
+            for (labels, value) in samples:
+                label_text = ','.join(key + '="' + str(label) + '"' for (key, label) in labels)
+                lines.append(metric + '{' + label_text + '} ' + repr(round(float(value), 6)))
+
+    add('attiny_cache_timestamp_seconds', 'gauge', 'The time of the last refresh of the register cache.',
+        [((('node', local_node),), timestamp)] if timestamp > 0 else [])
+    for (metric, metric_type, help_text, key, scale) in _METRICS:
+        add(metric, metric_type, help_text,
+            [((('node', name),), node_values[key] * scale) for (name, node_values) in nodes if key in node_values])
+    add('attiny_time_to_shutdown_seconds', 'gauge', 'The estimated time until the battery reaches the shutdown voltage.',
+        [((('node', name),), node_values['time_to_shutdown'] * 60) for (name, node_values) in nodes
+         if node_values.get('time_to_shutdown', _TIME_UNKNOWN) != _TIME_UNKNOWN])
+    add('attiny_shutdown_cause', 'gauge', 'The bits of should_shutdown.',
+        [((('node', name), ('cause', cause)), (node_values['should_shutdown'] >> bit) & 1)
+         for (name, node_values) in nodes if 'should_shutdown' in node_values for (bit, cause) in _SHUTDOWN_CAUSES])
+    add('attiny_reset_cause', 'gauge', 'The bits of the MCUSR, the cause of the last reset.',
+        [((('node', name), ('cause', cause)), (node_values['mcu_status_register'] >> bit) & 1)
+         for (name, node_values) in nodes if 'mcu_status_register' in node_values for (bit, cause) in _RESET_CAUSES])
+    return '\n'.join(lines) + '\n'
+
+
+class _MetricsRequestHandler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self):
+        if self.path.split('?')[0] != '/metrics':
+            self.send_error(404)
+            return
+        body = render_metrics(self.server.cache, self.server.local_node).encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain; version=0.0.4; charset=utf-8')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        logging.debug("Metrics request: " + format % args)
+
+
+class MetricsServer(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, port, cache, local_node, address=''):
+        self.cache = cache
+        self.local_node = local_node
+        super().__init__((address, port), _MetricsRequestHandler)
+        self._thread = threading.Thread(target=self.serve_forever, name="attiny metrics", daemon=True)
+
+    def start(self):
+        self._thread.start()
+
+    def close(self):
+        self.shutdown()
+        self.server_close()
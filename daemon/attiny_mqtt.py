@@ -0,0 +1,118 @@
+import json
+import logging
+import threading
+import time
+
+# The MQTT output of the daemon. It publishes the register cache (see attiny_cache.py) over
+# a persistent broker connection as one JSON object per message:
+#   <topic>          {"timestamp": t, "uptime": s, <the values of the cache>}
+#   <topic>/history  {"timestamp": t, "entries": [{"bat_voltage": mV, "ext_voltage": mV,
+#                                                  "temperature": C}, ...]}
+# t is the time of the last refresh of the cache, uptime the uptime of the RPi. The status
+# is published every interval seconds and, with on_change, whenever the cache changes.
+# The telemetry history the ATTiny recorded before the daemon started (e.g. while the RPi
+# was off) is published once in a single message after the first connection.
+# paho-mqtt (1.x or 2.x) is only needed if the output is configured.
+
+
+def _get_uptime():
+    with open('/proc/uptime', 'r') as f:
+        return float(f.readline().split()[0])
+
+
+class MqttPublisher(threading.Thread):
+    def __init__(self, cache, attiny, host, port=1883, topic="attiny_daemon", client_id="",
+                 user=None, password=None, interval=60, on_change=False, history=True):
+        super().__init__(name="mqtt", daemon=True)
+        import paho.mqtt.client as mqtt
+
+        self._cache = cache
+        self._attiny = attiny
+        self._topic = topic
+        self._interval = interval
+        self._on_change = on_change
+        self._backfill = history
+        self._connected = threading.Event()
+        self._stopped = threading.Event()
+
+        if hasattr(mqtt, "CallbackAPIVersion"):
+            # paho-mqtt 2.x
+            self._client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION1, client_id=client_id)
+        else:
+            self._client = mqtt.Client(client_id=client_id)
+        if user:
+            self._client.username_pw_set(user, password)
+        self._client.on_connect = self._on_connect
+        self._client.on_disconnect = self._on_disconnect
+        # paho reconnects in its network thread, waiting up to 2 minutes between attempts
+        self._client.reconnect_delay_set(min_delay=1, max_delay=120)
+        self._client.connect_async(host, port, keepalive=60)
+
+    def _on_connect(self, client, userdata, flags, rc):
+        if rc == 0:
+            logging.info("Connected to the MQTT broker")
+            self._connected.set()
+        else:
+            logging.warning("MQTT broker refused the connection: " + str(rc))
+
+    def _on_disconnect(self, client, userdata, rc):
+        self._connected.clear()
+        if rc != 0:
+            logging.warning("Lost the connection to the MQTT broker, reconnecting")
+
+    def run(self):
+        self._client.loop_start()
+        try:
+            self._publish_loop()
+        except Exception as e:
+            logging.error("MQTT output stopped: " + str(e))
+        finally:
+            self._client.disconnect()
+            self._client.loop_stop()
+
+    def _publish_loop(self):
+        (generation, timestamp, values) = self._cache.get()
+        next_publish = time.monotonic()
+        while not self._stopped.is_set() and not self._cache.closed:
+            if not self._connected.wait(1.0):
+                # nothing is queued while we are offline, the next status is sent when connected
+                continue
+            if self._backfill:
+                self._backfill = False
+                self._publish_history()
+
+            # wake up at least every second to notice stop() and the disconnection
+            timeout = min(max(next_publish - time.monotonic(), 0), 1.0)
+            if self._on_change:
+                (current, timestamp, values) = self._cache.wait_for_change(generation, timeout)
+            else:
+                self._stopped.wait(timeout)
+                (current, timestamp, values) = self._cache.get()
+
+            due = time.monotonic() >= next_publish or (self._on_change and current != generation)
+            generation = current
+            if due and timestamp == 0:
+                # the cache has not been refreshed yet
+                next_publish = time.monotonic() + 1.0
+            elif due:
+                self._publish_status(timestamp, values)
+                next_publish = time.monotonic() + self._interval
+
+    def _publish_status(self, timestamp, values):
+        message = {'timestamp': timestamp, 'uptime': _get_uptime()}
+        message.update(values)
+        self._client.publish(self._topic, json.dumps(message), qos=0, retain=False)
+
+    def _publish_history(self):
+        entries = self._attiny.read_history()
+        if entries is None:
+            logging.warning("Couldn't read the history for the MQTT backfill")
+            return
+        logging.debug("Publishing " + str(len(entries)) + " history entries")
+        message = {'timestamp': time.time(), 'entries': entries}
+        # the backfill is sent once, the broker should acknowledge it
+        self._client.publish(self._topic + "/history", json.dumps(message), qos=1, retain=False)
+
+    def stop(self):
+        self._stopped.set()
+        self.join(5)
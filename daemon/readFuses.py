@@ -9,7 +9,7 @@ import smbus
 import logging
 from attiny_i2c import ATTiny
 
-_time_const = 1.0   # used as a pause between i2c communications, the ATTiny is slow
+_time_const = 0.05   # the minimum gap between i2c communications, the ATTiny is slow
 _num_retries = 10   # the number of retries when reading from or writing to the ATTiny_Daemon
 _i2c_address = 0x37 # the I2C address that is used for the ATTiny_Daemon
 
@@ -8,8 +8,9 @@ import time
 import smbus
 import logging
 from attiny_i2c import ATTiny
+from attiny_cache import read_cache
 
-_time_const = 1.0   # used as a pause between i2c communications, the ATTiny is slow
+_time_const = 0.05   # the minimum gap between i2c communications, the ATTiny is slow
 _num_retries = 10   # the number of retries when reading from or writing to the ATTiny_Daemon
 _i2c_address = 0x37 # the I2C address that is used for the ATTiny_Daemon
 
@@ -17,10 +18,6 @@ _i2c_address = 0x37 # the I2C address that is used for the ATTiny_Daemon
 root_log = logging.getLogger()
 root_log.setLevel("INFO")
 
-# set up communication to the ATTiny_Daemon
-bus = 1
-attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
-
 states = {
      0 : "RUNNING_STATE",
      1 : "UNCLEAR_STATE",
@@ -31,15 +28,25 @@ states = {
     32 : "SHUTDOWN_STATE",
 }
 
-state = attiny.get_internal_state()
-logging.info("Current state is " + hex(state) + ": " + states[state])
-logging.info("Current should_shutdown value is " + hex(attiny.should_shutdown()))
-
-# access data
-logging.info("Current battery voltage is " + str(attiny.get_bat_voltage() / 1000) + "V.")
-logging.info("Current external voltage is " + str(attiny.get_ext_voltage() / 1000) + "V.")
-
-logging.info("Current warn voltage is " + str(attiny.get_warn_voltage() / 1000) + "V.")
-logging.info("Current ups shutdown voltage is " + str(attiny.get_ups_shutdown_voltage() / 1000) + "V.")
-logging.info("Current restart voltage is " + str(attiny.get_restart_voltage() / 1000) + "V.")
+# access data, use the register cache of the daemon and only if it isn't running access the ATTiny
+snapshot = read_cache()
+if snapshot is None:
+    logging.info("Daemon not reachable, reading from the ATTiny")
+    bus = 1
+    attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
+    snapshot = attiny.get_snapshot()
+    snapshot['warn_voltage'] = attiny.get_warn_voltage()
+    snapshot['ups_shutdown_voltage'] = attiny.get_ups_shutdown_voltage()
+    snapshot['restart_voltage'] = attiny.get_restart_voltage()
+
+state = snapshot['internal_state']
+logging.info("Current state is " + hex(state) + ": " + states.get(state, "UNKNOWN"))
+logging.info("Current should_shutdown value is " + hex(snapshot['should_shutdown']))
+
+logging.info("Current battery voltage is " + str(snapshot['bat_voltage'] / 1000) + "V.")
+logging.info("Current external voltage is " + str(snapshot['ext_voltage'] / 1000) + "V.")
+
+logging.info("Current warn voltage is " + str(snapshot.get('warn_voltage', 0xFFFFFFFF) / 1000) + "V.")
+logging.info("Current ups shutdown voltage is " + str(snapshot.get('ups_shutdown_voltage', 0xFFFFFFFF) / 1000) + "V.")
+logging.info("Current restart voltage is " + str(snapshot.get('restart_voltage', 0xFFFFFFFF) / 1000) + "V.")
 
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3 
+
+import sys
+
+sys.path.append('/opt/attiny_daemon/')  # add the path to our ATTiny module
+
+import logging
+from argparse import ArgumentParser
+from configparser import ConfigParser
+from attiny_i2c import ATTiny, read_hex_file
+
+_time_const = 0.05   # the minimum gap between i2c communications, the ATTiny is slow
+_num_retries = 10   # the number of retries when reading from or writing to the ATTiny_Daemon
+_configfile_default = '/opt/attiny_daemon/attiny_daemon.cfg'
+_i2c_bus = 1        # the I2C bus and address used if the config of the daemon has none
+_i2c_address = 0x37
+
+# set up logging
+root_log = logging.getLogger()
+root_log.setLevel("INFO")
+
+# the firmware has to be built with I2C_BOOTLOADER and the bootloader (firmware/ATTinyBoot)
+# has to be installed. Stop the daemon before the upload (systemctl stop attiny_daemon)
+arg_parser = ArgumentParser(description='Upload a firmware to the ATTiny with the I2C bootloader')
+arg_parser.add_argument('hexfile', help='the firmware in the Intel HEX format')
+arg_parser.add_argument('--cfgfile', metavar='file', default=_configfile_default,
+                        help='the config of the daemon with the default bus and address')
+arg_parser.add_argument('--bus', type=int, help='the I2C bus of the ATTiny')
+arg_parser.add_argument('--address', type=lambda value: int(value, 0),
+                        help='the I2C address of the ATTiny, e.g. 0x37')
+args = arg_parser.parse_args()
+
+# the ATTiny of this RPi as configured for the daemon, the options select another one
+parser = ConfigParser(allow_no_value=True)
+parser.read(args.cfgfile)
+bus = args.bus
+if bus is None:
+    bus = parser.getint('attinydaemon', 'i2c bus', fallback=_i2c_bus)
+address = args.address
+if address is None:
+    address = int(parser.get('attinydaemon', 'i2c address', fallback=hex(_i2c_address)), 0)
+
+image = read_hex_file(args.hexfile)
+
+# set up communication to the ATTiny_Daemon
+attiny = ATTiny(bus, address, _time_const, _num_retries)
+
+logging.info("Uploading " + str(len(image)) + " bytes to " + hex(address) + " on bus " + str(bus) + ", this takes about a minute")
+if not attiny.upload_firmware(image):
+    logging.error("The upload failed, the bootloader stays active until it is repeated")
+    sys.exit(1)
+if attiny.address != address:
+    logging.warning("The ATTiny is now on " + hex(attiny.address) + ", move it back or change the configuration")
@@ -8,7 +8,7 @@ import time
 import logging
 from attiny_i2c import ATTiny
 
-_time_const  = 1.0  # used as a pause between i2c communications, the ATTiny is slow
+_time_const  = 0.05  # the minimum gap between i2c communications, the ATTiny is slow
 _num_retries = 10   # the number of retries when reading from or writing to the ATTiny_Daemon
 _i2c_address = 0x37 # the I2C address that is used for the ATTiny_Daemon
 
@@ -20,17 +20,26 @@ root_log.setLevel("INFO")
 bus = 1
 attiny = ATTiny(bus, _i2c_address, _time_const, _num_retries)
 
-# access data
+# access data, this example reads the registers directly. Scripts that only need the
+# telemetry should use read_cache() of attiny_cache while the daemon is running
 (major, minor, patch) = attiny.get_version()
 version = str(major) + "." + str(minor) + "." + str(patch)
 logging.info("Current Version is " + version)
 
 logging.info("Uptime is " + str(attiny.get_uptime()))
+logging.info("Current wake-up interval is " + str(attiny.get_wakeup_interval()) + " seconds.")
 
 logging.info("Current temperature is " + str(attiny.get_temperature()) + " degrees Celsius.")
 
 logging.info("Current battery voltage is " + str(attiny.get_bat_voltage() / 1000) + "V.")
 logging.info("Current external voltage is " + str(attiny.get_ext_voltage() / 1000) + "V.")
+logging.info("Current state of charge is " + str(attiny.get_state_of_charge()) + "%.")
+time_to_shutdown = attiny.get_time_to_shutdown()
+if time_to_shutdown == attiny.TIME_UNKNOWN:
+    logging.info("Battery is not discharging.")
+else:
+    logging.info("Estimated time to shutdown is " + str(time_to_shutdown) + " minutes.")
+logging.info("Current discharge curve is " + str(attiny.get_discharge_curve()))
 
 logging.info("Current timeout is " + str(attiny.get_timeout()))
 logging.info("Current primed is " + str(attiny.get_primed()))
@@ -48,6 +57,23 @@ logging.info("Current switch recovery delay is " + str(attiny.get_switch_recover
 
 logging.info("Current led off mode is " + str(attiny.get_led_off_mode()))
 
+logging.info("Current battery voltage filter is " + hex(attiny.get_bat_v_filter()))
+logging.info("Current external voltage filter is " + hex(attiny.get_ext_v_filter()))
+logging.info("Current temperature filter is " + hex(attiny.get_t_filter()))
+
 logging.info("Low fuse is " + hex(attiny.get_fuse_low()))
 logging.info("High fuse is " + hex(attiny.get_fuse_high()))
 logging.info("Extended fuse is " + hex(attiny.get_fuse_extended()))
+
+history = attiny.read_history()
+if history is not None:
+    logging.info("History contains " + str(len(history)) + " entries (oldest first):")
+    for entry in history:
+        logging.info("  battery " + str(entry['bat_voltage'] / 1000) + "V, external " + str(entry['ext_voltage'] / 1000) + "V, temperature " + str(entry['temperature']))
+
+statistics = attiny.get_statistics()
+if statistics is not None:
+    logging.info("Wake time is " + str(statistics['wake_time_avg']) + "us on average, " + str(statistics['wake_time_max']) + "us max.")
+    logging.info("I2C callback time is " + str(statistics['isr_time_avg']) + "us on average, " + str(statistics['isr_time_max']) + "us max.")
+    logging.info("I2C transactions " + str(statistics['i2c_transactions']) + ", crc errors " + str(statistics['crc_errors']) +
+                 ", oversized frames " + str(statistics['oversized_frames']) + ", EEPROM writes " + str(statistics['eeprom_writes']))
@@ -0,0 +1,394 @@
+/*
+   ATTinyBoot - the I2C bootloader of ATTinyDaemon. It allows the RPi to update the firmware
+   without an ISP programmer (see upload_firmware() in daemon/attiny_i2c.py).
+   The datasheet referenced is the ATTiny25/45/85 datasheet provided by Microchip, revision
+   Rev. 2586Q-08/13.
+
+   The ATTiny85 has no boot section, the bootloader is an ordinary program at the end of the
+   flash (BOOTLOADER_START, the last 1K). The reset vector of the firmware is replaced by a
+   jump to the bootloader whenever page 0 is written, so the bootloader is started first
+   after every reset. It hands over to the firmware through the reset page, the last page
+   below the bootloader. Its last word is the original reset vector of the firmware, the
+   uploader writes it after all other pages. An erased reset page means that there is no
+   complete firmware and the bootloader stays active, so an interrupted update can simply
+   be repeated. The firmware enters the bootloader by jumping to BOOTLOADER_START with
+   BOOTLOADER_MAGIC in GPIOR0 (see handleBootloader.ino), GPIOR0 is cleared by a reset.
+
+   The bootloader is an I2C slave on the address of the firmware (read from the EEPROM).
+   The USI is polled, no interrupts are used. The protocol follows the firmware: a write is
+   register, data and a CRC8 over both, a read returns the data followed by a CRC8 over the
+   register number and the data. The registers are
+     BOOT_IDENT  (read)   BOOT_SIGNATURE, BOOT_VERSION, the number of pages of the firmware
+     BOOT_CHUNK  (write)  offset, CHUNK_SIZE bytes of the page buffer
+     BOOT_PAGE   (write)  page, CRC8 of the page buffer: erases and writes the page
+                 (read)   the status of the last page (Boot_Status), the page and the CRC8
+                          of the page as read back from the flash
+     BOOT_EXIT   (write)  BOOTLOADER_MAGIC: starts the firmware with a watchdog reset
+   The chunks of a page are not acknowledged one by one. A chunk with a wrong CRC is
+   dropped, the CRC of the page then doesn't match and the page isn't written. The CRC8
+   read back for page 0 is the one of the page with the modified reset vector.
+   The watchdog resets the ATTiny if no valid frame has been received for 8 seconds and
+   starts the firmware if it is complete.
+
+   Build and install it once with an ISP programmer. The extended fuse 0xFE enables
+   self programming (SELFPRGEN). Erasing the chip for the installation leaves an erased
+   reset page, afterwards the firmware is uploaded with the bootloader:
+     avr-gcc -mmcu=attiny85 -Os -nostartfiles -Wl,--section-start=.text=0x1C00 \
+             -Wl,-Map=ATTinyBoot.map -o ATTinyBoot.elf ATTinyBoot.c
+     avr-objcopy -O ihex ATTinyBoot.elf ATTinyBoot.hex
+     avrdude -c <programmer> -p t85 -U efuse:w:0xFE:m -U flash:w:ATTinyBoot.hex:i
+   The linker fails if the bootloader doesn't fit into the flash. In ATTinyBoot.map the
+   .vectors of ATTinyBoot.o have to be the first input section of .text at 0x1C00, the
+   disassembly (avr-objdump -d) has to show the jump to boot there.
+   The host build (../host/bootsim.cpp) runs this file against a model of the USI and the
+   flash, see the traces in ../host/traces/bootloader.
+*/
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <stdint.h>
+
+/*
+   These values have to match ATTinyDaemon.h
+*/
+#define BOOTLOADER_START     0x1C00
+#define BOOTLOADER_MAGIC     0xB7
+#define I2C_ADDRESS          0x37
+#define I2C_MIN_ADDRESS      0x08
+#define I2C_MAX_ADDRESS      0x77
+#define EEPROM_I2C_ADDRESS   52          // EEPROM_Address::i2c_address
+#define CRC8INIT             0x00
+#define CRC8POLY             0x31        // X^8+X^5+X^4+X^0
+#define PIN_SDA              PB0
+#define PIN_SCL              PB2
+
+#define RESET_VECTOR         (BOOTLOADER_START - 2)
+#define APP_PAGES            (BOOTLOADER_START / SPM_PAGESIZE)
+#define BOOT_SIGNATURE       0xB7
+#define BOOT_VERSION         1
+#define CHUNK_SIZE           16
+#define BUFFER_SIZE          (2 + CHUNK_SIZE + 1)      // register, offset, chunk, CRC
+
+#define BOOT_IDENT           0xB0
+#define BOOT_CHUNK           0xB1
+#define BOOT_PAGE            0xB2
+#define BOOT_EXIT            0xB3
+
+/*
+   The status of the last page written
+*/
+enum Boot_Status {
+  status_none                   = 0,       // no page written yet
+  status_written                = 1,       // the page has been written and verified
+  status_crc_error              = 2,       // the CRC of the page buffer didn't match, nothing written
+  status_protected              = 3,       // the page belongs to the bootloader, nothing written
+  status_verify_error           = 4,       // the page read back differs from the page buffer
+};
+
+/*
+   The states of the USI state machine, see handleUSI.ino
+*/
+enum USI_State {
+  usi_idle                      = 0,       // waiting for a start condition
+  usi_check_address             = 1,       // the address byte is shifted in
+  usi_send_data                 = 2,       // the next byte has to be sent
+  usi_request_reply             = 3,       // a byte has been sent, the ACK/NACK of the master is read next
+  usi_check_reply               = 4,       // the ACK/NACK of the master has been read
+  usi_request_data              = 5,       // the next byte is read
+  usi_get_data                  = 6,       // a byte has been read and is acknowledged
+};
+
+/*
+   The USI status register values, see handleUSI.ino
+*/
+#define USI_CLEAR_FLAGS      (_BV(USIOIF) | _BV(USIPF) | _BV(USIDC))
+#define USI_COUNT_BIT        0x0E
+
+/*
+   The reset vector of the firmware, function pointers are word addresses. The host build
+   replaces it.
+*/
+#if !defined FIRMWARE_ENTRY
+#define FIRMWARE_ENTRY       ((void (*)(void)) (RESET_VECTOR / 2))
+#endif
+
+/*
+   Without the startup code there is no .data and no .bss initialization, all variables
+   live on the stack of run().
+*/
+static void run(void) __attribute__ ((noreturn, noinline, used));
+
+#if defined (__AVR__)
+/*
+   The entry point at BOOTLOADER_START, reached after a reset and from the firmware. The
+   default linker script puts .progmem and .jumptables (e.g. of a switch) in front of .init0
+   and only .vectors in front of them, so the jump to boot() is our (only) vector, as in the
+   startup code that -nostartfiles leaves out. boot() only contains assembler: it clears the
+   zero register and sets the stack pointer, which the firmware leaves anywhere.
+*/
+asm (".section .vectors,\"ax\",@progbits\n"
+     "  rjmp boot\n"
+     ".previous\n");
+
+void boot(void) __attribute__ ((naked, noreturn, used));
+void boot(void) {
+  asm volatile ("clr __zero_reg__\n\t"
+                "ldi r28, lo8(%0)\n\t"
+                "out __SP_L__, r28\n\t"
+                "ldi r28, hi8(%0)\n\t"
+                "out __SP_H__, r28\n\t"
+                "rjmp run\n\t"
+                :: "i" (RAMEND));
+}
+#endif
+
+static uint8_t crc8_add(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = (crc & 0x80) ? (crc << 1) ^ CRC8POLY : crc << 1;
+  }
+  return crc;
+}
+
+static uint8_t crc8(uint8_t crc, const uint8_t *data, uint8_t len) {
+  for (uint8_t i = 0; i < len; i++) {
+    crc = crc8_add(crc, data[i]);
+  }
+  return crc;
+}
+
+/*
+   Start the firmware with a watchdog reset, which also resets the peripherals.
+*/
+static void restart(void) __attribute__ ((noreturn));
+static void restart(void) {
+  wdt_enable(WDTO_15MS);
+  for (;;);
+}
+
+/*
+   Erase and write a page from the page buffer and read it back. The reset vector of page
+   0 is replaced by a jump to the bootloader. Returns the Boot_Status, *flash_crc is the CRC8
+   of the page read back.
+*/
+static uint8_t program_page(uint8_t *data, uint8_t page, uint8_t crc, uint8_t *flash_crc) {
+  *flash_crc = 0;
+  if (crc8(CRC8INIT, data, SPM_PAGESIZE) != crc) {
+    return status_crc_error;
+  }
+  if (page >= APP_PAGES) {
+    return status_protected;
+  }
+  if (page == 0) {
+    // rjmp BOOTLOADER_START, relative to the next word
+    uint16_t rjmp = 0xC000 | ((BOOTLOADER_START / 2 - 1) & 0x0FFF);
+    data[0] = rjmp & 0xFF;
+    data[1] = rjmp >> 8;
+  }
+
+  uint16_t address = page * SPM_PAGESIZE;
+  boot_page_erase(address);
+  boot_spm_busy_wait();
+  for (uint8_t i = 0; i < SPM_PAGESIZE; i += 2) {
+    boot_page_fill(address + i, data[i] | (data[i + 1] << 8));
+  }
+  boot_page_write(address);
+  boot_spm_busy_wait();
+
+  uint8_t status = status_written;
+  uint8_t read_crc = CRC8INIT;
+  for (uint8_t i = 0; i < SPM_PAGESIZE; i++) {
+    uint8_t value = pgm_read_byte(address + i);
+    if (value != data[i]) {
+      status = status_verify_error;
+    }
+    read_crc = crc8_add(read_crc, value);
+  }
+  *flash_crc = read_crc;
+  return status;
+}
+
+static void run(void) {
+  if (GPIOR0 != BOOTLOADER_MAGIC && pgm_read_word(RESET_VECTOR) != 0xFFFF) {
+    // the firmware is complete and didn't ask for us
+    FIRMWARE_ENTRY();
+  }
+  GPIOR0 = 0;
+
+  MCUSR &= ~_BV(WDRF);                 // WDRF forces the watchdog reset on
+  wdt_enable(WDTO_8S);
+
+  uint8_t address = eeprom_read_byte((uint8_t *) EEPROM_I2C_ADDRESS);
+  if (address < I2C_MIN_ADDRESS || address > I2C_MAX_ADDRESS) {
+    address = I2C_ADDRESS;
+  }
+
+  uint8_t page_buffer[SPM_PAGESIZE];
+  uint8_t rbuf[BUFFER_SIZE];
+  uint8_t rx_count = 0;
+  uint8_t tx_buffer[3];
+  uint8_t tx_len = 0;
+  uint8_t tx_pos = 0;
+  uint8_t tx_crc = 0;
+  uint8_t reg = 0;
+  uint8_t page_status[3] = { status_none, 0, 0 };
+  uint8_t state = usi_idle;
+
+  // SCL is an output, the USI only pulls it low to stretch the clock (see handleUSI.ino)
+  PORTB |= _BV(PIN_SCL) | _BV(PIN_SDA);
+  DDRB |= _BV(PIN_SCL);
+  DDRB &= ~_BV(PIN_SDA);
+  USICR = _BV(USIWM1) | _BV(USICS1);
+  USISR = _BV(USISIF) | USI_CLEAR_FLAGS;
+
+  for (;;) {
+    uint8_t flags = USISR;
+    uint8_t complete = 0;              // a write has been completed by a start or a stop
+
+    if (flags & _BV(USISIF)) {
+      complete = rx_count > 0;
+      // wait until the start condition is complete (SCL low) or a stop occurs (SDA high)
+      while ((PINB & _BV(PIN_SCL)) && !(PINB & _BV(PIN_SDA)));
+      DDRB &= ~_BV(PIN_SDA);
+      if (PINB & _BV(PIN_SDA)) {
+        state = usi_idle;
+        USICR = _BV(USIWM1) | _BV(USICS1);
+      } else {
+        state = usi_check_address;
+        // hold SCL on counter overflow
+        USICR = _BV(USIWM1) | _BV(USIWM0) | _BV(USICS1);
+      }
+      USISR = _BV(USISIF) | USI_CLEAR_FLAGS;
+    } else if (flags & _BV(USIPF)) {
+      complete = rx_count > 0;
+      state = usi_idle;
+      DDRB &= ~_BV(PIN_SDA);
+      USICR = _BV(USIWM1) | _BV(USICS1);
+      USISR = _BV(USIPF);
+    } else if (flags & _BV(USIOIF)) {
+      uint8_t data = USIDR;
+      switch (state) {
+        case usi_check_address:
+          if ((data >> 1) != address) {
+            state = usi_idle;
+            USICR = _BV(USIWM1) | _BV(USICS1);
+            USISR = _BV(USISIF) | USI_CLEAR_FLAGS;
+            break;
+          }
+          if (data & 0x01) {
+            // the master reads the register selected by the last write
+            state = usi_send_data;
+            tx_len = 0;
+            if (reg == BOOT_IDENT) {
+              tx_buffer[0] = BOOT_SIGNATURE;
+              tx_buffer[1] = BOOT_VERSION;
+              tx_buffer[2] = APP_PAGES - 1;    // without the reset page
+              tx_len = 3;
+            } else if (reg == BOOT_PAGE) {
+              for (uint8_t i = 0; i < 3; i++) {
+                tx_buffer[i] = page_status[i];
+              }
+              tx_len = 3;
+            }
+            tx_pos = 0;
+            tx_crc = crc8_add(CRC8INIT, reg);
+          } else {
+            state = usi_request_data;
+            rx_count = 0;
+          }
+          // send the ACK
+          USIDR = 0;
+          DDRB |= _BV(PIN_SDA);
+          USISR = USI_CLEAR_FLAGS | USI_COUNT_BIT;
+          break;
+
+        case usi_check_reply:
+          if (data & 0x01) {
+            // NACK, the master does not want more data
+            state = usi_idle;
+            USICR = _BV(USIWM1) | _BV(USICS1);
+            USISR = USI_CLEAR_FLAGS;
+            break;
+          }
+          // fall through
+        case usi_send_data:
+          if (tx_pos < tx_len) {
+            data = tx_buffer[tx_pos];
+            tx_crc = crc8_add(tx_crc, data);
+          } else {
+            data = tx_pos == tx_len ? tx_crc : 0xFF;
+          }
+          if (tx_pos <= tx_len) {
+            tx_pos++;
+          }
+          USIDR = data;
+          state = usi_request_reply;
+          DDRB |= _BV(PIN_SDA);
+          USISR = USI_CLEAR_FLAGS;
+          break;
+
+        case usi_request_reply:
+          state = usi_check_reply;
+          DDRB &= ~_BV(PIN_SDA);
+          USIDR = 0;
+          USISR = USI_CLEAR_FLAGS | USI_COUNT_BIT;
+          break;
+
+        case usi_request_data:
+          state = usi_get_data;
+          DDRB &= ~_BV(PIN_SDA);
+          USISR = USI_CLEAR_FLAGS;
+          break;
+
+        case usi_get_data:
+          // frames that are too long are dropped when they are complete
+          if (rx_count < BUFFER_SIZE) {
+            rbuf[rx_count] = data;
+          }
+          if (rx_count < 0xFF) {
+            rx_count++;
+          }
+          state = usi_request_data;
+          USIDR = 0;
+          DDRB |= _BV(PIN_SDA);
+          USISR = USI_CLEAR_FLAGS | USI_COUNT_BIT;
+          break;
+
+        default:
+          state = usi_idle;
+          USICR = _BV(USIWM1) | _BV(USICS1);
+          USISR = USI_CLEAR_FLAGS;
+          break;
+      }
+    }
+
+    if (!complete) {
+      continue;
+    }
+    uint8_t bytes = rx_count;
+    rx_count = 0;
+    if (bytes > BUFFER_SIZE) {
+      continue;
+    }
+    reg = rbuf[0];
+    if (bytes < 3 || crc8(CRC8INIT, rbuf, bytes - 1) != rbuf[bytes - 1]) {
+      // a register selection for a read or a frame with a wrong CRC
+      continue;
+    }
+    wdt_reset();
+
+    if (reg == BOOT_CHUNK && bytes == BUFFER_SIZE && rbuf[1] % CHUNK_SIZE == 0 && rbuf[1] < SPM_PAGESIZE) {
+      for (uint8_t i = 0; i < CHUNK_SIZE; i++) {
+        page_buffer[rbuf[1] + i] = rbuf[2 + i];
+      }
+    } else if (reg == BOOT_PAGE && bytes == 4) {
+      // SCL is not held while the CPU is halted, the next start condition stretches the clock
+      page_status[1] = rbuf[1];
+      page_status[0] = program_page(page_buffer, rbuf[1], rbuf[2], &page_status[2]);
+    } else if (reg == BOOT_EXIT && bytes == 3 && rbuf[1] == BOOTLOADER_MAGIC) {
+      restart();
+    }
+  }
+}
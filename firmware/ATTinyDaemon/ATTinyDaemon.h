@@ -1,4 +1,3 @@
-#include <Wire.h>
 #include <util/atomic.h>
 #include <EEPROM.h>
 #include <limits.h>
@@ -8,18 +7,90 @@
 #include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <avr/cpufunc.h>
+#include <avr/pgmspace.h>
 
 /*
    If SERIAL_DEBUG is set, then serial debug data will be written to PB4, the pin to which the LED is connected
  */
 //#define SERIAL_DEBUG
 
+/*
+   Select the CRC8 implementation used for the I2C communication (see handleCRC.ino).
+   CRC8_TABLE uses a 256 byte lookup table in flash and is the fastest, CRC8_NIBBLE_TABLE
+   uses a 16 byte table and needs two lookups per byte. If neither is defined the bitwise
+   calculation is used. All variants produce identical results on the wire.
+ */
+//#define CRC8_TABLE
+#define CRC8_NIBBLE_TABLE
+
+/*
+   If ATTENTION_LINE is set, PIN_ATTENTION is pulled low whenever should_shutdown or the state
+   changes and released when the RPi reads should_shutdown or the snapshot register. Connect it
+   to a GPIO of the RPi (with pull-up to 3.3V, the pin is never driven high) to allow the daemon
+   to wait for the signal instead of polling. PIN_ATTENTION is the RESET pin, to use it the
+   RSTDISBL fuse has to be programmed. Afterwards the ATTiny can only be reprogrammed using a
+   high voltage programmer.
+ */
+//#define ATTENTION_LINE
+
+/*
+   If EXT_VOLTAGE_COMPARATOR is set, the analog comparator watches the external voltage between
+   the measurements while it is present and sets Shutdown_Cause::ext_voltage as soon as it is
+   lost (see handleVoltages.ino). The comparator cannot wake the ATTiny from power down, so
+   while the external voltage is present it sleeps in idle mode instead, which draws more
+   current from the external supply. On battery it still goes to power down.
+ */
+//#define EXT_VOLTAGE_COMPARATOR
+
+/*
+   If I2C_BOOTLOADER is set, writing BOOTLOADER_MAGIC to the bootloader register hands the
+   ATTiny over to the I2C bootloader (see ../ATTinyBoot/ATTinyBoot.c and handleBootloader.ino),
+   which allows to update the firmware from the RPi. The bootloader has to be installed with
+   an ISP programmer once and occupies the flash from BOOTLOADER_START, the firmware has to
+   end below BOOTLOADER_APP_END.
+ */
+//#define I2C_BOOTLOADER
+
+/*
+   If STATISTICS is set, the firmware measures its wake time, the time spent in the I2C
+   callbacks and counts I2C transactions, errors and EEPROM writes (see handleStatistics.ino).
+   The values can be read via the statistics register.
+ */
+#define STATISTICS
+
 /*
    Our version number - used by the daemon to ensure that the major number is equal between firmware and daemon
 */
 static const uint32_t MAJOR = 2;
-static const uint32_t MINOR = 14;
-static const uint32_t PATCH = 2;
+static const uint32_t MINOR = 18;
+static const uint32_t PATCH = 0;
+
+/*
+   The compile options of the build, a bit each. The daemon e.g. only reads the statistics
+   register if the firmware has been built with STATISTICS.
+ */
+#if defined STATISTICS
+static const uint32_t OPTION_STATISTICS              = 0x01;
+#else
+static const uint32_t OPTION_STATISTICS              = 0;
+#endif
+#if defined EXT_VOLTAGE_COMPARATOR
+static const uint32_t OPTION_EXT_VOLTAGE_COMPARATOR  = 0x02;
+#else
+static const uint32_t OPTION_EXT_VOLTAGE_COMPARATOR  = 0;
+#endif
+#if defined I2C_BOOTLOADER
+static const uint32_t OPTION_I2C_BOOTLOADER          = 0x04;
+#else
+static const uint32_t OPTION_I2C_BOOTLOADER          = 0;
+#endif
+static const uint32_t BUILD_OPTIONS = OPTION_STATISTICS | OPTION_EXT_VOLTAGE_COMPARATOR | OPTION_I2C_BOOTLOADER;
+
+/*
+   Store major and minor version and the patch level in a constant, the highest byte holds
+   the compile options
+ */
+static const uint32_t prog_version = (BUILD_OPTIONS << 24) | (MAJOR << 16) | (MINOR << 8) | PATCH;
 
 /*
    Flash size definition
@@ -57,13 +128,16 @@ static const uint32_t PATCH = 2;
 static const uint8_t LED_BUTTON        =   PB4;    // combined led/button pin
 static const uint8_t PIN_SWITCH        =   PB1;    // pin used for pushing the switch (the normal way to reset the RPi)
 static const uint8_t PIN_RESET         =   PB5;    // Reset pin (used as an alternative direct way to reset the RPi)
+static const uint8_t PIN_ATTENTION     =   PB5;    // active-low attention line to the RPi (only with ATTENTION_LINE)
+static const uint8_t PIN_SDA           =   PB0;    // I2C data, used by the USI (see handleUSI.ino)
+static const uint8_t PIN_SCL           =   PB2;    // I2C clock, used by the USI (see handleUSI.ino)
 // The following pin definition is needed as a define statement to allow the macro expansion in handleVoltages.ino
 #define EXT_VOLTAGE                        ADC3    // ADC number, used to measure external or RPi voltage (Ax, ADCx or x)
+static const uint8_t PIN_EXT_VOLTAGE   =   PB3;    // the pin of EXT_VOLTAGE, only used as analog input (see handlePower.ino)
 
 
 #if defined SERIAL_DEBUG
 #  include <ATtinySerialOut.h>
-#  include <avr/pgmspace.h>
 #endif
 
 /*
@@ -72,7 +146,26 @@ static const uint8_t PIN_RESET         =   PB5;    // Reset pin (used as an alte
 static const uint8_t  BLINK_TIME       =    100;  // time in milliseconds for the LED to blink
 static const uint16_t MIN_POWER_LEVEL  =   4700;  // the voltage level seen as "ON" at the external voltage after a reset
 static const uint8_t  NUM_MEASUREMENTS =      5;  // the number of ADC measurements we average, should be larger than 4
+static const uint8_t  ADC_SETTLE_CONVERSIONS = 12;  // the number of throw-away ADC conversions while the reference voltage settles (>1ms)
 static const uint8_t  SW_TO_PULSE_DIV  =      4;  // The divisor from switch_delay_revocery to delay between multiple pulses
+static const uint8_t  EEPROM_QUIET_SECONDS = 2;  // the number of seconds without register writes before writing the EEPROM
+static const uint8_t  HISTORY_SIZE     =     32;  // the number of entries in the telemetry history (3 bytes of RAM each)
+static const uint8_t  HISTORY_WAKEUPS  =     60;  // a history entry is recorded every HISTORY_WAKEUPS wake-ups
+static const uint8_t  VOLTAGE_SLOPE    =     10;  // the change in mV per second below which voltages are seen as stable
+static const uint8_t  STABLE_WAKEUPS   =     10;  // the number of wake-ups with stable voltages before the longest sleep is used
+static const uint8_t  ESTIMATOR_PERIOD =     64;  // the seconds over which the discharge rate is measured
+static const uint8_t  PULSE_QUEUE_SIZE =     16;  // the number of steps the pulse sequencer can hold (3 bytes of RAM each)
+static const uint8_t  BUTTON_QUEUE_SIZE =     4;  // the number of button edges waiting for the classification (3 bytes of RAM each)
+static const uint8_t  BUTTON_DEBOUNCE  =     32;  // edges of the button within this time (ms) after the last one are bounces
+static const uint16_t BUTTON_LONG_PRESS =  1000;  // the time (ms) the button has to be held for a long press
+static const uint16_t BUTTON_DOUBLE_GAP =   400;  // the maximum time (ms) between the presses of a double press
+
+/*
+   The I2C bootloader (option I2C_BOOTLOADER). The values have to match ATTinyBoot.c.
+*/
+static const uint16_t BOOTLOADER_START =  0x1C00;  // the flash address of the bootloader (the last 1K)
+static const uint16_t BOOTLOADER_APP_END = BOOTLOADER_START - SPM_PAGESIZE;  // the last page below is the reset page of the bootloader
+static const uint8_t  BOOTLOADER_MAGIC =    0xB7;  // written to the bootloader register and handed over in GPIOR0
 
 /*
    Values modelling the different states the system can be in
@@ -116,14 +209,23 @@ enum EEPROM_Address {
   switch_recovery_delay         = 29,      // uint16_t
   led_off_mode                  = 31,      // uint8_t
   vext_off_is_shutdown          = 32,      // uint8_t
+  discharge_curve               = 33,      // uint16_t[DISCHARGE_CURVE_POINTS]
+  bat_voltage_filter            = 49,      // uint8_t
+  ext_voltage_filter            = 50,      // uint8_t
+  temperature_filter            = 51,      // uint8_t
+  i2c_address                   = 52,      // uint8_t
+  journal                       = 128,     // start of the journal for frequently changed registers (see handleEEPROM.ino)
 } __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
 }
 
+static const int EEPROM_SIZE           = E2END + 1;  // 512 bytes on the ATTiny85
+
 /* 
    We create an EEPROM init value from the lower bits of the minor version number (BITS_FOR_MINOR)
    and use the remaining bits for the lower bits of the major number (BITS_FOR_MAJOR).
    This way, whenever the minor or major version changes, the eeprom will be initialized again to
-   ensure that everything works without problems.
+   ensure that everything works without problems. Only a valid I2C address is kept, the node
+   has to stay reachable on the address it has been moved to (see read_or_init_EEPROM()).
 */
 static const uint8_t BITS_FOR_MINOR    = 5;
 static const uint8_t BITS_FOR_MAJOR    = CHAR_BIT - BITS_FOR_MINOR;
@@ -134,7 +236,10 @@ static const uint8_t EEPROM_INIT_VALUE = MAJOR_PART | MINOR_PART;
 /*
    I2C interface and register definitions
 */
-static const uint8_t I2C_ADDRESS       = 0x37;
+static const uint8_t  I2C_ADDRESS          = 0x37;  // the default, the address is stored in the EEPROM
+static const uint8_t  I2C_MIN_ADDRESS      = 0x08;  // the 7-bit addresses below and above are reserved
+static const uint8_t  I2C_MAX_ADDRESS      = 0x77;
+static const uint16_t I2C_HANDOVER_TIMEOUT = 5000;  // ms to confirm a new address (see handleI2C.ino)
 
 enum class Register : uint8_t {
   last_access                   = 0x01,
@@ -144,23 +249,38 @@ enum class Register : uint8_t {
   bat_voltage_constant          = 0x14,
   ext_voltage_coefficient       = 0x15,
   ext_voltage_constant          = 0x16,
+  bat_voltage_filter            = 0x17,
+  ext_voltage_filter            = 0x18,
   timeout                       = 0x21,
   primed                        = 0x22,
   should_shutdown               = 0x23,
   force_shutdown                = 0x24,
   led_off_mode                  = 0x25,
+  button_gesture                = 0x26,
   restart_voltage               = 0x31,
   warn_voltage                  = 0x32,
   ups_shutdown_voltage          = 0x33,
   temperature                   = 0x41,
   temperature_coefficient       = 0x42,
   temperature_constant          = 0x43,
+  temperature_filter            = 0x44,
   ups_configuration             = 0x51,
   pulse_length                  = 0x52,
   switch_recovery_delay         = 0x53,
   vext_off_is_shutdown          = 0x54,
   pulse_length_on               = 0x55,
   pulse_length_off              = 0x56,
+  i2c_address                   = 0x57,
+  discharge_curve_0             = 0x61,
+  discharge_curve_1             = 0x62,
+  discharge_curve_2             = 0x63,
+  discharge_curve_3             = 0x64,
+  discharge_curve_4             = 0x65,
+  discharge_curve_5             = 0x66,
+  discharge_curve_6             = 0x67,
+  discharge_curve_7             = 0x68,
+  state_of_charge               = 0x69,
+  time_to_shutdown              = 0x6A,
   version                       = 0x80,
   fuse_low                      = 0x81,
   fuse_high                     = 0x82,
@@ -168,10 +288,66 @@ enum class Register : uint8_t {
   internal_state                = 0x84,
   uptime                        = 0x85,
   mcu_status_register           = 0x86,
+  snapshot                      = 0x87,
+  history_count                 = 0x88,
+  history                       = 0x89,
+  wakeup_interval               = 0x8A,
+  batch_write                   = 0x8B,
+  statistics                    = 0x8C,
+  config_hash                   = 0x8D,
+  bootloader                    = 0x8E,
 
   init_eeprom                   = 0xFF,
 }; // __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
 
+/*
+   The snapshot register returns the current telemetry in a single I2C transaction.
+   The struct is packed to get a well-defined layout (little endian, no padding) that
+   can be decoded on the RPi side. Together with the CRC it has to fit into the
+   32 bytes of an SMBus block read.
+*/
+struct Snapshot {
+  uint16_t bat_voltage;
+  uint16_t ext_voltage;
+  uint16_t temperature;
+  uint16_t seconds;
+  uint8_t  state;
+  uint8_t  should_shutdown;
+  uint32_t uptime;
+  uint8_t  state_of_charge;
+  uint16_t time_to_shutdown;
+} __attribute__ ((__packed__));
+
+/*
+   The telemetry history is a ring buffer of History_Entry values in RAM (see handleHistory.ino).
+   To fit into the 512 bytes of SRAM of the ATTiny85 the values are scaled to 8 bit:
+     bat_voltage  = (mV - HISTORY_BAT_OFFSET) / HISTORY_BAT_SCALE   (2000mV - 4550mV)
+     ext_voltage  = mV / HISTORY_EXT_SCALE                           (0mV - 6375mV)
+     temperature  = degrees Celsius, signed
+   The history register returns a page of HISTORY_PAGE_ENTRIES entries, preceded by the
+   page number. Page 0 is the oldest entry. Writing a page number to the register selects
+   the page, writing 0 additionally freezes the current content for the following reads.
+   After a read the next page is selected.
+   A page of 5 entries is 16 bytes, 17 with the CRC. The page also sizes the transmit
+   buffer and lives on the stack of request_event(), so it is kept at the lower end
+   of the 16 - 32 bytes that fit into an SMBus block read.
+*/
+static const uint16_t HISTORY_BAT_OFFSET   = 2000;
+static const uint8_t  HISTORY_BAT_SCALE    =   10;
+static const uint8_t  HISTORY_EXT_SCALE    =   25;
+static const uint8_t  HISTORY_PAGE_ENTRIES =    5;
+
+struct History_Entry {
+  uint8_t bat_voltage;
+  uint8_t ext_voltage;
+  int8_t  temperature;
+} __attribute__ ((__packed__));
+
+struct History_Page {
+  uint8_t       page;
+  History_Entry entries[HISTORY_PAGE_ENTRIES];
+} __attribute__ ((__packed__));
+
 
 /*
    The shutdown levels
@@ -206,3 +382,351 @@ enum Value {
   check_ext_voltage             = bit(1),
 } __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
 }
+
+/*
+   The batch_write register allows to write several registers in a single I2C frame:
+     batch_write, count, (register, value)*count, CRC
+   The size of each value is the size of the register. The frame is applied only if all
+   registers exist, are writable, have a backing variable and the frame length matches.
+   Since this happens in the I2C interrupt the main loop never sees a partially applied
+   batch. Reading the register returns the status of the last batch and resets it to none.
+*/
+namespace Batch_Status {
+// this enum is in its own namespace and not declared as a class to keep the implicit conversion
+// to int when using it.
+enum Value {
+  none                          = 0,       // no batch received since the last read
+  applied                       = 1,       // the batch has been applied
+  rejected                      = 2,       // the batch was malformed and has not been applied
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+/*
+   The statistics register returns the following values in a single I2C transaction.
+   Times are in microseconds, values that don't fit are set to the maximum. Averages
+   are exponential moving averages over about the last 8 values. Writing 0 to the
+   register resets all values.
+*/
+struct Statistics {
+  uint16_t wake_time_avg;                  // the time between two sleeps
+  uint16_t wake_time_max;
+  uint16_t isr_time_avg;                   // the time spent in receive_event() and request_event()
+  uint16_t isr_time_max;
+  uint16_t i2c_transactions;               // the number of calls of receive_event() and request_event()
+  uint8_t  crc_errors;                     // the number of writes with a wrong CRC
+  uint8_t  oversized_frames;               // the number of writes larger than the receive buffer
+  uint16_t eeprom_writes;                  // the number of bytes written to the EEPROM
+} __attribute__ ((__packed__));
+
+/*
+   A measured time, acc holds the moving average multiplied by 2^STATISTICS_SHIFT,
+   see handleStatistics.ino.
+*/
+struct Time_Measurement {
+  uint32_t acc;
+  uint16_t max;
+};
+
+/*
+   Every measured channel has its own filter (see handleFilter.ino). The filter register of
+   a channel holds the mode in bits 7-6 and the parameter in bits 3-0:
+     none         the measured value is used as is
+     ema          exponential moving average, the new value has a weight of 1/2^parameter
+     median       median of the last parameter values (at most MEDIAN_SIZE)
+     fast_attack  a falling value is used immediately, a rising value is averaged like ema.
+                  This detects the loss of the external voltage on the first wake-up.
+*/
+namespace Filter_Mode {
+// this enum is in its own namespace and not declared as a class to keep the implicit conversion
+// to int when using it (this allows bit operations on the values).
+enum Value {
+  none                          = 0,
+  ema                           = bit(6),
+  median                        = bit(7),
+  fast_attack                   = bit(7) | bit(6),
+  mode_mask                     = bit(7) | bit(6),
+  parameter_mask                = 0x0F,
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+namespace Filter_Channel {
+// this enum is in its own namespace and not declared as a class to keep the implicit conversion
+// to int when using it as an index.
+enum Value {
+  bat_voltage                   = 0,
+  ext_voltage                   = 1,
+  temperature                   = 2,
+  count                         = 3,       // the number of channels
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+static const uint8_t MEDIAN_SIZE = 5;
+
+/*
+   The state of the filter of a channel. count is the number of values seen since the
+   last reset (up to MEDIAN_SIZE), 0 means that the next value initializes the filter.
+*/
+struct Filter {
+  uint32_t acc;                            // the average multiplied by 2^parameter (ema, fast_attack)
+  uint16_t values[MEDIAN_SIZE];            // the last values (median)
+  uint8_t  next;                           // the index of the next value (median)
+  uint8_t  count;
+};
+
+/*
+   The discharge curve maps the battery voltage to the state of charge (see handleEstimator.ino).
+   Point i is the voltage in mV at a state of charge of (DISCHARGE_CURVE_POINTS - 1 - i) /
+   (DISCHARGE_CURVE_POINTS - 1), i.e., point 0 is the voltage of a full battery and the last
+   point the voltage of an empty battery. The voltages have to be decreasing. Values between
+   two points are interpolated linearly. The default is a typical curve of a LiIon cell under load.
+   time_to_shutdown is the estimated time in minutes until the battery reaches ups_shutdown_voltage,
+   TIME_UNKNOWN if the battery is not discharging.
+*/
+static const uint8_t  DISCHARGE_CURVE_POINTS = 8;
+static const uint16_t TIME_UNKNOWN           = INT16_MAX;
+
+/*
+   A step of the pulse sequencer (see handlePulse.ino): the switch pin is set to level
+   (LOW or HIGH) and kept there for duration milliseconds.
+*/
+struct Pulse_Step {
+  uint8_t  level;
+  uint16_t duration;
+} __attribute__ ((__packed__));
+
+/*
+   An edge of the button (see handleButton.ino): pressed is true for a press, false for a
+   release, time is the lower 16 bits of the virtual clock.
+*/
+struct Button_Edge {
+  uint8_t  pressed;
+  uint16_t time;
+} __attribute__ ((__packed__));
+
+/*
+   The gestures of the button, reported in the button_gesture register. The RPi writes 0
+   after acting on a gesture.
+*/
+namespace Button_Gesture {
+// this enum is in its own namespace and not declared as a class to keep the implicit conversion
+// to int when using it.
+enum Value {
+  none                          = 0,
+  short_press                   = 1,
+  long_press                    = 2,
+  double_press                  = 3,
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+/*
+   The variables that back the registers. They are defined and documented in
+   ATTinyDaemon.ino, here we only declare them for the register table below.
+*/
+extern volatile State state;
+extern volatile uint8_t timeout;
+extern volatile uint8_t primed;
+extern volatile uint8_t should_shutdown;
+extern volatile uint8_t force_shutdown;
+extern volatile uint8_t ups_configuration;
+extern volatile uint8_t led_off_mode;
+extern volatile uint8_t button_gesture;
+extern volatile uint8_t i2c_address;
+extern volatile uint8_t vext_off_is_shutdown;
+extern volatile uint16_t bat_voltage;
+extern volatile uint16_t bat_voltage_coefficient;
+extern volatile int16_t  bat_voltage_constant;
+extern volatile uint16_t ext_voltage;
+extern volatile uint16_t ext_voltage_coefficient;
+extern volatile int16_t  ext_voltage_constant;
+extern volatile uint16_t restart_voltage;
+extern volatile uint16_t warn_voltage;
+extern volatile uint16_t ups_shutdown_voltage;
+extern volatile uint16_t seconds;
+extern volatile uint16_t temperature;
+extern volatile uint16_t temperature_coefficient;
+extern volatile int16_t  temperature_constant;
+extern volatile uint16_t pulse_length;
+extern volatile uint16_t pulse_length_on;
+extern volatile uint16_t pulse_length_off;
+extern volatile uint16_t switch_recovery_delay;
+extern uint8_t fuse_low;
+extern uint8_t fuse_high;
+extern uint8_t fuse_extended;
+extern uint8_t mcusr_mirror;
+extern uint8_t history_count;
+extern volatile uint8_t wakeup_interval;
+extern volatile uint16_t discharge_curve[DISCHARGE_CURVE_POINTS];
+extern volatile uint8_t bat_voltage_filter;
+extern volatile uint8_t ext_voltage_filter;
+extern volatile uint8_t temperature_filter;
+extern volatile uint8_t state_of_charge;
+extern volatile uint16_t time_to_shutdown;
+
+/*
+   The flags describing how a register is handled when it is written
+*/
+namespace Register_Flag {
+// this enum is in its own namespace and not declared as a class to keep the implicit conversion
+// to int when using it (this allows bit operations on the values).
+enum Flag {
+  none                          = 0,
+  writable                      = bit(0),  // the register can be written by the RPi
+  reset_filters                 = bit(1),  // writing resets the filters of the measured values
+  or_value                      = bit(2),  // the written value is OR-ed to the variable, 0 resets it
+  check_ext_voltage             = bit(3),  // writing a value != 0 forces checking the external voltage
+  journaled                     = bit(4),  // the value is stored in the EEPROM journal instead of its address
+  recalc_calibration            = bit(5),  // writing changes the multipliers used for the calibration
+  handover                      = bit(6),  // the value is taken over when the RPi confirms it (see handleI2C.ino)
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+/*
+   The register table describes every register with its backing variable, the size,
+   the EEPROM address (0 if not stored in the EEPROM) and the flags defining what
+   happens when it is written. Registers without a backing variable (address is
+   nullptr) are computed when they are read (size is the size of the read data)
+   and trigger an action when written (see write_computed_register()).
+   The table is stored in flash and has to be sorted by register number. Registers
+   with the same upper nibble (a group) have to have consecutive numbers. This allows
+   us to find a register in constant time using register_group_base (see below).
+*/
+struct Register_Descriptor {
+  Register number;
+  const volatile void *address;
+  uint8_t size;
+  uint8_t eeprom_address;
+  uint8_t flags;
+};
+
+constexpr Register_Descriptor register_table[] PROGMEM = {
+  { Register::last_access,             &seconds,                 sizeof(seconds),                 0,                                        Register_Flag::none },
+  { Register::bat_voltage,             &bat_voltage,             sizeof(bat_voltage),             0,                                        Register_Flag::none },
+  { Register::ext_voltage,             &ext_voltage,             sizeof(ext_voltage),             0,                                        Register_Flag::none },
+  { Register::bat_voltage_coefficient, &bat_voltage_coefficient, sizeof(bat_voltage_coefficient), EEPROM_Address::bat_voltage_coefficient,  Register_Flag::writable | Register_Flag::reset_filters | Register_Flag::recalc_calibration },
+  { Register::bat_voltage_constant,    &bat_voltage_constant,    sizeof(bat_voltage_constant),    EEPROM_Address::bat_voltage_constant,     Register_Flag::writable | Register_Flag::reset_filters },
+  { Register::ext_voltage_coefficient, &ext_voltage_coefficient, sizeof(ext_voltage_coefficient), EEPROM_Address::ext_voltage_coefficient,  Register_Flag::writable | Register_Flag::reset_filters | Register_Flag::recalc_calibration },
+  { Register::ext_voltage_constant,    &ext_voltage_constant,    sizeof(ext_voltage_constant),    EEPROM_Address::ext_voltage_constant,     Register_Flag::writable | Register_Flag::reset_filters },
+  { Register::bat_voltage_filter,      &bat_voltage_filter,      sizeof(bat_voltage_filter),      EEPROM_Address::bat_voltage_filter,       Register_Flag::writable | Register_Flag::reset_filters },
+  { Register::ext_voltage_filter,      &ext_voltage_filter,      sizeof(ext_voltage_filter),      EEPROM_Address::ext_voltage_filter,       Register_Flag::writable | Register_Flag::reset_filters },
+  { Register::timeout,                 &timeout,                 sizeof(timeout),                 EEPROM_Address::timeout,                  Register_Flag::writable },
+  { Register::primed,                  &primed,                  sizeof(primed),                  EEPROM_Address::primed,                   Register_Flag::writable | Register_Flag::journaled },
+  { Register::should_shutdown,         &should_shutdown,         sizeof(should_shutdown),         0,                                        Register_Flag::writable | Register_Flag::or_value },
+  { Register::force_shutdown,          &force_shutdown,          sizeof(force_shutdown),          EEPROM_Address::force_shutdown,           Register_Flag::writable | Register_Flag::journaled },
+  { Register::led_off_mode,            &led_off_mode,            sizeof(led_off_mode),            EEPROM_Address::led_off_mode,             Register_Flag::writable },
+  { Register::button_gesture,          &button_gesture,          sizeof(button_gesture),          0,                                        Register_Flag::writable },
+  { Register::restart_voltage,         &restart_voltage,         sizeof(restart_voltage),         EEPROM_Address::restart_voltage,          Register_Flag::writable },
+  { Register::warn_voltage,            &warn_voltage,            sizeof(warn_voltage),            EEPROM_Address::warn_voltage,             Register_Flag::writable },
+  { Register::ups_shutdown_voltage,    &ups_shutdown_voltage,    sizeof(ups_shutdown_voltage),    EEPROM_Address::ups_shutdown_voltage,     Register_Flag::writable },
+  { Register::temperature,             &temperature,             sizeof(temperature),             0,                                        Register_Flag::none },
+  { Register::temperature_coefficient, &temperature_coefficient, sizeof(temperature_coefficient), EEPROM_Address::temperature_coefficient,  Register_Flag::writable | Register_Flag::reset_filters | Register_Flag::recalc_calibration },
+  { Register::temperature_constant,    &temperature_constant,    sizeof(temperature_constant),    EEPROM_Address::temperature_constant,     Register_Flag::writable | Register_Flag::reset_filters },
+  { Register::temperature_filter,      &temperature_filter,      sizeof(temperature_filter),      EEPROM_Address::temperature_filter,       Register_Flag::writable | Register_Flag::reset_filters },
+  { Register::ups_configuration,       &ups_configuration,       sizeof(ups_configuration),       EEPROM_Address::ups_configuration,        Register_Flag::writable },
+  { Register::pulse_length,            &pulse_length,            sizeof(pulse_length),            EEPROM_Address::pulse_length,             Register_Flag::writable },
+  { Register::switch_recovery_delay,   &switch_recovery_delay,   sizeof(switch_recovery_delay),   EEPROM_Address::switch_recovery_delay,    Register_Flag::writable },
+  { Register::vext_off_is_shutdown,    &vext_off_is_shutdown,    sizeof(vext_off_is_shutdown),    EEPROM_Address::vext_off_is_shutdown,     Register_Flag::writable | Register_Flag::check_ext_voltage },
+  { Register::pulse_length_on,         &pulse_length_on,         sizeof(pulse_length_on),         EEPROM_Address::pulse_length_on,          Register_Flag::writable },
+  { Register::pulse_length_off,        &pulse_length_off,        sizeof(pulse_length_off),        EEPROM_Address::pulse_length_off,         Register_Flag::writable },
+  { Register::i2c_address,             &i2c_address,             sizeof(i2c_address),             EEPROM_Address::i2c_address,              Register_Flag::writable | Register_Flag::handover },
+  { Register::discharge_curve_0,       &discharge_curve[0],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 0,      Register_Flag::writable },
+  { Register::discharge_curve_1,       &discharge_curve[1],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 2,      Register_Flag::writable },
+  { Register::discharge_curve_2,       &discharge_curve[2],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 4,      Register_Flag::writable },
+  { Register::discharge_curve_3,       &discharge_curve[3],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 6,      Register_Flag::writable },
+  { Register::discharge_curve_4,       &discharge_curve[4],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 8,      Register_Flag::writable },
+  { Register::discharge_curve_5,       &discharge_curve[5],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 10,     Register_Flag::writable },
+  { Register::discharge_curve_6,       &discharge_curve[6],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 12,     Register_Flag::writable },
+  { Register::discharge_curve_7,       &discharge_curve[7],      sizeof(discharge_curve[0]),      EEPROM_Address::discharge_curve + 14,     Register_Flag::writable },
+  { Register::state_of_charge,         &state_of_charge,         sizeof(state_of_charge),         0,                                        Register_Flag::none },
+  { Register::time_to_shutdown,        &time_to_shutdown,        sizeof(time_to_shutdown),        0,                                        Register_Flag::none },
+  { Register::version,                 &prog_version,            sizeof(prog_version),            0,                                        Register_Flag::none },
+  { Register::fuse_low,                &fuse_low,                sizeof(fuse_low),                0,                                        Register_Flag::none },
+  { Register::fuse_high,               &fuse_high,               sizeof(fuse_high),               0,                                        Register_Flag::none },
+  { Register::fuse_extended,           &fuse_extended,           sizeof(fuse_extended),           0,                                        Register_Flag::none },
+  { Register::internal_state,          &state,                   sizeof(state),                   0,                                        Register_Flag::none },
+  { Register::uptime,                  nullptr,                  sizeof(uint32_t),                0,                                        Register_Flag::none },
+  { Register::mcu_status_register,     &mcusr_mirror,            sizeof(mcusr_mirror),            0,                                        Register_Flag::none },
+  { Register::snapshot,                nullptr,                  sizeof(Snapshot),                0,                                        Register_Flag::none },
+  { Register::history_count,           &history_count,           sizeof(history_count),           0,                                        Register_Flag::none },
+  { Register::history,                 nullptr,                  sizeof(History_Page),            0,                                        Register_Flag::writable },
+  { Register::wakeup_interval,         &wakeup_interval,         sizeof(wakeup_interval),         0,                                        Register_Flag::none },
+  { Register::batch_write,             nullptr,                  sizeof(uint8_t),                 0,                                        Register_Flag::writable },
+#if defined STATISTICS
+  { Register::statistics,              nullptr,                  sizeof(Statistics),              0,                                        Register_Flag::writable },
+#else
+  // keeps the numbers of the group consecutive, the register is neither read nor written
+  { Register::statistics,              nullptr,                  0,                               0,                                        Register_Flag::none },
+#endif
+  { Register::config_hash,             nullptr,                  sizeof(uint16_t),                0,                                        Register_Flag::none },
+#if defined I2C_BOOTLOADER
+  { Register::bootloader,              nullptr,                  sizeof(uint8_t),                 0,                                        Register_Flag::writable },
+#endif
+  { Register::init_eeprom,             nullptr,                  sizeof(uint8_t),                 0,                                        Register_Flag::writable },
+};
+
+static const uint8_t NUM_REGISTERS = sizeof(register_table) / sizeof(register_table[0]);
+static const uint8_t NUM_DIRTY_BYTES = (NUM_REGISTERS + CHAR_BIT - 1) / CHAR_BIT;
+
+/*
+   The following functions are evaluated by the compiler. register_group_base() calculates
+   for a group (upper nibble of the register number) the index in register_table that the
+   register with the lower nibble 0 would have, i.e., the index of a register is
+   register_group_base[number >> 4] + (number & 0xF). Groups without registers get a value
+   that leads to an index whose register number does not match.
+   register_table_is_sorted() verifies the preconditions for this calculation.
+*/
+constexpr uint8_t register_number_of(uint8_t i) {
+  return static_cast<uint8_t>(register_table[i].number);
+}
+
+constexpr uint8_t register_group_base_of(uint8_t group, uint8_t i = 0) {
+  return i >= NUM_REGISTERS ? 0
+         : (register_number_of(i) >> 4) == group ? static_cast<uint8_t>(i - (register_number_of(i) & 0x0F))
+         : register_group_base_of(group, i + 1);
+}
+
+constexpr bool register_table_is_sorted(uint8_t i = 1) {
+  return i >= NUM_REGISTERS ? true
+         : register_number_of(i) > register_number_of(i - 1)
+           && ((register_number_of(i) >> 4) != (register_number_of(i - 1) >> 4)
+               || register_number_of(i) == register_number_of(i - 1) + 1)
+           && register_table_is_sorted(i + 1);
+}
+
+static_assert(register_table_is_sorted(), "register_table has to be sorted with consecutive numbers in each group");
+
+/*
+   The size of the largest register, used for the transmit buffer of the I2C slave
+   (see handleUSI.ino).
+*/
+constexpr uint8_t max_register_size(uint8_t i = 0, uint8_t size = 0) {
+  return i >= NUM_REGISTERS ? size
+         : max_register_size(i + 1, register_table[i].size > size ? register_table[i].size : size);
+}
+
+static const uint8_t TX_BUFFER_SIZE = max_register_size();
+
+/*
+   The journal occupies the EEPROM from EEPROM_Address::journal to the end of the EEPROM.
+   It consists of JOURNAL_SLOTS records, each holding a sequence number, the values of
+   all registers flagged as journaled in the register table and a CRC8 (see handleEEPROM.ino).
+   For these registers the EEPROM address only holds the value written when the EEPROM is
+   initialized. The number of slots has to stay below 128 to allow the serial number
+   arithmetic on the sequence number.
+*/
+constexpr uint8_t journal_data_size(uint8_t i = 0) {
+  return i >= NUM_REGISTERS ? 0
+         : ((register_table[i].flags & Register_Flag::journaled) ? register_table[i].size : 0)
+           + journal_data_size(i + 1);
+}
+
+static const uint8_t JOURNAL_RECORD_SIZE = journal_data_size() + 2;   // sequence number + data + CRC8
+static const uint8_t JOURNAL_SLOTS = (EEPROM_SIZE - EEPROM_Address::journal) / JOURNAL_RECORD_SIZE;
+
+static_assert(JOURNAL_SLOTS < 128, "the journal needs less than 128 slots for the sequence number arithmetic");
+
+const uint8_t register_group_base[16] PROGMEM = {
+  register_group_base_of(0x0), register_group_base_of(0x1), register_group_base_of(0x2), register_group_base_of(0x3),
+  register_group_base_of(0x4), register_group_base_of(0x5), register_group_base_of(0x6), register_group_base_of(0x7),
+  register_group_base_of(0x8), register_group_base_of(0x9), register_group_base_of(0xA), register_group_base_of(0xB),
+  register_group_base_of(0xC), register_group_base_of(0xD), register_group_base_of(0xE), register_group_base_of(0xF),
+};
@@ -6,11 +6,6 @@
    it accordingly by writing the bootloader to burn the related fuses.
 */
 
-/*
-   Store major and minor version and the patch level in a constant
- */
-static const uint32_t prog_version = (MAJOR << 16) | (MINOR << 8) | PATCH;
-
 /*
    The state variable encapsulates the all-over state of the system (ATTiny and RPi
    together).
@@ -89,17 +84,28 @@ volatile uint16_t switch_recovery_delay   = 1000;   // the pause needed between
 uint8_t mcusr_mirror = 0;
 
 /*
-   This variable signals that I2C registers that are stored in the EEPROM have been updated.
-   This happens in the I2C receive_event() function. Setting this variable leads to a call
-   to the write_EEPROM() function in the main loop.
+   These variables signal that I2C registers that are stored in the EEPROM have been updated.
+   This happens in the I2C receive_event() function. eeprom_dirty holds one bit per entry of
+   the register table, eeprom_quiet_seconds is set to EEPROM_QUIET_SECONDS on every write and
+   counted down by the virtual clock (see handleWatchdog.ino). When it reaches 0 the main loop
+   writes the changed registers to the EEPROM (see write_dirty_EEPROM()). This coalesces a
+   burst of writes into a single write back.
+ */
+volatile uint8_t eeprom_dirty[NUM_DIRTY_BYTES];
+volatile uint8_t eeprom_quiet_seconds = 0;
+
+/*
+   This variable signals that the filters of the measured values have to be reset since a
+   coefficient, a constant or a filter setting has been changed
  */
-volatile bool update_eeprom = false;
+volatile uint8_t reset_filters = false;
 
 /*
-   This variable signals that the bat voltage has to be reset since coefficient or constant
-   have been changed
+   This variable signals that a coefficient has been changed and the multipliers used for
+   the calibration have to be calculated again (see update_calibration()). It is initially
+   set to calculate them from the values read from the EEPROM.
  */
-volatile uint8_t reset_bat_voltage = false;
+volatile uint8_t recalc_calibration = true;
 
 void setup() {
   mcusr_mirror = MCUSR;
@@ -116,6 +122,8 @@ void setup() {
 
   check_fuses();      // verify that we can run with the fuse settings
 
+  init_power();       // turn off the unused peripherals
+
   /*
      If we got a reset while pulling down the switch, this might lead to short
      spike on switch pin. Shouldn't be a problem because we can stop the RPi
@@ -131,37 +139,17 @@ void setup() {
   init_I2C();
 }
 
-/*
-   This interrupt function will be executed whenever we press the button.
-   If the Raspberry is alive (i.e. no timeout) then the button
-   press is interpreted as a shutdown command.
-   If the Raspberry has been shutdown, primed is not set and the button
-   is pressed we want to restart the Raspberry. We set primed temporarily
-   to trigger a restart in the main loop.
-*/
-ISR (PCINT0_vect) {
-
-  disable_watchdog();
-  /*
-  if (seconds > timeout && primed == 0) {
-    primed = 2;
-    // could be set during the shutdown while the timeout has not yet been exceeded. We reset it.
-    should_shutdown = Shutdown_Cause::none;
-  } else {
-    // signal the Raspberry that the button has been pressed.
-    should_shutdown |= Shutdown_Cause::button;
-  }
-  */
-  should_shutdown |= Shutdown_Cause::button;
-  tried_reset = false;
-}
-
 void loop() {
+  handle_button();
   handle_state();
-  if(update_eeprom) {
-    update_eeprom = false;
-    write_EEPROM();
-  }
+  handle_pulse();
+  handle_attention();
+  handle_history();
+  handle_estimator();
+  handle_handover();
+  handle_EEPROM();
+  handle_I2C();
+  handle_bootloader();
 
   handle_sleep();
 }
@@ -172,17 +160,39 @@ void loop() {
    Since we are going into SLEEP_MODE_PWR_DOWN all power domains are shut down and
    only a very few wake-up sources are still active (USI Start Condition, Watchdog
    Interrupt, INT0 and Pin Change). See data sheet ch. 7.1, p. 34.
+   The USI overflow interrupt is not among them, so during an I2C transfer we only
+   go to SLEEP_MODE_IDLE and are woken by the next byte.
+   The same holds for the analog comparator watching the external voltage (see
+   handleVoltages.ino). In this case Timer0 is stopped during the sleep, its overflow
+   interrupt would wake us every 2ms.
+   A start condition or the comparator interrupt can arrive after the sleep mode has been
+   chosen, both are checked again with interrupts disabled and cancel the sleep. The loop
+   then handles them and chooses the sleep mode again.
    Taken in part from http://www.gammon.com.au/power
  */
 void handle_sleep() {
-  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  count_wake_time();
+  reset_watchdog();         // enables the interrupts, so it is called before the timed sequence
+  bool power_down = !i2c_busy() && !ext_voltage_watched();
+  bool comparator_idle = !i2c_busy() && !power_down;
+  set_sleep_mode(power_down ? SLEEP_MODE_PWR_DOWN : SLEEP_MODE_IDLE);
+  if (comparator_idle) {
+    power_timer0_disable();
+  }
   noInterrupts();           // timed sequence follows
-  reset_watchdog();
   sleep_enable();
+  if (power_down && i2c_busy()) {
+    sleep_disable();        // a transfer has started in the meantime, power down would hold SCL
+  }
+  if (comparator_idle && !ext_voltage_watched()) {
+    sleep_disable();        // the comparator has fired in the meantime, act on it right away
+  }
   sleep_bod_disable();
   interrupts();             // guarantees next instruction executed
   sleep_cpu();
   sleep_disable();  
+  power_timer0_enable();
+  start_wake_time();
 }
 
 /*
@@ -0,0 +1,63 @@
+/*
+   The hand-over to the I2C bootloader (compile option I2C_BOOTLOADER, see
+   ../ATTinyBoot/ATTinyBoot.c). The RPi writes BOOTLOADER_MAGIC to the bootloader register,
+   handle_bootloader() then jumps to the bootloader from the main loop once the I2C transfer
+   is complete. The bootloader reads our I2C address from the EEPROM, so pending EEPROM
+   writes are done before the jump. It leaves the other pins as they are, the RPi stays
+   powered while it is updated.
+   A firmware update is refused in warn_state or worse, while a pulse sequence is running
+   and while the UPS is about to be turned on again: the switch pin would be frozen and the
+   bootloader doesn't watch the battery.
+*/
+volatile uint8_t bootloader_requested = false;
+
+/*
+   The entry point of the bootloader, function pointers are word addresses. The host build
+   replaces it (see ../host/include/avr/boot.h).
+*/
+#if !defined BOOTLOADER_ENTRY
+#define BOOTLOADER_ENTRY ((void (*)(void)) (BOOTLOADER_START / 2))
+#endif
+
+/*
+   This variable signals that the UPS is turned on after the pulse sequence. Declaration in handlePulse.
+*/
+extern volatile bool pending_ups_on;
+
+/*
+   Called from the main loop. Jumps to the bootloader if it has been requested, the
+   bootloader restarts the firmware with a watchdog reset.
+*/
+void handle_bootloader() {
+#if defined I2C_BOOTLOADER
+  if (!bootloader_requested || i2c_busy()) {
+    return;
+  }
+  bootloader_requested = false;
+  if (!bootloader_allowed()) {
+    return;
+  }
+  write_dirty_EEPROM();
+
+  noInterrupts();
+  GPIOR0 = BOOTLOADER_MAGIC;
+  BOOTLOADER_ENTRY();
+#endif
+}
+
+/*
+   Returns true if the firmware can be updated now.
+*/
+bool bootloader_allowed() {
+  return state < State::warn_state && !pulse_sequence_running() && !pending_ups_on;
+}
+
+/*
+   The RPi requests the bootloader.
+   This function is called only by write_computed_register() during an interrupt.
+*/
+void request_bootloader_Int(uint8_t *data, uint8_t len) {
+  if (len == 1 && data[0] == BOOTLOADER_MAGIC && bootloader_allowed()) {
+    bootloader_requested = true;
+  }
+}
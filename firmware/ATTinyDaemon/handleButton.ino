@@ -0,0 +1,185 @@
+/*
+   The button is handled in two steps. The pin change interrupt debounces the edges and
+   puts them with their time into a queue, handle_button() classifies them in the main
+   loop into gestures (see Button_Gesture in ATTinyDaemon.h):
+     short_press   released before BUTTON_LONG_PRESS ms, no second press follows
+                   within BUTTON_DOUBLE_GAP ms
+     long_press    held for BUTTON_LONG_PRESS ms, reported while the button is still held
+     double_press  a second press within BUTTON_DOUBLE_GAP ms after a short press
+   The gesture is stored in button_gesture and signalled to the RPi with
+   Shutdown_Cause::button. The RPi resets both after acting on the gesture.
+
+   The times are taken from the virtual clock (see handleWatchdog.ino). While a gesture is
+   in progress the watchdog runs with its shortest period, so the clock advances in steps
+   of 16ms and the durations are measured with this resolution. An edge less than
+   BUTTON_DEBOUNCE ms after the last one is a bounce. If the last real edge is lost this
+   way, handle_button() picks up the level of the pin later.
+   The button shares its pin with the LED and can only be read while the LED is off, so
+   handle_state() doesn't flash the LED while a gesture is in progress.
+*/
+namespace Button_Phase {
+enum Value {
+  idle                          = 0,
+  pressed                       = 1,       // waiting for the release or the long press
+  released                      = 2,       // waiting for a second press
+  pressed_again                 = 3,       // waiting for the release of the second press
+  held                          = 4,       // the long press has been reported, waiting for the release
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+/*
+   The queue is a ring buffer, it is only accessed in atomic blocks or during the pin
+   change interrupt. A full queue drops the edge, handle_button() then picks up the
+   level of the pin.
+*/
+Button_Edge button_queue[BUTTON_QUEUE_SIZE];
+volatile uint8_t button_head = 0;                // the index of the oldest edge
+volatile uint8_t button_count = 0;               // the number of queued edges
+volatile uint8_t button_pressed = false;         // the debounced level of the button
+volatile uint16_t button_edge_time = 0;          // the time of the last accepted edge
+
+volatile uint8_t button_phase = Button_Phase::idle;
+uint16_t button_phase_time = 0;                  // the time the current phase started, main loop only
+volatile uint8_t button_gesture = Button_Gesture::none;
+
+/*
+   These variables hold the virtual clock and the current watchdog period. Declaration in handleWatchdog.
+*/
+extern volatile uint32_t clock_ms;
+extern volatile uint8_t watchdog_period;
+
+/*
+   This interrupt function will be executed whenever the level of the button pin changes.
+*/
+ISR (PCINT0_vect) {
+  sample_button_Int();
+}
+
+/*
+   Read the level of the button and queue an edge if it changed and is no bounce. The
+   clock has to run with the shortest watchdog period while the gesture is in progress.
+   Called with interrupts disabled.
+*/
+void sample_button_Int() {
+  if (!(GIMSK & bit(PCIE))) {
+    // the pin drives the LED
+    return;
+  }
+  // the button pulls the pin low against the pull-up
+  uint8_t pressed = !(PINB & bit(LED_BUTTON));
+  uint16_t now = clock_ms;
+  if (pressed == button_pressed || (uint16_t) (now - button_edge_time) < BUTTON_DEBOUNCE) {
+    return;
+  }
+  button_pressed = pressed;
+  button_edge_time = now;
+
+  if (button_count < BUTTON_QUEUE_SIZE) {
+    Button_Edge *edge = &button_queue[(button_head + button_count) % BUTTON_QUEUE_SIZE];
+    edge->pressed = pressed;
+    edge->time = now;
+    button_count++;
+  }
+
+  if (watchdog_period != 0) {
+    schedule_watchdog_Int();
+  }
+}
+
+/*
+   Returns true while a gesture is in progress. Called from the main loop and with
+   interrupts disabled by the watchdog schedule.
+*/
+bool button_gesture_running() {
+  return button_phase != Button_Phase::idle || button_count > 0 || button_pressed;
+}
+
+/*
+   Called from the main loop. Classifies the queued edges and reports a gesture when it
+   is complete.
+*/
+void handle_button() {
+  Button_Edge edge;
+  uint16_t now;
+  bool have_edge;
+
+  do {
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      if (button_count == 0) {
+        // catch up with a real edge that has been taken for a bounce
+        sample_button_Int();
+      }
+      have_edge = button_count > 0;
+      if (have_edge) {
+        edge = button_queue[button_head];
+        button_head = (button_head + 1) % BUTTON_QUEUE_SIZE;
+        button_count--;
+      }
+      now = clock_ms;
+    }
+
+    if (have_edge) {
+      classify_button_edge(&edge);
+    }
+  } while (have_edge);
+
+  uint16_t phase_duration = now - button_phase_time;
+  if (button_phase == Button_Phase::pressed && phase_duration >= BUTTON_LONG_PRESS) {
+    report_button_gesture(Button_Gesture::long_press);
+    button_phase = Button_Phase::held;
+  } else if (button_phase == Button_Phase::released && phase_duration >= BUTTON_DOUBLE_GAP) {
+    report_button_gesture(Button_Gesture::short_press);
+    button_phase = Button_Phase::idle;
+  }
+}
+
+/*
+   The transitions of the gesture classification for an edge.
+*/
+void classify_button_edge(Button_Edge *edge) {
+  uint16_t phase_duration = edge->time - button_phase_time;
+
+  switch (button_phase) {
+    case Button_Phase::idle:
+      if (edge->pressed) {
+        button_phase = Button_Phase::pressed;
+      }
+      break;
+    case Button_Phase::pressed:
+      if (phase_duration >= BUTTON_LONG_PRESS) {
+        report_button_gesture(Button_Gesture::long_press);
+        button_phase = Button_Phase::idle;
+      } else {
+        button_phase = Button_Phase::released;
+      }
+      break;
+    case Button_Phase::released:
+      if (phase_duration >= BUTTON_DOUBLE_GAP) {
+        // both edges have been handled late, the first press is complete
+        report_button_gesture(Button_Gesture::short_press);
+        button_phase = Button_Phase::pressed;
+      } else {
+        button_phase = Button_Phase::pressed_again;
+      }
+      break;
+    case Button_Phase::pressed_again:
+      report_button_gesture(Button_Gesture::double_press);
+      button_phase = Button_Phase::idle;
+      break;
+    case Button_Phase::held:
+      button_phase = Button_Phase::idle;
+      break;
+  }
+  button_phase_time = edge->time;
+}
+
+/*
+   Store the gesture and signal the RPi that the button has been pressed.
+*/
+void report_button_gesture(uint8_t gesture) {
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    button_gesture = gesture;
+    should_shutdown |= Shutdown_Cause::button;
+  }
+  tried_reset = false;
+}
@@ -1,8 +1,17 @@
 /*
    These methods calculate an 8-bit CRC based on the polynome used for Dallas / Maxim
    sensors (X^8+X^5+X^4+X^0).
-   A lot of implementations exist that are equally good. I took this one from
-   https://www.mikrocontroller.net/topic/155115
+   A lot of implementations exist that are equally good. The original bitwise version
+   was taken from https://www.mikrocontroller.net/topic/155115
+   We use the direct (non-augmented) formulation of the CRC which gives the same
+   result as the augmented one without the additional zero byte at the end. This
+   allows us to use lookup tables stored in flash.
+   The implementation is selected in ATTinyDaemon.h:
+     CRC8_TABLE         - 256 byte table, one lookup per byte (fastest)
+     CRC8_NIBBLE_TABLE  - 16 byte table, two lookups per byte
+     neither            - bitwise calculation, eight iterations per byte (smallest)
+   The calculation is done during the interrupt in the I2C callback routines,
+   keeping the clock stretching as short as possible.
    The variables here don't need to be volatile because they are only accessed
    during the interrupt in the I2C callback routines.
 
@@ -12,57 +21,110 @@
 const uint8_t CRC8INIT = 0x00;                         // The initalization value used for the CRC calculation
 const uint8_t CRC8POLY = 0x31;                         // The CRC8 polynome used: X^8+X^5+X^4+X^0
 
+#if defined CRC8_TABLE
+/*
+   crc8_table[i] contains the CRC register after shifting in the byte i,
+   generated for the polynome CRC8POLY.
+*/
+const uint8_t crc8_table[256] PROGMEM = {
+  0x00, 0x31, 0x62, 0x53, 0xC4, 0xF5, 0xA6, 0x97,
+  0xB9, 0x88, 0xDB, 0xEA, 0x7D, 0x4C, 0x1F, 0x2E,
+  0x43, 0x72, 0x21, 0x10, 0x87, 0xB6, 0xE5, 0xD4,
+  0xFA, 0xCB, 0x98, 0xA9, 0x3E, 0x0F, 0x5C, 0x6D,
+  0x86, 0xB7, 0xE4, 0xD5, 0x42, 0x73, 0x20, 0x11,
+  0x3F, 0x0E, 0x5D, 0x6C, 0xFB, 0xCA, 0x99, 0xA8,
+  0xC5, 0xF4, 0xA7, 0x96, 0x01, 0x30, 0x63, 0x52,
+  0x7C, 0x4D, 0x1E, 0x2F, 0xB8, 0x89, 0xDA, 0xEB,
+  0x3D, 0x0C, 0x5F, 0x6E, 0xF9, 0xC8, 0x9B, 0xAA,
+  0x84, 0xB5, 0xE6, 0xD7, 0x40, 0x71, 0x22, 0x13,
+  0x7E, 0x4F, 0x1C, 0x2D, 0xBA, 0x8B, 0xD8, 0xE9,
+  0xC7, 0xF6, 0xA5, 0x94, 0x03, 0x32, 0x61, 0x50,
+  0xBB, 0x8A, 0xD9, 0xE8, 0x7F, 0x4E, 0x1D, 0x2C,
+  0x02, 0x33, 0x60, 0x51, 0xC6, 0xF7, 0xA4, 0x95,
+  0xF8, 0xC9, 0x9A, 0xAB, 0x3C, 0x0D, 0x5E, 0x6F,
+  0x41, 0x70, 0x23, 0x12, 0x85, 0xB4, 0xE7, 0xD6,
+  0x7A, 0x4B, 0x18, 0x29, 0xBE, 0x8F, 0xDC, 0xED,
+  0xC3, 0xF2, 0xA1, 0x90, 0x07, 0x36, 0x65, 0x54,
+  0x39, 0x08, 0x5B, 0x6A, 0xFD, 0xCC, 0x9F, 0xAE,
+  0x80, 0xB1, 0xE2, 0xD3, 0x44, 0x75, 0x26, 0x17,
+  0xFC, 0xCD, 0x9E, 0xAF, 0x38, 0x09, 0x5A, 0x6B,
+  0x45, 0x74, 0x27, 0x16, 0x81, 0xB0, 0xE3, 0xD2,
+  0xBF, 0x8E, 0xDD, 0xEC, 0x7B, 0x4A, 0x19, 0x28,
+  0x06, 0x37, 0x64, 0x55, 0xC2, 0xF3, 0xA0, 0x91,
+  0x47, 0x76, 0x25, 0x14, 0x83, 0xB2, 0xE1, 0xD0,
+  0xFE, 0xCF, 0x9C, 0xAD, 0x3A, 0x0B, 0x58, 0x69,
+  0x04, 0x35, 0x66, 0x57, 0xC0, 0xF1, 0xA2, 0x93,
+  0xBD, 0x8C, 0xDF, 0xEE, 0x79, 0x48, 0x1B, 0x2A,
+  0xC1, 0xF0, 0xA3, 0x92, 0x05, 0x34, 0x67, 0x56,
+  0x78, 0x49, 0x1A, 0x2B, 0xBC, 0x8D, 0xDE, 0xEF,
+  0x82, 0xB3, 0xE0, 0xD1, 0x46, 0x77, 0x24, 0x15,
+  0x3B, 0x0A, 0x59, 0x68, 0xFF, 0xCE, 0x9D, 0xAC
+};
+
 /*
    This function adds the current byte of data to the existing CRC calculation in the
    variable reg.
 */
-unsigned char crc8_bytecalc(uint8_t data, uint8_t reg)
+uint8_t crc8_bytecalc(uint8_t data, uint8_t reg)
 {
-  uint8_t i;                                           // we assume we have less than 255 bytes data
-  uint8_t flag;                                        // flag for the MSB
-  uint8_t polynome = CRC8POLY;
+  return pgm_read_byte(&crc8_table[reg ^ data]);
+}
 
-  // for each bit of the byte
-  for (i = 0; i < 8; i++) {
-    if (reg & 0x80) flag = 1;                          // Test MSB of the register
-    else flag = 0;
-    reg <<= 1;                                         // Schiebe Register 1 Bit nach Links und
-    if (data & 0x80) reg |= 1;                         // Fill the LSB with the next data bit
-    data <<= 1;                                        // next bit of data
-    if (flag) reg ^= polynome;                         // if flag == 1 (MSB set) then XOR with polynome
-  }
+#elif defined CRC8_NIBBLE_TABLE
+/*
+   crc8_nibble_table[i] contains the CRC register after shifting in the nibble i
+   (4 bit), generated for the polynome CRC8POLY.
+*/
+const uint8_t crc8_nibble_table[16] PROGMEM = {
+  0x00, 0x31, 0x62, 0x53, 0xC4, 0xF5, 0xA6, 0x97,
+  0xB9, 0x88, 0xDB, 0xEA, 0x7D, 0x4C, 0x1F, 0x2E
+};
+
+/*
+   This function adds the current byte of data to the existing CRC calculation in the
+   variable reg, first the high and then the low nibble.
+*/
+uint8_t crc8_bytecalc(uint8_t data, uint8_t reg)
+{
+  reg ^= data;
+  reg = (reg << 4) ^ pgm_read_byte(&crc8_nibble_table[reg >> 4]);
+  reg = (reg << 4) ^ pgm_read_byte(&crc8_nibble_table[reg >> 4]);
   return reg;
 }
 
+#else
 /*
-   This function calculates the CRC8 of a msg using the function crc8_bytecalc().
-   This function is called only by receive_event() (handleI2C) during an interrupt.
+   This function adds the current byte of data to the existing CRC calculation in the
+   variable reg.
 */
-unsigned char crc8_message_calc(uint8_t *msg, uint8_t len)
+uint8_t crc8_bytecalc(uint8_t data, uint8_t reg)
 {
-  uint8_t reg = CRC8INIT;
   uint8_t i;
-  for (i = 0; i < len; i++) {
-    reg = crc8_bytecalc(msg[i], reg);      // calculate the CRC for the next byte of data and add it to reg
+
+  reg ^= data;                                         // the data is XORed into the register
+  // for each bit of the byte
+  for (i = 0; i < 8; i++) {
+    if (reg & 0x80) {                                  // Test MSB of the register
+      reg = (reg << 1) ^ CRC8POLY;                     // if MSB set then shift and XOR with polynome
+    } else {
+      reg <<= 1;
+    }
   }
-  return crc8_bytecalc(0, reg);      // The calculation has to be continued for the bit length of the polynome with 0 values
+  return reg;
 }
+#endif
 
 /*
-   This function calculates the CRC8 of a msg using the function crc8_bytecalc()
-   and writes the message followed by the crc to I2C.
-   This function is called only by request_event() (handleI2C) during an interrupt. 
+   This function calculates the CRC8 of a msg using the function crc8_bytecalc().
+   This function is called by receive_event() (handleI2C) during an interrupt and
+   for the records of the EEPROM journal (handleEEPROM).
 */
-
-void write_data_crc(uint8_t *msg, uint8_t len) {
+uint8_t crc8_message_calc(uint8_t *msg, uint8_t len)
+{
   uint8_t reg = CRC8INIT;
   uint8_t i;
-  reg = crc8_bytecalc((uint8_t) register_number, reg);
   for (i = 0; i < len; i++) {
-    reg = crc8_bytecalc(msg[i], reg);
+    reg = crc8_bytecalc(msg[i], reg);      // calculate the CRC for the next byte of data and add it to reg
   }
-  uint8_t crc = crc8_bytecalc(0, reg);
-
-  Wire.write(msg, len);
-  Wire.write(&crc, 1);
+  return reg;
 }
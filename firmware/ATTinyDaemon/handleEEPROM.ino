@@ -1,39 +1,20 @@
 /*
-   EEPROM class that works with volatile values. We add atomic access
-   to guarantee that only valid data is written to and read from 
-   the EEPROM.
+   The EEPROM is read and written using the register table (see ATTinyDaemon.h).
+   Every register with an EEPROM address is stored at this address using its size,
+   except for the journaled registers which are stored in the journal (see below).
+   We copy the values atomically to guarantee that only valid data is written to
+   and read from the EEPROM.
    We use int as the type for the index since the EEPROM size of the
    ATTiny85 is 512 bytes.
  */
-struct MyEEPROMClass : EEPROMClass {
-    // turn off warnings no return for non-void function
-    // we have to do this to ensure the minimum time spent in
-    // the atomic block
-    #pragma GCC diagnostic push
-    #pragma GCC diagnostic ignored "-Wreturn-type"
-
-    template< typename T > T &get( int idx, volatile T &t ){
-      T tmp;
-      EEPROMClass::get(idx, tmp);
-      ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        t = tmp;
-      }
-      // no return, the method works only through its side-effects
-    };
-    #pragma GCC diagnostic pop
-    template< typename T > const T &put( int idx, volatile T &t ){
-      T tmp;
-      ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        tmp = t;
-      }
-      EEPROMClass::put(idx, tmp);
-      return (T &)t;
-    };
-};
-static MyEEPROMClass MyEEPROM;
-
-
 
+/*
+   The position of the newest record in the journal and its sequence number.
+   JOURNAL_SLOTS - 1 as slot means that the next record is written to slot 0.
+   Only accessed from the main loop.
+ */
+uint8_t journal_slot = JOURNAL_SLOTS - 1;
+uint8_t journal_sequence = 0;
 
 /*
    Read the EEPROM if it contains valid data, otherwise initialize it.
@@ -47,40 +28,49 @@ void  read_or_init_EEPROM() {
   uint8_t writtenBefore;
   EEPROM.get(EEPROM_Address::base, writtenBefore);
   if (writtenBefore != EEPROM_INIT_VALUE) {
-    // no data has been written before, initialise EEPROM
+    // no data has been written before, initialise EEPROM. A firmware with another
+    // version may have moved us to another address, we keep it to stay reachable
+    uint8_t stored_address = EEPROM.read(EEPROM_Address::i2c_address);
+    if (valid_i2c_address(stored_address)) {
+      i2c_address = stored_address;
+    }
+    erase_journal();
     write_EEPROM();
   } else {
     read_EEPROM_values();
+    read_journal();
   }
 }
 
 /*
-   Read the values stored in the EEPROM. The addresses are defined in
-   the header file. We use the modern get()-method that determines the
-   object size itself, because the accompanying put()-method uses the
-   update()-function that checks whether the data has been modified
-   before it writes.
+   Read the values stored in the EEPROM. The addresses and sizes are
+   defined in the register table in the header file.
 */
 void read_EEPROM_values() {
-  MyEEPROM.get(EEPROM_Address::timeout, timeout);
-  MyEEPROM.get(EEPROM_Address::primed, primed);
-  MyEEPROM.get(EEPROM_Address::force_shutdown, force_shutdown);  
-  MyEEPROM.get(EEPROM_Address::restart_voltage, restart_voltage);
-  MyEEPROM.get(EEPROM_Address::warn_voltage, warn_voltage);
-  MyEEPROM.get(EEPROM_Address::ups_shutdown_voltage, ups_shutdown_voltage);
-  MyEEPROM.get(EEPROM_Address::bat_voltage_coefficient, bat_voltage_coefficient);
-  MyEEPROM.get(EEPROM_Address::bat_voltage_constant, bat_voltage_constant);
-  MyEEPROM.get(EEPROM_Address::ext_voltage_coefficient, ext_voltage_coefficient);
-  MyEEPROM.get(EEPROM_Address::ext_voltage_constant, ext_voltage_constant);
-  MyEEPROM.get(EEPROM_Address::temperature_coefficient, temperature_coefficient);
-  MyEEPROM.get(EEPROM_Address::temperature_constant, temperature_constant);
-  MyEEPROM.get(EEPROM_Address::ups_configuration, ups_configuration);
-  MyEEPROM.get(EEPROM_Address::pulse_length, pulse_length);
-  MyEEPROM.get(EEPROM_Address::pulse_length_on, pulse_length_on);
-  MyEEPROM.get(EEPROM_Address::pulse_length_off, pulse_length_off);
-  MyEEPROM.get(EEPROM_Address::switch_recovery_delay, switch_recovery_delay);
-  MyEEPROM.get(EEPROM_Address::led_off_mode, led_off_mode);
-  MyEEPROM.get(EEPROM_Address::vext_off_is_shutdown, vext_off_is_shutdown);
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    uint8_t eeprom_address = pgm_read_byte(&register_table[i].eeprom_address);
+    if (eeprom_address != 0) {
+      read_EEPROM_value(&register_table[i], eeprom_address);
+    }
+  }
+}
+
+/*
+   Read a single register value from the EEPROM and set the variable atomically.
+*/
+void read_EEPROM_value(const Register_Descriptor *descriptor, int eeprom_address) {
+  uint8_t tmp[sizeof(uint32_t)];
+  uint8_t size = pgm_read_byte(&descriptor->size);
+  uint8_t *address = register_address(descriptor);
+
+  for (uint8_t i = 0; i < size; i++) {
+    tmp[i] = EEPROM.read(eeprom_address + i);
+  }
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    for (uint8_t i = 0; i < size; i++) {
+      address[i] = tmp[i];
+    }
+  }
 }
 
 /*
@@ -92,25 +82,248 @@ void read_EEPROM_values() {
    update or reinit the EEPROM.
 */
 void write_EEPROM() {
-  // put uses update(), thus no unnecessary writes
-  EEPROM.put(EEPROM_Address::base, EEPROM_INIT_VALUE);
-  MyEEPROM.put(EEPROM_Address::timeout, timeout);
-  MyEEPROM.put(EEPROM_Address::primed, primed);
-  MyEEPROM.put(EEPROM_Address::force_shutdown, force_shutdown);
-  MyEEPROM.put(EEPROM_Address::restart_voltage, restart_voltage);
-  MyEEPROM.put(EEPROM_Address::warn_voltage, warn_voltage);
-  MyEEPROM.put(EEPROM_Address::ups_shutdown_voltage, ups_shutdown_voltage);
-  MyEEPROM.put(EEPROM_Address::bat_voltage_coefficient, bat_voltage_coefficient);
-  MyEEPROM.put(EEPROM_Address::bat_voltage_constant, bat_voltage_constant);
-  MyEEPROM.put(EEPROM_Address::ext_voltage_coefficient, ext_voltage_coefficient);
-  MyEEPROM.put(EEPROM_Address::ext_voltage_constant, ext_voltage_constant);
-  MyEEPROM.put(EEPROM_Address::temperature_coefficient, temperature_coefficient);
-  MyEEPROM.put(EEPROM_Address::temperature_constant, temperature_constant);
-  MyEEPROM.put(EEPROM_Address::ups_configuration, ups_configuration);
-  MyEEPROM.put(EEPROM_Address::pulse_length, pulse_length);
-  MyEEPROM.put(EEPROM_Address::pulse_length_on, pulse_length_on);
-  MyEEPROM.put(EEPROM_Address::pulse_length_off, pulse_length_off);
-  MyEEPROM.put(EEPROM_Address::switch_recovery_delay, switch_recovery_delay);
-  MyEEPROM.put(EEPROM_Address::led_off_mode, led_off_mode);
-  MyEEPROM.put(EEPROM_Address::vext_off_is_shutdown, vext_off_is_shutdown);
+  // we use update_EEPROM_byte(), thus no unnecessary writes
+  update_EEPROM_byte(EEPROM_Address::base, EEPROM_INIT_VALUE);
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    uint8_t eeprom_address = pgm_read_byte(&register_table[i].eeprom_address);
+    if (eeprom_address != 0) {
+      write_EEPROM_value(&register_table[i], eeprom_address);
+    }
+  }
+  append_journal();
+}
+
+/*
+   Copy a single register value atomically and write it to the EEPROM.
+*/
+void write_EEPROM_value(const Register_Descriptor *descriptor, int eeprom_address) {
+  uint8_t tmp[sizeof(uint32_t)];
+  uint8_t size = pgm_read_byte(&descriptor->size);
+  uint8_t *address = register_address(descriptor);
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    for (uint8_t i = 0; i < size; i++) {
+      tmp[i] = address[i];
+    }
+  }
+  for (uint8_t i = 0; i < size; i++) {
+    update_EEPROM_byte(eeprom_address + i, tmp[i]);
+  }
+}
+
+/*
+   Calculate a Fletcher-16 checksum over the number and the current value (little endian)
+   of every register stored in the EEPROM, in the order of the register table. The daemon
+   calculates the same checksum over its configuration and skips the synchronization of
+   the registers if both are equal. Using the variables instead of the EEPROM includes
+   the writes that have not been written back yet.
+   This function is called only by request_event() during an interrupt.
+*/
+uint16_t config_hash_Int() {
+  uint8_t sum1 = 0;
+  uint8_t sum2 = 0;
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    if (pgm_read_byte(&register_table[i].eeprom_address) != 0) {
+      uint8_t size = pgm_read_byte(&register_table[i].size);
+      uint8_t *address = register_address(&register_table[i]);
+
+      fletcher16_add(&sum1, &sum2, pgm_read_byte(&register_table[i].number));
+      for (uint8_t j = 0; j < size; j++) {
+        fletcher16_add(&sum1, &sum2, address[j]);
+      }
+    }
+  }
+  return (sum2 << 8) | sum1;
+}
+
+/*
+   Add a byte to the sums of a Fletcher-16 checksum. Both sums are below 255, so the
+   modulo 255 is a single subtraction (no division in the interrupt).
+*/
+void fletcher16_add(uint8_t *sum1, uint8_t *sum2, uint8_t data) {
+  *sum1 = fletcher16_mod(*sum1 + data);
+  *sum2 = fletcher16_mod(*sum2 + *sum1);
+}
+
+uint8_t fletcher16_mod(uint16_t sum) {
+  return sum >= 255 ? sum - 255 : sum;
+}
+
+/*
+   Write a byte to the EEPROM only if it is different from the stored value,
+   this saves write cycles. Every byte actually written is counted in the statistics.
+*/
+void update_EEPROM_byte(int eeprom_address, uint8_t value) {
+  if (EEPROM.read(eeprom_address) != value) {
+    EEPROM.write(eeprom_address, value);
+    count_EEPROM_write();
+  }
+}
+
+/*
+   The following two functions mark registers as changed and restart the
+   quiet period. They are called only by receive_event() during an interrupt.
+*/
+void mark_EEPROM_dirty_Int(uint8_t register_index) {
+  eeprom_dirty[register_index / CHAR_BIT] |= bit(register_index % CHAR_BIT);
+  eeprom_quiet_seconds = EEPROM_QUIET_SECONDS;
+}
+
+void mark_all_EEPROM_dirty_Int() {
+  for (uint8_t i = 0; i < NUM_DIRTY_BYTES; i++) {
+    eeprom_dirty[i] = 0xFF;
+  }
+  eeprom_quiet_seconds = EEPROM_QUIET_SECONDS;
+}
+
+/*
+   Called from the main loop. Writes the changed registers when no
+   register has been written for EEPROM_QUIET_SECONDS seconds.
+*/
+void handle_EEPROM() {
+  uint8_t quiet_seconds;
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    quiet_seconds = eeprom_quiet_seconds;
+  }
+  if (quiet_seconds == 0) {
+    write_dirty_EEPROM();
+  }
+}
+
+/*
+   Writes only the registers that have been marked as changed. The dirty
+   bit is cleared before the value is copied, so a write from the RPi during
+   the EEPROM access marks the register again and is not lost.
+*/
+void write_dirty_EEPROM() {
+  bool journal_changed = false;
+
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    uint8_t mask = bit(i % CHAR_BIT);
+    bool dirty = false;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      if (eeprom_dirty[i / CHAR_BIT] & mask) {
+        eeprom_dirty[i / CHAR_BIT] &= ~mask;
+        dirty = true;
+      }
+    }
+    if (dirty) {
+      uint8_t eeprom_address = pgm_read_byte(&register_table[i].eeprom_address);
+      if (pgm_read_byte(&register_table[i].flags) & Register_Flag::journaled) {
+        journal_changed = true;
+      } else if (eeprom_address != 0) {
+        write_EEPROM_value(&register_table[i], eeprom_address);
+      }
+    }
+  }
+  if (journal_changed) {
+    // all journaled registers are written with a single record
+    append_journal();
+  }
+}
+
+/*
+   The journal spreads the writes of frequently changed registers (e.g., primed which
+   is changed on every start and stop of the daemon) over the unused part of the EEPROM.
+   Every write back appends a record to the next slot instead of overwriting a fixed
+   address. A record consists of
+     sequence number  - incremented with every record
+     data             - the journaled registers in the order of the register table
+     CRC8             - calculated over sequence number and data
+   The CRC is written last, so an interrupted write leaves an invalid record and the
+   previous record stays the newest one. Erased slots (all bytes 0xFF) are never valid.
+*/
+
+/*
+   Erase the journal. Used when the EEPROM is initialized to get rid of records
+   written by a different firmware version. update_EEPROM_byte() skips cells already erased.
+*/
+void erase_journal() {
+  for (int i = EEPROM_Address::journal; i < EEPROM_SIZE; i++) {
+    update_EEPROM_byte(i, 0xFF);
+  }
+  journal_slot = JOURNAL_SLOTS - 1;
+  journal_sequence = 0;
+}
+
+/*
+   Read a record from a journal slot. Returns true if the CRC is valid.
+*/
+bool read_journal_record(uint8_t slot, uint8_t *record) {
+  int eeprom_address = EEPROM_Address::journal + slot * JOURNAL_RECORD_SIZE;
+  for (uint8_t i = 0; i < JOURNAL_RECORD_SIZE; i++) {
+    record[i] = EEPROM.read(eeprom_address + i);
+  }
+  return crc8_message_calc(record, JOURNAL_RECORD_SIZE - 1) == record[JOURNAL_RECORD_SIZE - 1];
+}
+
+/*
+   Find the newest valid record in the journal and set the journaled registers
+   to its values. The newest record is the one with the highest sequence number
+   using serial number arithmetic, which works because we have less than 128 slots.
+   If no valid record exists, the values read from the EEPROM addresses are kept.
+*/
+void read_journal() {
+  uint8_t record[JOURNAL_RECORD_SIZE];
+  uint8_t newest[JOURNAL_RECORD_SIZE];
+  bool found = false;
+
+  for (uint8_t slot = 0; slot < JOURNAL_SLOTS; slot++) {
+    if (read_journal_record(slot, record)) {
+      if (!found || (int8_t)(record[0] - journal_sequence) > 0) {
+        found = true;
+        journal_slot = slot;
+        journal_sequence = record[0];
+        memcpy(newest, record, JOURNAL_RECORD_SIZE);
+      }
+    }
+  }
+  if (!found) {
+    return;
+  }
+
+  uint8_t pos = 1;
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    if (pgm_read_byte(&register_table[i].flags) & Register_Flag::journaled) {
+      uint8_t size = pgm_read_byte(&register_table[i].size);
+      uint8_t *address = register_address(&register_table[i]);
+      ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        for (uint8_t j = 0; j < size; j++) {
+          address[j] = newest[pos + j];
+        }
+      }
+      pos += size;
+    }
+  }
+}
+
+/*
+   Append a record with the current values of the journaled registers to the journal.
+*/
+void append_journal() {
+  uint8_t record[JOURNAL_RECORD_SIZE];
+
+  record[0] = journal_sequence + 1;
+  uint8_t pos = 1;
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    if (pgm_read_byte(&register_table[i].flags) & Register_Flag::journaled) {
+      uint8_t size = pgm_read_byte(&register_table[i].size);
+      uint8_t *address = register_address(&register_table[i]);
+      ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        for (uint8_t j = 0; j < size; j++) {
+          record[pos + j] = address[j];
+        }
+      }
+      pos += size;
+    }
+  }
+  record[pos] = crc8_message_calc(record, pos);
+
+  journal_slot = (journal_slot + 1) % JOURNAL_SLOTS;
+  journal_sequence = record[0];
+
+  int eeprom_address = EEPROM_Address::journal + journal_slot * JOURNAL_RECORD_SIZE;
+  for (uint8_t i = 0; i < JOURNAL_RECORD_SIZE; i++) {
+    update_EEPROM_byte(eeprom_address + i, record[i]);
+  }
 }
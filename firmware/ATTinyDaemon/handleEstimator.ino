@@ -0,0 +1,125 @@
+/*
+   The estimator calculates the state of charge of the battery from the battery voltage
+   using the discharge curve (see ATTinyDaemon.h) and predicts the time until the battery
+   reaches ups_shutdown_voltage. Without a current sensor we cannot count the charge
+   directly. Instead we measure how fast the state of charge drops over ESTIMATOR_PERIOD
+   seconds and average this discharge rate. The load differs a lot between a running
+   and a turned off RPi, so we keep one rate for each and continue with the rate learned
+   before whenever the state switches.
+   The state of charge is calculated in units of 0.01% (SOC_FULL is 100%) to get a
+   usable resolution for the rate, the register holds it in percent.
+*/
+static const uint16_t SOC_FULL   = 10000;
+static const uint8_t  RATE_SCALE =    16;  // the rate is stored multiplied by RATE_SCALE
+static const uint8_t  RATE_SHIFT =     2;  // the new rate has a weight of 1/2^RATE_SHIFT
+
+volatile uint16_t discharge_curve[DISCHARGE_CURVE_POINTS] = { 4150, 4000, 3870, 3780, 3700, 3620, 3500, 3200 };
+volatile uint8_t state_of_charge = 0;
+volatile uint16_t time_to_shutdown = TIME_UNKNOWN;
+
+/*
+   The seconds slept in full watchdog periods since the last call of handle_estimator().
+   Wake-ups by the button or I2C end a sleep early, so we cannot count the wake-ups.
+*/
+volatile uint8_t estimator_seconds = 0;
+
+/*
+   The state of the current measurement period, only used in handle_estimator().
+   discharge_rate is the drop of the state of charge per ESTIMATOR_PERIOD seconds
+   (multiplied by RATE_SCALE) with the RPi running (index 0) and turned off (index 1).
+*/
+uint16_t period_start_soc = 0;
+uint16_t period_seconds = 0;
+uint8_t period_rpi_off = 0;
+uint16_t discharge_rate[2] = { 0, 0 };
+
+/*
+   Called from the main loop on every wake-up after the voltages have been measured.
+*/
+void handle_estimator() {
+  uint16_t bat_voltage_safe, ups_shutdown_voltage_safe;
+  uint8_t elapsed;
+  State state_safe;
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    bat_voltage_safe = bat_voltage;
+    ups_shutdown_voltage_safe = ups_shutdown_voltage;
+    state_safe = state;
+    elapsed = estimator_seconds;
+    estimator_seconds = 0;
+  }
+
+  uint16_t soc = soc_of_voltage(bat_voltage_safe);
+  uint8_t rpi_off = state_safe >= State::shutdown_state ? 1 : 0;
+
+  if (rpi_off != period_rpi_off || bat_voltage_safe == 0) {
+    // the load changes or there is no measurement yet, start a new period
+    period_rpi_off = rpi_off;
+    period_start_soc = soc;
+    period_seconds = 0;
+  } else {
+    period_seconds += elapsed;
+    if (period_seconds >= ESTIMATOR_PERIOD) {
+      // a rising state of charge (charging) counts as no discharge
+      uint32_t rate = soc < period_start_soc ? period_start_soc - soc : 0;
+      rate = rate * ESTIMATOR_PERIOD * RATE_SCALE / period_seconds;
+      if (discharge_rate[rpi_off] != 0) {
+        rate = (((uint32_t) discharge_rate[rpi_off] << RATE_SHIFT) - discharge_rate[rpi_off] + rate) >> RATE_SHIFT;
+      }
+      discharge_rate[rpi_off] = rate > UINT16_MAX ? UINT16_MAX : rate;
+
+      period_start_soc = soc;
+      period_seconds = 0;
+    }
+  }
+
+  uint16_t remaining = TIME_UNKNOWN;
+  uint16_t shutdown_soc = soc_of_voltage(ups_shutdown_voltage_safe);
+  if (soc <= shutdown_soc) {
+    remaining = 0;
+  } else if (discharge_rate[rpi_off] != 0) {
+    uint32_t minutes = (uint32_t) (soc - shutdown_soc) * ESTIMATOR_PERIOD * RATE_SCALE / discharge_rate[rpi_off] / 60;
+    if (minutes < TIME_UNKNOWN) {
+      remaining = minutes;
+    }
+  }
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    state_of_charge = soc / (SOC_FULL / 100);
+    time_to_shutdown = remaining;
+  }
+}
+
+/*
+   Calculate the state of charge for a voltage by interpolating the discharge curve.
+*/
+uint16_t soc_of_voltage(uint16_t voltage) {
+  uint16_t curve[DISCHARGE_CURVE_POINTS];
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    for (uint8_t i = 0; i < DISCHARGE_CURVE_POINTS; i++) {
+      curve[i] = discharge_curve[i];
+    }
+  }
+
+  if (voltage >= curve[0]) {
+    return SOC_FULL;
+  }
+  for (uint8_t i = 1; i < DISCHARGE_CURVE_POINTS; i++) {
+    if (voltage >= curve[i]) {
+      // curve[i - 1] > voltage >= curve[i], thus the divisor cannot be 0
+      uint32_t soc = (uint32_t) (DISCHARGE_CURVE_POINTS - 1 - i) * SOC_FULL
+                     + (uint32_t) (voltage - curve[i]) * SOC_FULL / (curve[i - 1] - curve[i]);
+      return soc / (DISCHARGE_CURVE_POINTS - 1);
+    }
+  }
+  return 0;
+}
+
+/*
+   Add the length of a full watchdog period.
+   This function is called only by the watchdog interrupt.
+*/
+void add_estimator_time_Int(uint8_t interval) {
+  if (estimator_seconds <= UCHAR_MAX - interval) {
+    estimator_seconds += interval;
+  }
+}
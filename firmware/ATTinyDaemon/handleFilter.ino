@@ -0,0 +1,94 @@
+/*
+   The filters smooth the measured values before they are published in the registers.
+   Each channel (battery voltage, external voltage and temperature) has its own filter
+   register defining mode and parameter (see Filter_Mode in ATTinyDaemon.h). The
+   filters use integer arithmetic only. After a reset (e.g., when a coefficient has been
+   changed) the next measured value initializes the filter.
+*/
+volatile uint8_t bat_voltage_filter = Filter_Mode::ema | 3;
+volatile uint8_t ext_voltage_filter = Filter_Mode::none;
+volatile uint8_t temperature_filter = Filter_Mode::none;
+
+/*
+   The filter state is only accessed from the main loop and need not be volatile.
+*/
+Filter filters[Filter_Channel::count];
+
+/*
+   Filter the new measurements of all channels. Called by read_voltages().
+*/
+void filter_measurements(uint32_t *bat, uint32_t *ext, uint32_t *temp) {
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (reset_filters == true) {
+      reset_filters = false;
+      memset(filters, 0, sizeof(filters));
+    }
+  }
+
+  *bat = filter_value(&filters[Filter_Channel::bat_voltage], bat_voltage_filter, *bat);
+  *ext = filter_value(&filters[Filter_Channel::ext_voltage], ext_voltage_filter, *ext);
+
+  // the temperature is signed, we shift it into the unsigned range of the filter
+  uint16_t shifted = filter_value(&filters[Filter_Channel::temperature], temperature_filter, (uint16_t) (*temp + 0x8000));
+  *temp = (uint16_t) (shifted - 0x8000);
+}
+
+/*
+   Add a value to a filter and return the filtered value.
+*/
+uint16_t filter_value(Filter *filter, uint8_t config, uint16_t value) {
+  uint8_t mode = config & Filter_Mode::mode_mask;
+  uint8_t parameter = config & Filter_Mode::parameter_mask;
+  bool first = filter->count == 0;
+
+  if (filter->count < MEDIAN_SIZE) {
+    filter->count++;
+  }
+
+  switch (mode) {
+    case Filter_Mode::ema:
+    case Filter_Mode::fast_attack:
+      if (first || (mode == Filter_Mode::fast_attack && value < (filter->acc >> parameter))) {
+        filter->acc = (uint32_t) value << parameter;
+      } else {
+        filter->acc = filter->acc - (filter->acc >> parameter) + value;
+      }
+      return filter->acc >> parameter;
+
+    case Filter_Mode::median:
+      filter->values[filter->next] = value;
+      filter->next = (filter->next + 1) % MEDIAN_SIZE;
+      return median_value(filter, parameter);
+
+    default:
+      return value;
+  }
+}
+
+/*
+   Return the median of the last n values of a filter (at most MEDIAN_SIZE and at most
+   the number of values seen). For an even number the upper of the two middle values
+   is returned.
+*/
+uint16_t median_value(Filter *filter, uint8_t n) {
+  if (n > filter->count) {
+    n = filter->count;
+  }
+  if (n == 0) {
+    n = 1;
+  }
+
+  // insertion sort of the last n values, n is very small
+  uint16_t sorted[MEDIAN_SIZE];
+  uint8_t index = filter->next;
+  for (uint8_t i = 0; i < n; i++) {
+    index = (index + MEDIAN_SIZE - 1) % MEDIAN_SIZE;
+    uint16_t value = filter->values[index];
+    uint8_t j = i;
+    for (; j > 0 && sorted[j - 1] > value; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = value;
+  }
+  return sorted[n / 2];
+}
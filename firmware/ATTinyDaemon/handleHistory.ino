@@ -0,0 +1,93 @@
+/*
+   The telemetry history keeps the last HISTORY_SIZE measurements of battery voltage,
+   external voltage and temperature in a ring buffer in RAM. A new entry is recorded
+   every HISTORY_WAKEUPS wake-ups, so the RPi can read what happened while it was
+   turned off or hung (e.g., to backfill its monitoring after a restart).
+   The encoding of the entries is described in ATTinyDaemon.h.
+*/
+History_Entry history[HISTORY_SIZE];
+uint8_t history_head = 0;             // index of the next entry to write
+uint8_t history_count = 0;            // the number of valid entries
+uint8_t history_wakeups = 0;          // the wake-ups since the last entry
+
+/*
+   The state of the paged read. These variables don't need to be volatile because
+   they are only accessed during the interrupt in the I2C callback routines.
+*/
+uint8_t history_read_start = 0;       // index of the oldest entry when the read started
+uint8_t history_read_count = 0;       // the number of valid entries when the read started
+uint8_t history_read_page = 0;        // the page returned by the next read
+
+/*
+   Called from the main loop on every wake-up. Records a new entry every
+   HISTORY_WAKEUPS wake-ups using the values of the last measurement.
+*/
+void handle_history() {
+  if (++history_wakeups < HISTORY_WAKEUPS) {
+    return;
+  }
+  history_wakeups = 0;
+
+  uint16_t bat_voltage_safe, ext_voltage_safe;
+  int16_t temperature_safe;
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    bat_voltage_safe = bat_voltage;
+    ext_voltage_safe = ext_voltage;
+    temperature_safe = temperature;
+  }
+
+  History_Entry entry;
+  entry.bat_voltage = scale_history_value(bat_voltage_safe > HISTORY_BAT_OFFSET ? bat_voltage_safe - HISTORY_BAT_OFFSET : 0, HISTORY_BAT_SCALE);
+  entry.ext_voltage = scale_history_value(ext_voltage_safe, HISTORY_EXT_SCALE);
+  entry.temperature = temperature_safe < SCHAR_MIN ? SCHAR_MIN : temperature_safe > SCHAR_MAX ? SCHAR_MAX : temperature_safe;
+
+  // the history is read during the I2C interrupt
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    history[history_head] = entry;
+    history_head = (history_head + 1) % HISTORY_SIZE;
+    if (history_count < HISTORY_SIZE) {
+      history_count++;
+    }
+  }
+}
+
+/*
+   Scale a value to 8 bit, values that are too large are set to the maximum.
+*/
+uint8_t scale_history_value(uint16_t value, uint8_t scale) {
+  value /= scale;
+  return value > UCHAR_MAX ? UCHAR_MAX : value;
+}
+
+/*
+   Select the page returned by the next read of the history register.
+   Selecting page 0 freezes the position of the oldest entry and the number
+   of entries, so a new entry recorded during the read does not shift the pages.
+   This function is called only by write_computed_register() during an interrupt.
+*/
+void select_history_page_Int(uint8_t page) {
+  if (page == 0) {
+    history_read_count = history_count;
+    history_read_start = (history_head + HISTORY_SIZE - history_count) % HISTORY_SIZE;
+  }
+  history_read_page = page;
+}
+
+/*
+   Fill a page with the history entries of the selected page and select the next
+   page. Entries beyond the number of valid entries are set to 0xFF.
+   This function is called only by request_event() during an interrupt.
+*/
+void read_history_page_Int(History_Page *page) {
+  page->page = history_read_page;
+
+  uint8_t entry = history_read_page * HISTORY_PAGE_ENTRIES;
+  for (uint8_t i = 0; i < HISTORY_PAGE_ENTRIES; i++, entry++) {
+    if (entry < history_read_count) {
+      page->entries[i] = history[(history_read_start + entry) % HISTORY_SIZE];
+    } else {
+      memset(&page->entries[i], 0xFF, sizeof(History_Entry));
+    }
+  }
+  history_read_page++;
+}
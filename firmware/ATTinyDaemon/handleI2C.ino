@@ -1,22 +1,10 @@
 /*
-   Initialize the I2C connection
- */
-void init_I2C() {
-#if defined SERIAL_DEBUG
-  Serial.println(F("In init_I2C()"));
-#endif
-  Wire.end();
-  Wire.begin(I2C_ADDRESS);
-  Wire.onRequest(request_event);
-  Wire.onReceive(receive_event);
-}
-
-/*
-  The buffer used for holding the data communicated via I2C.
+  The buffer used for holding the data received via I2C, it is filled
+  by the USI state machine (see handleUSI.ino).
   This doesn't need to be volatile because it is only accessed
   during the interrupt.
  */
-const uint8_t BUFFER_SIZE = 8;
+const uint8_t BUFFER_SIZE = 16;
 uint8_t rbuf[BUFFER_SIZE];
 
 /*
@@ -26,12 +14,193 @@ uint8_t rbuf[BUFFER_SIZE];
 */
 Register register_number;
 
+/*
+  The status of the last batch write (see Batch_Status in ATTinyDaemon.h).
+  This doesn't need to be volatile because it is only accessed
+  during the interrupt.
+*/
+uint8_t batch_status = Batch_Status::none;
+
+/*
+   The I2C address is stored in the EEPROM and changed by writing the i2c_address register.
+   A wrong address would make us unreachable, so a new address is taken over in two steps:
+   the write only makes it the pending address and we answer on both addresses. The first
+   access on the pending address proves that the RPi reaches us there, it becomes the
+   address and is written to the EEPROM. If this access doesn't happen within
+   I2C_HANDOVER_TIMEOUT ms, the pending address is dropped. Without a handover the pending
+   address is the address itself.
+*/
+volatile uint8_t i2c_address = I2C_ADDRESS;
+volatile uint8_t i2c_address_pending = I2C_ADDRESS;
+volatile uint16_t handover_start = 0;            // the time of the write, lower 16 bits of the virtual clock
+
+/*
+   This variable holds the virtual clock. Declaration in handleWatchdog.
+*/
+extern volatile uint32_t clock_ms;
+
+/*
+   Find the descriptor of a register in the register table (see ATTinyDaemon.h).
+   The register is found in constant time using the group base index of the upper
+   nibble of the register number. Returns nullptr if the register does not exist.
+*/
+const Register_Descriptor *find_register(Register number) {
+  uint8_t register_index = static_cast<uint8_t>(number);
+  register_index = pgm_read_byte(&register_group_base[register_index >> 4]) + (register_index & 0x0F);
+
+  if (register_index < NUM_REGISTERS) {
+    const Register_Descriptor *descriptor = &register_table[register_index];
+    if (pgm_read_byte(&descriptor->number) == static_cast<uint8_t>(number)) {
+      return descriptor;
+    }
+  }
+  return nullptr;
+}
+
+/*
+   Return the address of the variable backing a register, nullptr if the
+   register is computed.
+*/
+uint8_t *register_address(const Register_Descriptor *descriptor) {
+  return (uint8_t *) pgm_read_ptr(&descriptor->address);
+}
+
+/*
+   Write the data received for a register to its backing variable and execute
+   the side effects defined by the flags in the register table. The write
+   is only executed if the register is writable and the length of the data
+   matches the size of the register. Registers without a backing variable
+   are handed to write_computed_register().
+   This function is called only by receive_event() during an interrupt.
+*/
+void write_register(Register number, uint8_t *data, uint8_t len) {
+  const Register_Descriptor *descriptor = find_register(number);
+  if (descriptor == nullptr) {
+    return;
+  }
+  uint8_t flags = pgm_read_byte(&descriptor->flags);
+  if (!(flags & Register_Flag::writable)) {
+    return;
+  }
+
+  uint8_t *address = register_address(descriptor);
+  if (address == nullptr) {
+    write_computed_register(number, data, len);
+    return;
+  }
+  if (pgm_read_byte(&descriptor->size) != len) {
+    return;
+  }
+
+  if (flags & Register_Flag::handover) {
+    start_handover_Int(data[0]);
+    return;
+  }
+  if (flags & Register_Flag::or_value) {
+    // normally simply bit-or the info from the RPi, but allow 0 to reset all conditions
+    if (data[0] == 0) {
+      *address = 0;
+    } else {
+      *address |= data[0];
+    }
+  } else {
+    for (uint8_t i = 0; i < len; i++) {
+      address[i] = data[i];
+    }
+  }
+
+  if (flags & Register_Flag::check_ext_voltage) {
+    if (data[0] != 0) {
+      // we have to check the external voltage when depending on its value
+      ups_configuration |= UPS_Configuration::Value::check_ext_voltage;
+    }
+  }
+  if (flags & Register_Flag::reset_filters) {
+    reset_filters = true;  // reset the averages of the measured values
+  }
+  if (flags & Register_Flag::recalc_calibration) {
+    recalc_calibration = true;
+  }
+  if (pgm_read_byte(&descriptor->eeprom_address) != 0) {
+    mark_EEPROM_dirty_Int(descriptor - register_table);
+  }
+}
+
+/*
+   Execute the action of a register without a backing variable.
+   This function is called only by write_register() during an interrupt.
+*/
+void write_computed_register(Register number, uint8_t *data, uint8_t len) {
+  // turn off warnings for unhandled enumeration values
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+
+  switch (number) {
+    case Register::history:
+      if (len == 1) {
+        select_history_page_Int(data[0]);
+      }
+      break;
+    case Register::batch_write:
+      batch_status = write_batch_Int(data, len) ? Batch_Status::applied : Batch_Status::rejected;
+      break;
+    case Register::statistics:
+      if (len == 1 && data[0] == 0) {
+        reset_statistics_Int();
+      }
+      break;
+    case Register::bootloader:
+      request_bootloader_Int(data, len);
+      break;
+    case Register::init_eeprom:
+      if (len == 1 && data[0] != 0) {
+        mark_all_EEPROM_dirty_Int();
+      }
+      break;
+    default:
+      break;
+  }
+  #pragma GCC diagnostic pop
+}
+
+/*
+   Write the (register, value) pairs of a batch write. data[0] is the number of
+   pairs. All pairs are validated first, nothing is written if one of them is
+   invalid. Returns true if the batch has been applied.
+   This function is called only by write_computed_register() during an interrupt.
+*/
+bool write_batch_Int(uint8_t *data, uint8_t len) {
+  uint8_t pos = 1;
+  for (uint8_t i = 0; i < data[0]; i++) {
+    if (pos >= len) {
+      return false;
+    }
+    const Register_Descriptor *descriptor = find_register(static_cast<Register>(data[pos]));
+    if (descriptor == nullptr || register_address(descriptor) == nullptr
+        || !(pgm_read_byte(&descriptor->flags) & Register_Flag::writable)) {
+      return false;
+    }
+    pos += 1 + pgm_read_byte(&descriptor->size);
+  }
+  if (pos != len) {
+    return false;
+  }
+
+  pos = 1;
+  for (uint8_t i = 0; i < data[0]; i++) {
+    uint8_t size = pgm_read_byte(&find_register(static_cast<Register>(data[pos]))->size);
+    write_register(static_cast<Register>(data[pos]), &data[pos + 1], size);
+    pos += 1 + size;
+  }
+  return true;
+}
+
 /*
    This method is called when either a register number is transferred (1 byte)
    or data is written to a register.
    When data is written we use a simple protocol to guarantee that the data has
-   been received correctly. The last byte transmitted by the sender has to repeat
-   the register value, i.e. first byte == last byte (rbuf[0] == rbuf[-1]).
+   been received correctly. The last byte transmitted by the sender is a CRC8
+   calculated over the register number and the data.
    When data is requested we simply send the data on the bus and hope for the best.
    Transmission errors are fixed on the receiving side (the Raspberry) by simply
    retrying the read.
@@ -39,275 +208,148 @@ Register register_number;
 
 void receive_event(int bytes) {
 
-  disable_watchdog();
-  
   i2c_triggered_state_change();
 
-  uint8_t count = BUFFER_SIZE > bytes ? bytes : BUFFER_SIZE;
-  for (int i = 0; i < count; i++) {
-    rbuf[i] = Wire.read();
-  }
   if (bytes > BUFFER_SIZE) {
-    // something is seriously wrong. Clean up and try to recover
-    for (int i = BUFFER_SIZE; i < bytes; i++)
-      Wire.read();
+    // something is seriously wrong. Drop the data and try to recover
+    count_oversized_frame_Int();
+    return;
   }
 
   // Read the first byte to determine which register is concerned
   register_number = static_cast<Register>(rbuf[0]);
 
-  // check that the data has been received correctly
-  uint8_t crc = crc8_message_calc(rbuf, bytes - 1);
-  if (crc == rbuf[bytes - 1])
-  {
-    // If there is more than 1 byte, then the master is writing to the slave
-    if (bytes == 3) {
-      // turn off warnings for unhandled enumeration values
-      #pragma GCC diagnostic push
-      #pragma GCC diagnostic ignored "-Wswitch"
+  // If there is more than 1 byte, then the master is writing to the slave
+  if (bytes > 2) {
+    // check that the data has been received correctly
+    uint8_t crc = crc8_message_calc(rbuf, bytes - 1);
+    if (crc == rbuf[bytes - 1]) {
+      write_register(register_number, &rbuf[1], bytes - 2);
+    } else {
+      count_crc_error_Int();
+    }
+  }
+  if (bytes != 1) {
+    // we had a write operation and reset the counter
+    reset_counter_Int();
+  }
+}
 
-      // write an 8 bit register
-      switch (register_number) {
-        case Register::timeout:
-          timeout = rbuf[1];
-          update_eeprom = true;
-          break;
-        case Register::primed:
-          primed = rbuf[1];
-          update_eeprom = true;
-          break;
-        case Register::should_shutdown:
-          // normally simply bit-or the info from the RPi, but allow 0 to reset all conditions
-          if(rbuf[1] == 0) {
-            should_shutdown = 0;
-          } else {
-            should_shutdown |= rbuf[1];
-          }
-          break;
-        case Register::force_shutdown:
-          force_shutdown = rbuf[1];
-          update_eeprom = true;
-          break;
-        case Register::led_off_mode:
-          led_off_mode = rbuf[1];
-          update_eeprom = true;
-          break;
-        case Register::ups_configuration:
-          ups_configuration = rbuf[1];
-          update_eeprom = true;
-          break;
-        case Register::vext_off_is_shutdown:
-          vext_off_is_shutdown = rbuf[1];
-          if(vext_off_is_shutdown) {
-            // we have to check the external voltage when depending on its value
-            ups_configuration |= UPS_Configuration::Value::check_ext_voltage;
-          }
-          update_eeprom = true;
-          break;
-        case Register::init_eeprom:
-        {
-          uint8_t init_eeprom = rbuf[1];
+/*
+   This method is called after receiveEvent() if the master wants to
+   read data. The register_number contains the register to read.
+   Registers with a backing variable are sent directly, the others
+   are computed here.
+*/
+void request_event() {
+  const Register_Descriptor *descriptor = find_register(register_number);
 
-          if (init_eeprom != 0) {
-            update_eeprom = true;
-          }
-          break;
-        }
-        default:
-          break;
-      }
-    #pragma GCC diagnostic pop
+  if (register_number == Register::should_shutdown || register_number == Register::snapshot) {
+    release_attention_Int();
+  }
 
+  if (descriptor != nullptr) {
+    uint8_t *address = register_address(descriptor);
 
-    } else if (bytes == 4) {
+    if (address != nullptr) {
+      write_data_crc(address, pgm_read_byte(&descriptor->size));
+    } else {
       // turn off warnings for unhandled enumeration values
       #pragma GCC diagnostic push
       #pragma GCC diagnostic ignored "-Wswitch"
 
-      // write a 16 bit register
       switch (register_number) {
-        case Register::restart_voltage:
-          restart_voltage = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
-          break;
-        case Register::warn_voltage:
-          warn_voltage = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
-          break;
-        case Register::ups_shutdown_voltage:
-          ups_shutdown_voltage = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
-          break;
-        case Register::bat_voltage_coefficient:
-          bat_voltage_coefficient = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
-          reset_bat_voltage = true;  // reset bat_voltage average
-          break;
-        case Register::bat_voltage_constant:
-          bat_voltage_constant = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
-          reset_bat_voltage = true;  // reset bat_voltage average
-          break;
-        case Register::ext_voltage_coefficient:
-          ext_voltage_coefficient = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
-          break;
-        case Register::ext_voltage_constant:
-          ext_voltage_constant = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
+        case Register::uptime: {
+          // without curly braces gcc produces faulty code... finding this took a long time
+          uint32_t uptime = millis();
+          write_data_crc((uint8_t *)&uptime, sizeof(uptime));
           break;
-        case Register::temperature_coefficient:
-          temperature_coefficient = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
-          break;
-        case Register::temperature_constant:
-          temperature_constant = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
+        }
+        case Register::snapshot: {
+          // we are in the interrupt, so all values are consistent with each other
+          Snapshot snapshot;
+          snapshot.bat_voltage = bat_voltage;
+          snapshot.ext_voltage = ext_voltage;
+          snapshot.temperature = temperature;
+          snapshot.seconds = seconds;
+          snapshot.state = static_cast<uint8_t>(state);
+          snapshot.should_shutdown = should_shutdown;
+          snapshot.uptime = millis();
+          snapshot.state_of_charge = state_of_charge;
+          snapshot.time_to_shutdown = time_to_shutdown;
+          write_data_crc((uint8_t *)&snapshot, sizeof(snapshot));
           break;
-        case Register::pulse_length:
-          pulse_length = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
+        }
+        case Register::batch_write:
+          write_data_crc(&batch_status, sizeof(batch_status));
+          batch_status = Batch_Status::none;
           break;
-        case Register::pulse_length_on:
-          pulse_length_on = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
+#if defined STATISTICS
+        case Register::statistics: {
+          Statistics statistics;
+          read_statistics_Int(&statistics);
+          write_data_crc((uint8_t *)&statistics, sizeof(statistics));
           break;
-        case Register::pulse_length_off:
-          pulse_length_off = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
+        }
+#endif
+        case Register::config_hash: {
+          uint16_t hash = config_hash_Int();
+          write_data_crc((uint8_t *)&hash, sizeof(hash));
           break;
-        case Register::switch_recovery_delay:
-          switch_recovery_delay = rbuf[1] | (rbuf[2] << 8);
-          update_eeprom = true;
+        }
+        case Register::history: {
+          History_Page page;
+          read_history_page_Int(&page);
+          write_data_crc((uint8_t *)&page, sizeof(page));
           break;
+        }
         default:
           break;
       }
-    #pragma GCC diagnostic pop
+      #pragma GCC diagnostic pop
     }
   }
-  if (bytes != 1) {
-    // we had a write operation and reset the counter
-    reset_counter_Int();
-  }
+
+  // we had a read operation and reset the counter
+  reset_counter_Int();
 }
 
 /*
-   This method is called after receiveEvent() if the master wants to
-   read data. The register_number contains the register to read.
+   Returns true if the address is a 7-bit address that is not reserved.
 */
-void request_event() {
-  
-  /*
-    Read from the register variable to know what to send back.
-  */
-  // turn off warnings for unhandled enumeration values
-  #pragma GCC diagnostic push
-  #pragma GCC diagnostic ignored "-Wswitch"
+bool valid_i2c_address(uint8_t address) {
+  return address >= I2C_MIN_ADDRESS && address <= I2C_MAX_ADDRESS;
+}
 
-  switch (register_number) {
+/*
+   Make a new address the pending address, writing the current address cancels a handover.
+   This function is called only by write_register() during an interrupt.
+*/
+void start_handover_Int(uint8_t address) {
+  if (valid_i2c_address(address)) {
+    i2c_address_pending = address;
+    handover_start = clock_ms;
+  }
+}
 
-    case Register::last_access:
-      write_data_crc((uint8_t *)&seconds, sizeof(seconds));
-      break;
-    case Register::bat_voltage:
-      write_data_crc((uint8_t *)&bat_voltage, sizeof(bat_voltage));
-      break;
-    case Register::ext_voltage:
-      write_data_crc((uint8_t *)&ext_voltage, sizeof(ext_voltage));
-      break;
-    case Register::bat_voltage_coefficient:
-      write_data_crc((uint8_t *)&bat_voltage_coefficient, sizeof(bat_voltage_coefficient));
-      break;
-    case Register::bat_voltage_constant:
-      write_data_crc((uint8_t *)&bat_voltage_constant, sizeof(bat_voltage_constant));
-      break;
-    case Register::ext_voltage_coefficient:
-      write_data_crc((uint8_t *)&ext_voltage_coefficient, sizeof(ext_voltage_coefficient));
-      break;
-    case Register::ext_voltage_constant:
-      write_data_crc((uint8_t *)&ext_voltage_constant, sizeof(ext_voltage_constant));
-      break;
-    case Register::timeout:
-      write_data_crc((uint8_t *)&timeout, sizeof(timeout));
-      break;
-    case Register::primed:
-      write_data_crc((uint8_t *)&primed, sizeof(primed));
-      break;
-    case Register::should_shutdown:
-      write_data_crc((uint8_t *)&should_shutdown, sizeof(should_shutdown));
-      break;
-    case Register::force_shutdown:
-      write_data_crc((uint8_t *)&force_shutdown, sizeof(force_shutdown));
-      break;
-    case Register::led_off_mode:
-      write_data_crc((uint8_t *)&led_off_mode, sizeof(led_off_mode));
-      break;      
-    case Register::vext_off_is_shutdown:
-      write_data_crc((uint8_t *)&vext_off_is_shutdown, sizeof(vext_off_is_shutdown));
-      break;      
-    case Register::restart_voltage:
-      write_data_crc((uint8_t *)&restart_voltage, sizeof(restart_voltage));
-      break;
-    case Register::warn_voltage:
-      write_data_crc((uint8_t *)&warn_voltage, sizeof(warn_voltage));
-      break;
-    case Register::ups_shutdown_voltage:
-      write_data_crc((uint8_t *)&ups_shutdown_voltage, sizeof(ups_shutdown_voltage));
-      break;
-    case Register::temperature:
-      write_data_crc((uint8_t *)&temperature, sizeof(temperature));
-      break;
-    case Register::temperature_coefficient:
-      write_data_crc((uint8_t *)&temperature_coefficient, sizeof(temperature_coefficient));
-      break;
-    case Register::temperature_constant:
-      write_data_crc((uint8_t *)&temperature_constant, sizeof(temperature_constant));
-      break;
-    case Register::ups_configuration:
-      write_data_crc((uint8_t *)&ups_configuration, sizeof(ups_configuration));
-      break;
-    case Register::pulse_length:
-      write_data_crc((uint8_t *)&pulse_length, sizeof(pulse_length));
-      break;
-    case Register::pulse_length_on:
-      write_data_crc((uint8_t *)&pulse_length_on, sizeof(pulse_length_on));
-      break;
-    case Register::pulse_length_off:
-      write_data_crc((uint8_t *)&pulse_length_off, sizeof(pulse_length_off));
-      break;
-    case Register::switch_recovery_delay:
-      write_data_crc((uint8_t *)&switch_recovery_delay, sizeof(switch_recovery_delay));
-      break;
-    case Register::version:
-      write_data_crc((uint8_t *)&prog_version, sizeof(prog_version));
-      break;
-    case Register::fuse_low:
-      write_data_crc((uint8_t *)&fuse_low, sizeof(fuse_low));
-      break;
-    case Register::fuse_high:
-      write_data_crc((uint8_t *)&fuse_high, sizeof(fuse_high));
-      break;
-    case Register::fuse_extended:
-      write_data_crc((uint8_t *)&fuse_extended, sizeof(fuse_extended));
-      break;
-    case Register::internal_state:
-      write_data_crc((uint8_t *)&state, sizeof(state));
-      break;
-    case Register::uptime: {
-      // without curly braces gcc produces faulty code... finding this took a long time
-      uint32_t uptime = millis();
-      write_data_crc((uint8_t *)&uptime, sizeof(uptime));
-      break;
+/*
+   The master accessed us on the pending address, take it over and write it to the EEPROM.
+   This function is called only by the USI overflow interrupt.
+*/
+void take_over_i2c_address_Int() {
+  i2c_address = i2c_address_pending;
+  mark_EEPROM_dirty_Int(find_register(Register::i2c_address) - register_table);
+}
+
+/*
+   Called from the main loop. Drops the pending address if the handover has not been
+   confirmed in time.
+*/
+void handle_handover() {
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (i2c_address_pending != i2c_address
+        && (uint16_t) ((uint16_t) clock_ms - handover_start) >= I2C_HANDOVER_TIMEOUT) {
+      i2c_address_pending = i2c_address;
     }
-    case Register::mcu_status_register:
-      write_data_crc((uint8_t *)&mcusr_mirror, sizeof(mcusr_mirror));
-      break;
-    default:
-      break;
   }
-  #pragma GCC diagnostic pop
-
-  // we had a read operation and reset the counter
-  reset_counter_Int();
 }
@@ -50,6 +50,7 @@ void ledOff_buttonOn() {
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
     pb_high(LED_BUTTON);              // First high to guarantee no spurious interrups
     pb_input(LED_BUTTON);
+    input_buffer_on(LED_BUTTON);      // the pin change interrupt needs the input buffer
 
     PCMSK |= bit(LED_BUTTON);         // set interrupt pin
     GIFR |= bit(PCIF);                // clear interrupts
@@ -81,6 +82,7 @@ void ledOff_buttonOff() {
     GIMSK &= ~(bit(PCIE));            // disable pin change interrupts
     pb_input(LED_BUTTON);
     pb_low(LED_BUTTON);
+    input_buffer_off(LED_BUTTON);     // the floating pin must not draw current
   }
 #endif
 }
@@ -103,20 +105,28 @@ void ledOff_buttonOff() {
 */
 void switch_pin_high() {
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    // output high
-    pb_high(PIN_SWITCH);
-    pb_output(PIN_SWITCH);
+    switch_pin_high_Int();
   }
 }
 
 void switch_pin_low() {
-  // Turn off pullup, then to output
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    pb_low(PIN_SWITCH);
-    pb_output(PIN_SWITCH);
+    switch_pin_low_Int();
   }
 }
 
+void switch_pin_high_Int() {
+  // output high
+  pb_high(PIN_SWITCH);
+  pb_output(PIN_SWITCH);
+}
+
+void switch_pin_low_Int() {
+  // Turn off pullup, then to output
+  pb_low(PIN_SWITCH);
+  pb_output(PIN_SWITCH);
+}
+
 /*
    Functions that abstract checking the different bits of reset_configuration.
    These will be unrolled by the compiler, so no additional overhead on the heap
@@ -147,6 +157,12 @@ uint8_t ups_additional_on_pulses() {
   return (ups_configuration & 0b11000000) >> 6;
 }
 
+/*
+   These variables hold the actions waiting for the end of a pulse sequence. Declaration in handlePulse.
+*/
+extern volatile bool pending_ups_on;
+extern volatile bool pending_init_I2C;
+
 /*
    restartRaspberry() executes a reset of the RPI using either
    a pulse or a switching sequence, depending on reset_configuration:
@@ -158,6 +174,10 @@ uint8_t ups_additional_on_pulses() {
    2    pull the switch pin low to turn the UPS off (reset needs 1 pulse)
    3    turn switch off and on to turn the UPS off/on (2 pulses, check for external voltage)
 
+   The pulses are executed by the pulse sequencer (see handlePulse.ino), the functions below
+   only queue them and return immediately. The UPS is turned on again by handle_pulse() after
+   the recovery delay, only then the external voltage can be checked.
+
    Additionally, should_shutdown is cleared.
 */
 void restart_raspberry() {
@@ -169,24 +189,10 @@ void restart_raspberry() {
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
     switch_recovery_delay_safe = switch_recovery_delay;
   }
-  delay(switch_recovery_delay_safe); // wait for the switch circuit to revover
+  // wait for the switch circuit to recover, the switch pin keeps its level
+  queue_pulse(ups_is_voltage_controlled() ? LOW : HIGH, switch_recovery_delay_safe);
 
-  ups_on();
-}
-
-/*
- * The following function executes one push on the switch of the UPS
- */
-void push_switch(uint16_t pulse_time) {
-  switch_pin_low();
-  
-  uint16_t pulse_time_safe;
-  ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    pulse_time_safe = pulse_time;
-  }
-  delay(pulse_time_safe);
-  
-  switch_pin_high();
+  pending_ups_on = true;
 }
 
 /*
@@ -194,7 +200,7 @@ void push_switch(uint16_t pulse_time) {
  */
 void ups_off() {
   if (ups_is_voltage_controlled()) {
-    switch_pin_low();
+    queue_pulse(LOW, 0);
   } else {
     if (ups_check_voltage()) {
       read_voltages();
@@ -214,20 +220,7 @@ void ups_off() {
         pulse_length_safe = pulse_length;
       }
     }
-    push_switch(pulse_length_safe);
-
-    uint8_t additional_pulses = ups_additional_off_pulses();
-
-    uint16_t switch_recovery_delay_safe;
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-      switch_recovery_delay_safe = switch_recovery_delay;
-    }
-
-    for(uint8_t i = 0; i < additional_pulses; i++) {
-      delay(switch_recovery_delay_safe / SW_TO_PULSE_DIV); // we wait a shorter time for multiple pulses
-      push_switch(pulse_length_safe);
-    }
-
+    queue_switch_pulses(pulse_length_safe, ups_additional_off_pulses());
   }
 }
 
@@ -236,7 +229,7 @@ void ups_off() {
  */
 void ups_on() {
   if (ups_is_voltage_controlled()) {
-    switch_pin_high();
+    queue_pulse(HIGH, 0);
   } else {
     if (ups_check_voltage()) {
       read_voltages();
@@ -255,20 +248,46 @@ void ups_on() {
         pulse_length_safe = pulse_length;
       }
     }
-    push_switch(pulse_length_safe);
-
-    uint8_t additional_pulses = ups_additional_on_pulses();
+    queue_switch_pulses(pulse_length_safe, ups_additional_on_pulses());
+  }
+  // we restart I2C after the sequence since the RPi has just been turned on (again)
+  pending_init_I2C = true;
+}
 
-    uint16_t switch_recovery_delay_safe;
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-      switch_recovery_delay_safe = switch_recovery_delay;
-    }
+#if defined ATTENTION_LINE
+/*
+   The values of should_shutdown and state the RPi has seen with its last read.
+   They don't need to be volatile, they are changed only during the I2C interrupt
+   and read in an atomic block.
+*/
+uint8_t attention_should_shutdown = Shutdown_Cause::none;
+State attention_state = State::running_state;
+#endif
 
-    for(uint8_t i = 0; i < additional_pulses; i++) {
-      delay(switch_recovery_delay_safe / SW_TO_PULSE_DIV); // we wait a shorter time for multiple pulses
-      push_switch(pulse_length_safe);
+/*
+   Pull the attention line low if should_shutdown or the state has changed since
+   the RPi last read them. The line is used as an open drain output, we either pull
+   it low or let it float, the pull-up is on the RPi side.
+*/
+void handle_attention() {
+#if defined ATTENTION_LINE
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (should_shutdown != attention_should_shutdown || state != attention_state) {
+      pb_low(PIN_ATTENTION);
+      pb_output(PIN_ATTENTION);
     }
   }
-  // we restart I2C since the RPi has just been turned on (again)
-  init_I2C();
+#endif
+}
+
+/*
+   Release the attention line, the RPi is reading the current values.
+   This function is called only by request_event() during an interrupt.
+*/
+void release_attention_Int() {
+#if defined ATTENTION_LINE
+  pb_input(PIN_ATTENTION);
+  attention_should_shutdown = should_shutdown;
+  attention_state = state;
+#endif
 }
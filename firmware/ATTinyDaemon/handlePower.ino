@@ -0,0 +1,33 @@
+/*
+   Power management of the peripherals (data sheet ch. 7.4, p.36ff). Everything that is
+   not needed is turned off in setup():
+   - the analog comparator is disabled with ACD, it would keep the band gap reference
+     running in power down. With EXT_VOLTAGE_COMPARATOR it is started while the external
+     voltage is present (see handleVoltages.ino).
+   - Timer1 is not used at all and stays stopped with the power reduction register.
+   - the ADC is only clocked during read_voltages(), which enables it just in time.
+   - the USI has to stay enabled because its start condition detector wakes us for I2C.
+   - Timer0 (millis() and delay()) has to stay enabled while we are awake, in power down
+     its clock is stopped anyway.
+   The digital input buffer of a pin draws current when its voltage is between the logic
+   levels (ch. 7.4). We disable it (DIDR0, ch. 17.13.5) for the external voltage, which
+   is only measured, and for the button pin whenever the button is not monitored. The bits
+   of DIDR0 correspond to the pins PB0 to PB5.
+*/
+void init_power() {
+  ACSR = bit(ACD);
+  power_timer1_disable();
+  power_adc_disable();
+  input_buffer_off(PIN_EXT_VOLTAGE);
+}
+
+/*
+   Disable or enable the digital input buffer of a pin.
+*/
+void input_buffer_off(uint8_t pin) {
+  DIDR0 |= bit(pin);
+}
+
+void input_buffer_on(uint8_t pin) {
+  DIDR0 &= ~bit(pin);
+}
@@ -0,0 +1,134 @@
+/*
+   The pulse sequencer drives the switch pin of the UPS without blocking the main loop.
+   ups_off(), ups_on() and restart_raspberry() queue steps, each step sets the switch pin
+   to a level and keeps it there for a duration. The steps are executed by the watchdog
+   interrupt: the end of the current step is a deadline of the watchdog schedule (see
+   handleWatchdog.ino). The CPU sleeps in between, and the main loop (voltages, state
+   machine, I2C) keeps running on every wake-up. The watchdog periods are multiples of
+   16ms, so the durations are rounded to 16ms, which is precise enough for the switches.
+*/
+
+static const uint8_t PULSE_MIN_DURATION = 8;   // shorter steps only set the level, half the shortest watchdog period
+
+/*
+   The queue is a ring buffer, it is only accessed in atomic blocks or during the watchdog
+   interrupt.
+*/
+Pulse_Step pulse_queue[PULSE_QUEUE_SIZE];
+volatile uint8_t pulse_head = 0;                 // the index of the current step
+volatile uint8_t pulse_count = 0;                // the number of queued steps including the current one
+volatile uint16_t pulse_remaining = 0;           // the milliseconds left of the current step
+
+/*
+   Actions waiting for the end of the current sequence, see handle_pulse()
+*/
+volatile bool pending_ups_on = false;            // restart_raspberry() turns the UPS on after the recovery delay
+volatile bool pending_init_I2C = false;          // ups_on() restarts I2C once the RPi has been turned on
+
+/*
+   Called from the main loop. Starts the actions waiting for the end of the sequence.
+*/
+void handle_pulse() {
+  if (pulse_sequence_running()) {
+    return;
+  }
+  if (pending_ups_on) {
+    pending_ups_on = false;
+    ups_on();
+  } else if (pending_init_I2C) {
+    pending_init_I2C = false;
+    init_I2C();
+  }
+}
+
+bool pulse_sequence_running() {
+  return pulse_count > 0;
+}
+
+/*
+   Queue a single step.
+*/
+void queue_pulse(uint8_t level, uint16_t duration) {
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    queue_pulse_Int(level, duration);
+  }
+}
+
+/*
+   Queue one push of the switch and additional pushes separated by a shorter recovery
+   delay. The switch pin is high afterwards. The pushes are queued only if all of them
+   fit into the queue, a partial sequence could leave the switch pin low.
+*/
+void queue_switch_pulses(uint16_t length, uint8_t additional) {
+  uint16_t pause;
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    pause = switch_recovery_delay / SW_TO_PULSE_DIV;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (PULSE_QUEUE_SIZE - pulse_count >= 2 * (additional + 1)) {
+      queue_pulse_Int(LOW, length);
+      for (uint8_t i = 0; i < additional; i++) {
+        queue_pulse_Int(HIGH, pause);
+        queue_pulse_Int(LOW, length);
+      }
+      queue_pulse_Int(HIGH, 0);
+    }
+  }
+}
+
+/*
+   Add a step to the queue and start it if the sequencer is idle. A full queue drops the step.
+   Called with interrupts disabled.
+*/
+void queue_pulse_Int(uint8_t level, uint16_t duration) {
+  if (pulse_count >= PULSE_QUEUE_SIZE) {
+    return;
+  }
+  Pulse_Step *step = &pulse_queue[(pulse_head + pulse_count) % PULSE_QUEUE_SIZE];
+  step->level = level;
+  step->duration = duration;
+  pulse_count++;
+  if (pulse_count == 1) {
+    start_pulse_step_Int();
+    // the running watchdog period would end long after a short step
+    schedule_watchdog_Int();
+  }
+}
+
+/*
+   Set the level of the current step. Steps shorter than half the shortest watchdog
+   period only set the level. Called with interrupts disabled.
+*/
+void start_pulse_step_Int() {
+  while (pulse_count > 0) {
+    Pulse_Step *step = &pulse_queue[pulse_head];
+    if (step->level == LOW) {
+      switch_pin_low_Int();
+    } else {
+      switch_pin_high_Int();
+    }
+    if (step->duration >= PULSE_MIN_DURATION) {
+      pulse_remaining = step->duration;
+      return;
+    }
+    pulse_head = (pulse_head + 1) % PULSE_QUEUE_SIZE;
+    pulse_count--;
+  }
+}
+
+/*
+   A watchdog period has elapsed. Continue the current step or start the next one.
+   This function is called only by the watchdog interrupt.
+*/
+void advance_pulse_Int(uint16_t period) {
+  if (pulse_count == 0) {
+    return;
+  }
+  pulse_remaining = pulse_remaining > period ? pulse_remaining - period : 0;
+  if (pulse_remaining < PULSE_MIN_DURATION) {
+    pulse_head = (pulse_head + 1) % PULSE_QUEUE_SIZE;
+    pulse_count--;
+    start_pulse_step_Int();
+  }
+}
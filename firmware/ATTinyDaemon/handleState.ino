@@ -22,8 +22,8 @@ void handle_state() {
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
     seconds_safe = seconds;
   }
-  // Turn the LED on
-  if (state <= State::warn_state) {
+  // Turn the LED on, but not while the button is read for a gesture (see handleButton.ino)
+  if (state <= State::warn_state && !button_gesture_running()) {
     if (primed == 1 || (seconds_safe < timeout) ) {
       // start the regular blink if either primed is set or we are not yet in a timeout.
       ledOn_buttonOff();
@@ -45,7 +45,7 @@ void handle_state() {
   // If the button has been pressed or the bat_voltage is lower than the warn voltage
   // we blink the LED 5 times to signal that the RPi should shut down, if it has not
   // already signalled that it is doing so
-  if (state <= State::warn_state) {
+  if (state <= State::warn_state && !button_gesture_running()) {
     // we first check whether the Raspberry is already in the shutdown process
     if (!(should_shutdown & Shutdown_Cause::rpi_initiated)) {
       if (should_shutdown > Shutdown_Cause::rpi_initiated && (seconds_safe < timeout)) {
@@ -134,9 +134,10 @@ void act_on_state_change() {
     if (reset_i2c_bus) {
       init_I2C();
     }
-    if (should_restart) {
+    // a restart that is still executed by the pulse sequencer cannot be retried yet
+    if (should_restart && !pulse_sequence_running() && !pending_ups_on) {
       if (primed > 0
-          || (primed == 0 && (should_shutdown && static_cast<uint8_t>(Shutdown_Cause::button))) ) {
+          || (primed == 0 && (should_shutdown & Shutdown_Cause::button)) ) {
         // RPi has not accessed the I2C interface for more than timeout seconds.
         if(tried_reset) {
           // we already tried the reset. Blink 5 times to signal that.
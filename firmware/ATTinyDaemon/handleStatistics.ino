@@ -0,0 +1,132 @@
+/*
+   The statistics measure how long the firmware is awake and how long the I2C callbacks
+   stretch the bus, and count I2C transactions, errors and EEPROM writes. They are used
+   to size the power budget and to find the reason for failed reads on the RPi side.
+   The times are measured with micros(), which is based on Timer0. Timer0 is halted in
+   the ADC noise reduction mode, the time of the ADC conversions (about 0.1ms each)
+   is therefore not included in the wake time.
+   If STATISTICS is not defined all functions are empty.
+*/
+#if defined STATISTICS
+/*
+   These variables don't need to be volatile, they are changed during the I2C interrupt
+   or in an atomic block. The averages are calculated as exponential moving averages,
+   the accumulators hold the average multiplied by 2^STATISTICS_SHIFT. The counters are
+   kept directly in statistics, avg and max are filled in when the statistics are read.
+*/
+const uint8_t STATISTICS_SHIFT = 3;
+
+Statistics statistics;
+Time_Measurement wake_time;
+Time_Measurement isr_time;
+uint32_t wake_start = 0;
+#endif
+
+/*
+   Returns the start time of a measurement.
+*/
+uint32_t start_measurement() {
+#if defined STATISTICS
+  return micros();
+#else
+  return 0;
+#endif
+}
+
+#if defined STATISTICS
+/*
+   Add a new time to the average and maximum. Times that don't fit into 16 bit
+   are set to the maximum.
+*/
+void add_time_Int(uint32_t start, Time_Measurement *measurement) {
+  uint32_t time = micros() - start;
+  uint16_t time16 = time > USHRT_MAX ? USHRT_MAX : time;
+
+  measurement->acc = measurement->acc - (measurement->acc >> STATISTICS_SHIFT) + time16;
+  if (time16 > measurement->max) {
+    measurement->max = time16;
+  }
+}
+#endif
+
+/*
+   Called after waking up and before going to sleep by handle_sleep().
+*/
+void start_wake_time() {
+#if defined STATISTICS
+  wake_start = micros();
+#endif
+}
+
+void count_wake_time() {
+#if defined STATISTICS
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    add_time_Int(wake_start, &wake_time);
+  }
+#endif
+}
+
+/*
+   Count an I2C transaction and the time spent in the callback.
+   This function is called only by the USI state machine during an interrupt.
+*/
+void count_transaction_Int(uint32_t start) {
+#if defined STATISTICS
+  add_time_Int(start, &isr_time);
+  statistics.i2c_transactions++;
+#endif
+}
+
+/*
+   Count a write with a wrong CRC or a frame too large for the receive buffer.
+   These functions are called only by receive_event() during an interrupt.
+   The counters saturate.
+*/
+void count_crc_error_Int() {
+#if defined STATISTICS
+  if (statistics.crc_errors < UCHAR_MAX) {
+    statistics.crc_errors++;
+  }
+#endif
+}
+
+void count_oversized_frame_Int() {
+#if defined STATISTICS
+  if (statistics.oversized_frames < UCHAR_MAX) {
+    statistics.oversized_frames++;
+  }
+#endif
+}
+
+/*
+   Count a byte written to the EEPROM.
+*/
+void count_EEPROM_write() {
+#if defined STATISTICS
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    statistics.eeprom_writes++;
+  }
+#endif
+}
+
+/*
+   Copy or reset the statistics.
+   These functions are called only by the I2C callbacks during an interrupt.
+*/
+void read_statistics_Int(Statistics *copy) {
+#if defined STATISTICS
+  *copy = statistics;
+  copy->wake_time_avg = wake_time.acc >> STATISTICS_SHIFT;
+  copy->wake_time_max = wake_time.max;
+  copy->isr_time_avg = isr_time.acc >> STATISTICS_SHIFT;
+  copy->isr_time_max = isr_time.max;
+#endif
+}
+
+void reset_statistics_Int() {
+#if defined STATISTICS
+  memset(&statistics, 0, sizeof(statistics));
+  memset(&wake_time, 0, sizeof(wake_time));
+  memset(&isr_time, 0, sizeof(isr_time));
+#endif
+}
@@ -0,0 +1,283 @@
+/*
+ * The ATTiny datasheet I'm referencing is the ATTiny25/45/85 datasheet provided by Microchip.
+ * Pages and Chapter numbers are for the revision Rev. 2586Q-08/13.
+ */
+
+/*
+   I2C slave using the USI in two-wire mode (Ch. 15.3.4 of the datasheet), based on
+   the state machine of the application note AVR312 (Using the USI module as a TWI slave).
+   Received bytes are written directly to rbuf (see handleI2C.ino). A write is handed
+   to receive_event() when the master either sends a repeated start (register number
+   followed by a read) or a stop condition. There is no interrupt for the stop condition,
+   it is polled in handle_I2C() from the main loop. If we miss it because we were
+   sleeping, the write is handed over with the next start condition, in any case before
+   the next transfer is processed.
+   For a read request_event() is called when we are addressed. It hands the value to
+   write_data_crc(), which latches it into tx_buffer. The bytes are
+   sent from there and the CRC is calculated while the bytes are shifted out. The value
+   has to be latched because the main loop could change a multi-byte variable between
+   the transfer of two bytes.
+*/
+namespace USI_State {
+// this enum is in its own namespace and not declared as a class to keep the implicit conversion
+// to int when using it.
+enum Value {
+  idle                          = 0,       // waiting for a start condition
+  check_address                 = 1,       // the address byte is shifted in
+  send_data                     = 2,       // the next byte has to be sent
+  request_reply                 = 3,       // a byte has been sent, the ACK/NACK of the master is read next
+  check_reply                   = 4,       // the ACK/NACK of the master has been read
+  request_data                  = 5,       // the next byte is read
+  get_data                      = 6,       // a byte has been read and is acknowledged
+} __attribute__ ((__packed__));            // force smallest size i.e., uint_8t (GCC syntax)
+}
+
+/*
+   The USI status register values. Writing a 1 clears a flag, the lowest 4 bits
+   are the counter value. The counter counts both clock edges, so 0 means 8 bits
+   and 0x0E means a single bit (used for ACK/NACK).
+*/
+static const uint8_t USI_CLEAR_FLAGS      = bit(USIOIF) | bit(USIPF) | bit(USIDC);
+static const uint8_t USI_COUNT_BYTE       = 0x00;
+static const uint8_t USI_COUNT_BIT        = 0x0E;
+
+/*
+   The state of the state machine. The state is volatile because it is checked
+   in the main loop by i2c_busy(), everything else is only accessed during the
+   interrupts or in atomic blocks.
+*/
+volatile uint8_t usi_state = USI_State::idle;
+uint8_t rx_count = 0;                 // the number of bytes of the current write, 0 if none
+uint8_t tx_buffer[TX_BUFFER_SIZE];    // the value that is currently sent
+uint8_t tx_len = 0;                   // the number of valid bytes in tx_buffer
+uint8_t tx_pos = 0;                   // the next byte to send, tx_len is the CRC
+uint8_t tx_crc = 0;                   // the CRC of the bytes sent so far
+
+/*
+   Initialize the I2C connection
+ */
+void init_I2C() {
+#if defined SERIAL_DEBUG
+  Serial.println(F("In init_I2C()"));
+#endif
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (!valid_i2c_address(i2c_address)) {
+      // the EEPROM has not been written with an address yet
+      i2c_address = I2C_ADDRESS;
+    }
+    i2c_address_pending = i2c_address;
+
+    // SCL is an output, the USI only pulls it low to stretch the clock. SDA is an
+    // input unless we send. The pull-ups are on the RPi side.
+    pb_high(PIN_SCL);
+    pb_high(PIN_SDA);
+    pb_output(PIN_SCL);
+    pb_input(PIN_SDA);
+
+    rx_count = 0;
+    usi_start_condition_mode();
+  }
+}
+
+/*
+   Returns true while a transfer is in progress. The USI overflow interrupt cannot
+   wake us from power down or ADC noise reduction mode, we must not enter those
+   during a transfer.
+*/
+bool i2c_busy() {
+  return usi_state != USI_State::idle;
+}
+
+/*
+   Called from the main loop. Hands a write that has been finished with a stop
+   condition to receive_event() and returns the state machine to idle.
+*/
+void handle_I2C() {
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    // if the start flag is set a new transfer has started after the stop
+    if ((USISR & bit(USIPF)) && !(USISR & bit(USISIF))) {
+      USISR = bit(USIPF);
+      if (rx_count > 0) {
+        dispatch_receive_Int();
+      }
+      if (usi_state != USI_State::idle) {
+        usi_start_condition_mode();
+      }
+    }
+  }
+}
+
+/*
+   Hand the received bytes to receive_event().
+   This function is called only during an interrupt or in an atomic block.
+*/
+void dispatch_receive_Int() {
+  uint8_t bytes = rx_count;
+  rx_count = 0;
+  uint32_t start = start_measurement();
+  receive_event(bytes);
+  count_transaction_Int(start);
+}
+
+/*
+   Return the next byte to send: the bytes of the latched value, then the CRC,
+   and 0xFF if the master reads beyond that.
+   This function is called only by the USI overflow interrupt.
+*/
+uint8_t usi_tx_byte_Int() {
+  if (tx_pos < tx_len) {
+    uint8_t data = tx_buffer[tx_pos++];
+    tx_crc = crc8_bytecalc(data, tx_crc);
+    return data;
+  }
+  if (tx_pos == tx_len) {
+    tx_pos++;
+    return tx_crc;
+  }
+  return 0xFF;
+}
+
+/*
+   This function latches a msg for sending via I2C. The CRC8 is seeded with the
+   register number here, usi_tx_byte_Int() adds each byte while it is shifted
+   out and sends the CRC after the last byte.
+   This function is called only by request_event() (handleI2C) during an interrupt.
+*/
+void write_data_crc(uint8_t *msg, uint8_t len) {
+  for (uint8_t i = 0; i < len; i++) {
+    tx_buffer[i] = msg[i];
+  }
+  tx_len = len;
+  tx_pos = 0;
+  tx_crc = crc8_bytecalc((uint8_t) register_number, CRC8INIT);
+}
+
+/*
+   The following functions set the USI up for the next step of the state machine.
+*/
+void usi_start_condition_mode() {
+  usi_state = USI_State::idle;
+  pb_input(PIN_SDA);
+  // start condition interrupt, two-wire mode without holding SCL on counter overflow
+  USICR = bit(USISIE) | bit(USIWM1) | bit(USICS1);
+  USISR = bit(USISIF) | USI_CLEAR_FLAGS;
+}
+
+void usi_send_ack() {
+  USIDR = 0;
+  pb_output(PIN_SDA);
+  USISR = USI_CLEAR_FLAGS | USI_COUNT_BIT;
+}
+
+void usi_read_ack() {
+  pb_input(PIN_SDA);
+  USIDR = 0;
+  USISR = USI_CLEAR_FLAGS | USI_COUNT_BIT;
+}
+
+void usi_send_data() {
+  pb_output(PIN_SDA);
+  USISR = USI_CLEAR_FLAGS | USI_COUNT_BYTE;
+}
+
+void usi_read_data() {
+  pb_input(PIN_SDA);
+  USISR = USI_CLEAR_FLAGS | USI_COUNT_BYTE;
+}
+
+/*
+   A start condition has been detected. The USI holds SCL low until USISIF is cleared.
+   This is also the wake-up source when we are sleeping.
+*/
+ISR(USI_START_vect) {
+  // a repeated start or a start after a stop we missed finishes the last write
+  if (rx_count > 0) {
+    dispatch_receive_Int();
+  }
+
+  usi_state = USI_State::check_address;
+  pb_input(PIN_SDA);
+
+  // wait until the start condition is complete (SCL low) or a stop occurs (SDA high)
+  while ((PINB & bit(PIN_SCL)) && !(PINB & bit(PIN_SDA)));
+
+  if (PINB & bit(PIN_SDA)) {
+    // stop condition, wait for the next start
+    usi_start_condition_mode();
+    return;
+  }
+  // enable the overflow interrupt and hold SCL on counter overflow
+  USICR = bit(USISIE) | bit(USIOIE) | bit(USIWM1) | bit(USIWM0) | bit(USICS1);
+  USISR = bit(USISIF) | USI_CLEAR_FLAGS | USI_COUNT_BYTE;
+}
+
+/*
+   The counter overflowed, i.e., a byte or an ACK/NACK bit has been shifted. SCL is
+   held low until the counter overflow flag is cleared by the next usi_* function.
+*/
+ISR(USI_OVF_vect) {
+  switch (usi_state) {
+    case USI_State::check_address:
+      if ((USIDR >> 1) != i2c_address) {
+        if ((USIDR >> 1) != i2c_address_pending) {
+          usi_start_condition_mode();
+          break;
+        }
+        take_over_i2c_address_Int();
+      }
+      if (USIDR & 0x01) {
+        // the master reads, prepare the value
+        usi_state = USI_State::send_data;
+        tx_len = 0;
+        tx_pos = 1;
+        uint32_t start = start_measurement();
+        request_event();
+        count_transaction_Int(start);
+      } else {
+        usi_state = USI_State::request_data;
+        rx_count = 0;
+      }
+      usi_send_ack();
+      break;
+
+    case USI_State::check_reply:
+      if (USIDR & 0x01) {
+        // NACK, the master does not want more data
+        usi_start_condition_mode();
+        break;
+      }
+      // ACK, send the next byte
+      // fall through
+    case USI_State::send_data:
+      USIDR = usi_tx_byte_Int();
+      usi_state = USI_State::request_reply;
+      usi_send_data();
+      break;
+
+    case USI_State::request_reply:
+      usi_state = USI_State::check_reply;
+      usi_read_ack();
+      break;
+
+    case USI_State::request_data:
+      usi_state = USI_State::get_data;
+      usi_read_data();
+      break;
+
+    case USI_State::get_data:
+      // receive_event() drops frames that are too long
+      if (rx_count < BUFFER_SIZE) {
+        rbuf[rx_count] = USIDR;
+      }
+      if (rx_count < UCHAR_MAX) {
+        rx_count++;
+      }
+      usi_state = USI_State::request_data;
+      usi_send_ack();
+      break;
+
+    default:
+      usi_start_condition_mode();
+      break;
+  }
+}
@@ -38,16 +38,65 @@
    1111  ADC4 (Temperature)
 */
 
+/*
+   The coefficients are given as value * 1000. To avoid the expensive 32 bit divisions on
+   every measurement we convert them to multipliers with CALIBRATION_SHIFT fractional bits
+   (Q12) whenever they change, so applying a coefficient is a multiplication and a shift.
+   The coefficient of the battery voltage is folded into the numerator of the Vcc
+   calculation, which leaves one division per measurement for inverting the band gap
+   measurement. Only accessed from the main loop, thus not volatile.
+*/
+static const uint8_t  CALIBRATION_SHIFT = 12;
+static const uint32_t BAND_GAP_NUMERATOR = 1126400L;    // 1.1*1024*1000, see Ch. 17.11.1 of datasheet
+
+uint32_t bat_voltage_numerator;    // BAND_GAP_NUMERATOR * bat_voltage_coefficient / 1000
+uint32_t ext_voltage_multiplier;   // ext_voltage_coefficient / 1000 in Q12
+uint32_t temperature_multiplier;   // temperature_coefficient / 1000 in Q12
+
+/*
+   Calculate the multipliers from the coefficients if one of them has been changed.
+*/
+void update_calibration() {
+  uint16_t bat_voltage_coefficient_safe, ext_voltage_coefficient_safe, temperature_coefficient_safe;
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (recalc_calibration == false) {
+      return;
+    }
+    recalc_calibration = false;
+    bat_voltage_coefficient_safe = bat_voltage_coefficient;
+    ext_voltage_coefficient_safe = ext_voltage_coefficient;
+    temperature_coefficient_safe = temperature_coefficient;
+  }
+
+  // 1126400 * 65535 does not fit into 32 bit, 1126.4 * 65535 does
+  bat_voltage_numerator = (uint32_t) bat_voltage_coefficient_safe * (BAND_GAP_NUMERATOR / 100) / 10;
+  ext_voltage_multiplier = q12_of_coefficient(ext_voltage_coefficient_safe);
+  temperature_multiplier = q12_of_coefficient(temperature_coefficient_safe);
+}
+
+/*
+   Convert a coefficient * 1000 to a rounded Q12 multiplier.
+*/
+uint32_t q12_of_coefficient(uint16_t coefficient) {
+  return (((uint32_t) coefficient << CALIBRATION_SHIFT) + 500) / 1000;
+}
+
 void read_voltages() {
   // if we are in shutdown state take only one measurement
   uint8_t num_measurements = state > State::warn_state ? 1 : NUM_MEASUREMENTS; 
 
+  update_calibration();
+
+  // the comparator shares the multiplexer with the ADC (see watch_ext_voltage())
+  bool ext_voltage_watched = unwatch_ext_voltage();
+
   /* Table 17-5 defines the prescaler values. For a clock frequency of 8MHz which we use,
      a divison factor of 64 leads to the needed sample rate of 125kHz, which is in the
      needed 50-200kHz range. For this factor ADPS[2:0] is 110
   */
-  //-- Enable ADC with a division factor of 64 -----------------------------------------
-  ADCSRA = bit(ADEN) | bit(ADPS2) | bit(ADPS1);
+  //-- Enable ADC with a division factor of 64 and the conversion complete interrupt ---
+  power_adc_enable();  // the ADC is only clocked during the measurements (see handlePower.ino)
+  ADCSRA = bit(ADEN) | bit(ADIE) | bit(ADPS2) | bit(ADPS1);
 
   //-- Measure Temperature -------------------------------------------------------------
   // temperature first because the ADC measurements heat the chip
@@ -56,15 +105,12 @@ void read_voltages() {
 
   uint32_t temp_temperature = read_adc(num_measurements);
 
-  uint16_t temperature_coefficient_safe;
   int16_t temperature_constant_safe;
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    temperature_coefficient_safe = temperature_coefficient;
     temperature_constant_safe = temperature_constant;
   }
 
-  temp_temperature *= temperature_coefficient_safe;
-  temp_temperature = temp_temperature / 1000 + temperature_constant_safe;
+  temp_temperature = ((temp_temperature * temperature_multiplier) >> CALIBRATION_SHIFT) + temperature_constant_safe;
 
   //-- Measure Vcc ---------------------------------------------------------------------
   /*
@@ -82,25 +128,18 @@ void read_voltages() {
    of 1ms before measurements are stable. Conversions starting before this may not
    be reliable. The ADC must be enabled during the settling time.
   */
-  delay(2); // Wait for ADC to settle
+  adc_settle(); // Wait for ADC to settle
 
-  // Calculate Vcc (in mV); 1.126.400 = 1.1*1024*1000, see Ch. 17.11.1 of datasheet
-  uint32_t temp_bat_voltage = 1126400L / read_adc(num_measurements);
+  // Calculate Vcc (in mV) corrected by the coefficient (see bat_voltage_numerator)
+  uint32_t temp_bat_voltage = bat_voltage_numerator / read_adc(num_measurements);
 
-  // correct the measurement using coefficient and constant
-  uint16_t bat_voltage_coefficient_safe;
+  // correct the measurement using the constant
   int16_t bat_voltage_constant_safe;
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    bat_voltage_coefficient_safe = bat_voltage_coefficient;
     bat_voltage_constant_safe = bat_voltage_constant;
-    if(reset_bat_voltage == true) {
-      reset_bat_voltage = false;
-      bat_voltage = 0;
-    }
   }
 
-  temp_bat_voltage *= bat_voltage_coefficient_safe;
-  temp_bat_voltage = temp_bat_voltage / 1000 + bat_voltage_constant_safe;
+  temp_bat_voltage += bat_voltage_constant_safe;
 
 
   //-- Measure EXT_V -------------------------------------------------------------------
@@ -110,32 +149,30 @@ void read_voltages() {
 
   uint32_t temp_ext_voltage = read_adc(num_measurements);
   temp_ext_voltage *= temp_bat_voltage;    // normalize relative to Vcc
-  temp_ext_voltage /= 1024;
+  temp_ext_voltage >>= 10;                 // divide by 1024
 
   // correct the measurement using coefficient and constant
-  uint16_t ext_voltage_coefficient_safe;
   int16_t ext_voltage_constant_safe;
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    ext_voltage_coefficient_safe = ext_voltage_coefficient;
     ext_voltage_constant_safe = ext_voltage_constant;
   }
   if((signed)temp_ext_voltage > ext_voltage_constant_safe) {
-    temp_ext_voltage *= ext_voltage_coefficient_safe;
-    temp_ext_voltage = temp_ext_voltage / 1000 + ext_voltage_constant_safe;
+    temp_ext_voltage = ((temp_ext_voltage * ext_voltage_multiplier) >> CALIBRATION_SHIFT) + ext_voltage_constant_safe;
   } else {
     temp_ext_voltage = 0;
   }
 
 
   //-- Turn off the ADC ----------------------------------------------------------------
-  ADCSRA &= ~bit(ADEN); // turn off the ADC
+  ADCSRA &= ~(bit(ADEN) | bit(ADIE)); // turn off the ADC
+  power_adc_disable();                // stop its clock, ADEN has to be cleared first
 
-  if (bat_voltage != 0) {
-    // Average battery voltage over the last few measurements.
-    // This allows us to average out short voltage spikes caused by
-    // the Raspberry's different loads.
-    temp_bat_voltage = (temp_bat_voltage + bat_voltage * 9) / 10;
-  }
+  // the unfiltered value, this is what the comparator sees
+  watch_ext_voltage(ext_voltage_watched, temp_ext_voltage);
+
+  // Filter the measurements, e.g. to average out short voltage spikes caused
+  // by the Raspberry's different loads (see handleFilter.ino)
+  filter_measurements(&temp_bat_voltage, &temp_ext_voltage, &temp_temperature);
 
   // we use the following block to guarantee that the values are atomically set
   // even in the presence of interrupts from I2C
@@ -160,14 +197,9 @@ uint32_t read_adc(uint8_t num_measurements) {
 
   // measure num_measurements + 1 times and throw away first measurement
   for (int i = 0; i <= num_measurements; i++) {
-    ADCSRA |= bit(ADSC); // Start conversion
-    loop_until_bit_is_clear(ADCSRA, ADSC); // wait for results
-
-    uint8_t low  = ADCL; // must read ADCL first - it then locks ADCH
-    uint8_t high = ADCH; // unlocks both
+    uint16_t current_val = adc_conversion();
 
     if(i != 0) { // throw away the first measurement
-      uint16_t current_val = (high << 8) | low;
       result += current_val;
       if (current_val > highest_val) {
         highest_val = current_val;
@@ -185,3 +217,149 @@ uint32_t read_adc(uint8_t num_measurements) {
 
   return result;  // 32 bit forces correct calculation of voltages in the next step
 }
+
+/*
+   The ADC conversion complete interrupt only wakes us from sleep, the result is
+   read by adc_conversion().
+*/
+EMPTY_INTERRUPT(ADC_vect);
+
+/*
+   This function does one ADC conversion in the ADC noise reduction sleep mode
+   (Ch. 17.7 of the datasheet). Entering the sleep mode starts the conversion,
+   the conversion complete interrupt wakes us up again. Since the CPU and the I/O
+   clock are halted the conversion is not disturbed by digital noise and the
+   power consumption is much lower than with busy waiting. The timer used for
+   millis() is halted as well, we lose about 0.1ms for each conversion.
+   Other interrupts (e.g., I2C) can wake us before the conversion is complete,
+   in this case we simply go back to sleep, the conversion continues.
+   The USI overflow interrupt cannot wake us from this mode, during an I2C
+   transfer we start the conversion ourselves and wait without sleeping.
+   The decision is made once per pass, the transfer can start or end at any
+   time and the conversion must be started before we look at ADSC.
+*/
+uint16_t adc_conversion() {
+  bool started = false;
+  set_sleep_mode(SLEEP_MODE_ADC);
+  sleep_enable();
+  do {
+    if (!i2c_busy()) {
+      sleep_cpu(); // starts the conversion if it isn't running yet
+    } else if (!started) {
+      ADCSRA |= bit(ADSC); // Start conversion
+    }
+    started = true;
+  } while (bit_is_set(ADCSRA, ADSC));
+  sleep_disable();
+
+  uint8_t low  = ADCL; // must read ADCL first - it then locks ADCH
+  uint8_t high = ADCH; // unlocks both
+
+  return (high << 8) | low;
+}
+
+/*
+   This function waits for the ADC to settle after switching the reference voltage
+   by doing throw-away conversions. At 125kHz ADC clock each conversion takes 13
+   ADC cycles (104us), so ADC_SETTLE_CONVERSIONS conversions cover the needed 1ms
+   while the CPU sleeps.
+*/
+void adc_settle() {
+  for (uint8_t i = 0; i < ADC_SETTLE_CONVERSIONS; i++) {
+    adc_conversion();
+  }
+}
+
+/*
+   The fast path for the loss of the external voltage (compile option EXT_VOLTAGE_COMPARATOR).
+   read_voltages() only notices the loss at the next wake-up, up to 8 seconds later. While
+   the external voltage is present the analog comparator watches it in between: the band gap
+   (ACBG) is compared against the external voltage pin, which is connected through the ADC
+   multiplexer (ACME, ch. 16.1), and ANA_COMP_vect fires as soon as the pin drops below it.
+   The interrupt sets Shutdown_Cause::ext_voltage and wakes us, handle_state() measures the
+   voltages immediately and handle_attention() signals the RPi.
+   The threshold is the band gap at the pin. With the default divider (see
+   ext_voltage_coefficient and ext_voltage_constant) this is an external voltage of about
+   2.9V, below MIN_POWER_LEVEL. A supply that is switched off passes it within milliseconds,
+   a supply that sags slowly below MIN_POWER_LEVEL is caught by the next measurement, which
+   then sets the same cause. The cause is cleared when a measurement sees the external
+   voltage again.
+   The multiplexer can only be used by the comparator while the ADC is disabled but clocked,
+   so read_voltages() stops the comparator during the measurements. The comparator interrupt
+   doesn't wake us from power down (ch. 7.1), handle_sleep() uses the idle mode while it is
+   armed.
+*/
+static const uint8_t BAND_GAP_STARTUP = 70;       // us, maximum start-up time of the band gap (electrical characteristics)
+
+volatile uint8_t ext_voltage_comparator = false;   // true while the comparator is armed
+
+#if defined EXT_VOLTAGE_COMPARATOR
+/*
+   The external voltage has dropped below the threshold. The comparator is stopped until
+   the next measurement sees the external voltage again.
+*/
+ISR (ANA_COMP_vect) {
+  stop_comparator_Int();
+  should_shutdown |= Shutdown_Cause::ext_voltage;
+}
+
+/*
+   Called with interrupts disabled. The clock of the ADC is only needed by the multiplexer
+   of the armed comparator, it is stopped again (see handlePower.ino).
+*/
+void stop_comparator_Int() {
+  ACSR = bit(ACD);
+  ADCSRB &= ~bit(ACME);
+  power_adc_disable();
+  ext_voltage_comparator = false;
+}
+#endif
+
+/*
+   Returns true if the comparator watches the external voltage.
+*/
+bool ext_voltage_watched() {
+  return ext_voltage_comparator;
+}
+
+/*
+   Stop the comparator before the ADC is used. Returns whether the external voltage has been
+   watched until now.
+*/
+bool unwatch_ext_voltage() {
+  bool watched = false;
+#if defined EXT_VOLTAGE_COMPARATOR
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    watched = ext_voltage_comparator;
+    stop_comparator_Int();
+  }
+#endif
+  return watched;
+}
+
+/*
+   Start the comparator if the external voltage is present, otherwise report its loss if it
+   has been watched until now. Called after the measurements with the ADC turned off.
+*/
+void watch_ext_voltage(bool watched, uint16_t measured_ext_voltage) {
+#if defined EXT_VOLTAGE_COMPARATOR
+  if (measured_ext_voltage >= MIN_POWER_LEVEL) {
+    power_adc_enable();                        // the multiplexer needs the clock of the ADC
+    ADMUX = ADC_NUMBER(EXT_VOLTAGE);
+    ADCSRB |= bit(ACME);
+    // the output rises when the pin drops below the band gap, the interrupt has to be
+    // disabled while the edge is selected
+    ACSR = bit(ACBG) | bit(ACIS1) | bit(ACIS0);
+    delayMicroseconds(BAND_GAP_STARTUP);
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      ACSR |= bit(ACI) | bit(ACIE);            // writing ACI clears a flag raised while switching on
+      ext_voltage_comparator = true;
+      should_shutdown &= ~Shutdown_Cause::ext_voltage;
+    }
+  } else if (watched) {
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      should_shutdown |= Shutdown_Cause::ext_voltage;
+    }
+  }
+#endif
+}
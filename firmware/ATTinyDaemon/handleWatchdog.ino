@@ -1,77 +1,220 @@
 /*
- * The ATTiny datasheet I'm referencing is the ATTiny25/45/85 datasheet provided by Microchip. 
+ * The ATTiny datasheet I'm referencing is the ATTiny25/45/85 datasheet provided by Microchip.
  * Pages and Chapter numbers are for the revision Rev. 2586Q-08/13.
  */
 
+/*
+ * The watchdog is the clock of the system. After setup() it runs all the time, every
+ * period is armed by schedule_watchdog_Int() and accounted when it fires, so the virtual
+ * clock advances by the time that actually passed, asleep or awake. Early wake-ups by I2C
+ * don't touch the watchdog, the first edge of a button gesture restarts it with the
+ * shortest period (see handleButton.ino). The periods are 16ms << index (index 0 to 9,
+ * data sheet ch. 8.5.2, table 8-3, p.46). The clock relies on the watchdog oscillator,
+ * which is only about 10% accurate (ch. 21.4.2).
+ * clock_ms is the time since the start, seconds (the time since the last I2C access) and
+ * the other counters in seconds are advanced for every full second.
+ */
+static const uint8_t WATCHDOG_MIN_PERIOD       =  16;        // the shortest period in ms
+static const uint8_t WATCHDOG_MAX_PERIOD_INDEX =   9;        // the longest period, 16ms << 9 = 8s
+static const uint8_t WATCHDOG_STOPPED          = UCHAR_MAX;  // no period is armed
+
+volatile uint32_t clock_ms = 0;
+volatile uint16_t clock_fraction = 0;                // the milliseconds since the last full second
+volatile uint8_t watchdog_period = WATCHDOG_STOPPED; // the index of the armed period
+volatile uint32_t watchdog_end = 0;                  // clock_ms at the end of the armed period
+
+/*
+ * The state of the sampling schedule. Samples are taken every wakeup_interval seconds.
+ * wakeup_interval can be read via I2C, sample_period is the index of the watchdog period
+ * with this length. The watchdog interrupt sets sample_due and moves next_sample on by the
+ * current interval, reset_watchdog() then decides on the next interval. The other values
+ * are only used in reset_watchdog() and need not be volatile.
+ */
+volatile uint8_t wakeup_interval = 8;
+volatile uint8_t sample_period = WATCHDOG_MAX_PERIOD_INDEX;
+volatile uint32_t sample_time = 0;  // the deadline of the last sample
+volatile uint32_t next_sample = 0;  // the deadline of the next sample
+volatile bool sample_due = true;
+uint16_t last_bat_voltage = 0;      // the battery voltage at the last sample
+uint16_t last_ext_voltage = 0;      // the external voltage at the last sample
+uint8_t stable_wakeups = 0;         // the number of consecutive samples with stable voltages
+
 /*
  * taken from http://www.gammon.com.au/power
- * We use the watchdog to wake us from deep sleep. The length of the
- * deep sleep depends on the current battery voltage. If above 
- * warn_voltage, we wake every second, if between shutdown_voltage and
- * warn_voltage, we wake very 2 seconds, and if we are below shutdown_voltage
- * we only wake every 8 seconds. Our seconds counter is changed accordingly.
+ * We use the watchdog to wake us from deep sleep. The interval between two
+ * samples depends on the current battery voltage. If above
+ * warn_voltage, we sample every second, if between shutdown_voltage and
+ * warn_voltage, we sample very 2 seconds, and if we are below shutdown_voltage
+ * we only sample every 8 seconds. If neither battery nor external voltage
+ * changed by more than VOLTAGE_SLOPE mV per second for STABLE_WAKEUPS
+ * samples, nothing is happening (normally we are on stable mains) and we
+ * sample every 8 seconds as well. When a voltage starts to move again (loss of
+ * mains, heavy load) we immediately return to the shorter intervals.
+ * The intervals are watchdog periods (1.024s, 2.048s and 8.192s), so a sample
+ * without other deadlines needs a single period.
+ * Called before going to sleep (and in setup()), the interval is only decided
+ * after a sample. If the watchdog is not running yet, it is started.
  */
 void reset_watchdog () {
-  uint8_t wd_value;
-
-  uint16_t bat_voltage_safe, ups_shutdown_voltage_safe, warn_voltage_safe;
+  bool due;
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    bat_voltage_safe = bat_voltage;
-    ups_shutdown_voltage_safe = ups_shutdown_voltage;
-    warn_voltage_safe = warn_voltage;
+    due = sample_due;
+    sample_due = false;
   }
 
-  if (bat_voltage_safe <= ups_shutdown_voltage_safe) {
-    // either startup or low power (includes bat_voltage == 0)
-    // If we are starting then this gives us enough time to
-    // initialize everything without any problems    
-    wd_value = bit (WDIE) | bit (WDP3) | bit (WDP0);                 // set WDIE, and 8 seconds delay
-
+  if (due) {
+    uint16_t bat_voltage_safe, ext_voltage_safe, ups_shutdown_voltage_safe, warn_voltage_safe;
     ATOMIC_BLOCK(ATOMIC_FORCEON) {
-      seconds += 8;
+      bat_voltage_safe = bat_voltage;
+      ext_voltage_safe = ext_voltage;
+      ups_shutdown_voltage_safe = ups_shutdown_voltage;
+      warn_voltage_safe = warn_voltage;
     }
-  } else if (bat_voltage_safe <= warn_voltage_safe) {
-    // warn_voltage, we reduce signalling to every 2 seconds
-    wd_value = bit (WDIE) | bit (WDP2) | bit (WDP1) | bit (WDP0);    // set WDIE, and 2 second delay
 
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-      seconds += 2;
+    // the maximum change since the last sample if the voltages are stable
+    uint16_t max_change = VOLTAGE_SLOPE * wakeup_interval;
+    if (voltage_change(bat_voltage_safe, last_bat_voltage) <= max_change
+        && voltage_change(ext_voltage_safe, last_ext_voltage) <= max_change) {
+      if (stable_wakeups < STABLE_WAKEUPS) {
+        stable_wakeups++;
+      }
+    } else {
+      stable_wakeups = 0;
+    }
+    last_bat_voltage = bat_voltage_safe;
+    last_ext_voltage = ext_voltage_safe;
+
+    uint8_t interval, period;
+    if (bat_voltage_safe <= ups_shutdown_voltage_safe || stable_wakeups == STABLE_WAKEUPS) {
+      // either startup, low power (includes bat_voltage == 0) or nothing happens.
+      // If we are starting then this gives us enough time to
+      // initialize everything without any problems
+      interval = 8;
+      period = 9;
+    } else if (bat_voltage_safe <= warn_voltage_safe) {
+      // warn_voltage, we reduce signalling to every 2 seconds
+      interval = 2;
+      period = 7;
+    } else {
+      // everything ok, we signal every second
+      interval = 1;
+      period = 6;
     }
-  } else {
-    // everything ok, we signal every second
-    wd_value = bit (WDIE) | bit (WDP2) | bit (WDP1);                 // set WDIE, and 1 second delay
 
     ATOMIC_BLOCK(ATOMIC_FORCEON) {
-      seconds += 1;
+      wakeup_interval = interval;
+      sample_period = period;
+      next_sample = sample_time + ((uint32_t) WATCHDOG_MIN_PERIOD << period);
+      // a shorter interval is not reached by the period armed after the sample
+      if ((int32_t) (watchdog_end - next_sample) > 0) {
+        schedule_watchdog_Int();
+      }
+    }
+  }
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (watchdog_period == WATCHDOG_STOPPED) {
+      schedule_watchdog_Int();
     }
   }
+}
 
+/*
+ * Arm the watchdog with the longest period that ends before the next deadline: the next
+ * sample, the end of the current pulse step (see handlePulse.ino) or the timeout of the
+ * RPi. During a button gesture the shortest period is used. If a period is already
+ * running, the part of it that has passed is lost to the clock, the watchdog counter
+ * cannot be read. This happens only when the interval becomes shorter right after a
+ * sample, when a pulse sequence starts or with the first edge of a button gesture.
+ * Called with interrupts disabled.
+ */
+void schedule_watchdog_Int() {
+  uint32_t remaining = (int32_t) (next_sample - clock_ms) > 0 ? next_sample - clock_ms : 0;
+  if (pulse_sequence_running() && pulse_remaining < remaining) {
+    remaining = pulse_remaining;
+  }
+  if (button_gesture_running()) {
+    // the durations of a gesture are measured with the shortest period (see handleButton.ino)
+    remaining = 0;
+  }
+  if (seconds <= timeout) {
+    // act_on_state_change() restarts the RPi when seconds exceeds the timeout
+    uint32_t to_timeout = (uint32_t) (timeout + 1 - seconds) * 1000 - clock_fraction;
+    if (to_timeout < remaining) {
+      remaining = to_timeout;
+    }
+  }
+
+  uint8_t index = 0;
+  while (index < WATCHDOG_MAX_PERIOD_INDEX && ((uint32_t) WATCHDOG_MIN_PERIOD << (index + 1)) <= remaining) {
+    index++;
+  }
+  watchdog_period = index;
+  watchdog_end = clock_ms + ((uint32_t) WATCHDOG_MIN_PERIOD << index);
+  // the period index is split into WDP3 and WDP2..0
+  set_watchdog_Int(bit (WDIE) | (index & 0b0111) | ((index & 0b1000) ? bit (WDP3) : 0));
+}
+
+/*
+ * Write a new value to the watchdog control register and restart the watchdog.
+ * Called with interrupts disabled.
+ */
+void set_watchdog_Int(uint8_t wd_value) {
   // clear various "reset" flags
   MCUSR = 0;
   // allow changes, disable reset, clear existing interrupt, data sheet ch. 8.5.2, p.46ff
   WDTCR = bit (WDCE) | bit (WDE) | bit (WDIF);
   // data change, Ch. 8.4.1.2, the new timeout value has to be written within the next
-  // 4 cycles. Thus we first determine the correct value (above) and then write it at once. 
+  // 4 cycles. Thus we first determine the correct value and then write it at once.
   WDTCR = wd_value;
 
   wdt_reset();
 }
 
 /*
- * Here we disable the watchdog. It is not enough to call wdt_disable(), MCUSR has to be set to 0 as well
- * on the ATTiny. Although this is not pointed out explicitly in the datasheet on p. 42 where
- * disabling the watchdog is explained, on p. 44 there is an example C code that does exactly that, and
- * additionally on p. 46 when explaining WDE it is mentioned in passing. 
+ * Returns the absolute difference of two voltages.
  */
-void disable_watchdog() {
-  
-  MCUSR = 0;
-  wdt_disable();  // disable watchdog
+uint16_t voltage_change(uint16_t voltage, uint16_t last_voltage) {
+  return voltage > last_voltage ? voltage - last_voltage : last_voltage - voltage;
+}
+
+/*
+ * Advance the clock by an elapsed period and all counters by the full seconds.
+ * This function is called only by the watchdog interrupt.
+ */
+void advance_clock_Int(uint16_t period) {
+  clock_ms += period;
+  clock_fraction += period;
+
+  uint8_t full_seconds = 0;
+  while (clock_fraction >= 1000) {
+    clock_fraction -= 1000;
+    full_seconds++;
+  }
+  if (full_seconds > 0) {
+    seconds += full_seconds;
+    add_estimator_time_Int(full_seconds);
+
+    // full seconds without I2C writes have passed
+    eeprom_quiet_seconds = eeprom_quiet_seconds > full_seconds ? eeprom_quiet_seconds - full_seconds : 0;
+  }
+
+  if ((int32_t) (clock_ms - next_sample) >= 0) {
+    // continue with the current interval until reset_watchdog() decides on the next one
+    sample_due = true;
+    sample_time = next_sample;
+    next_sample += (uint32_t) WATCHDOG_MIN_PERIOD << sample_period;
+  }
 }
 
 /*
- * This ISR will be called when the watchdog wakes up the system.
+ * This ISR will be called when the watchdog wakes up the system. The watchdog keeps
+ * running in interrupt mode, we only set the next period.
  */
 ISR (WDT_vect) {
-  disable_watchdog();
+  uint16_t period = WATCHDOG_MIN_PERIOD << watchdog_period;
+
+  advance_clock_Int(period);
+  advance_pulse_Int(period);
+  schedule_watchdog_Int();
 }
@@ -0,0 +1,90 @@
+/*
+   Micro benchmarks of the hot paths of the firmware: the watchdog interrupt, I2C
+   transactions, the voltage measurement, the CRC, the config hash and the filters.
+
+   The numbers are host CPU cycles (rdtsc) or nanoseconds, not AVR cycles. They are a
+   relative measure to catch regressions and to compare implementations, an optimization
+   that halves the host time does usually not halve the time on the ATTiny. The ADC
+   conversions and delays of the firmware take no host time (see mock.cpp).
+*/
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <Arduino.h>
+#include "ATTinyDaemon.h"
+#include "i2c_master.h"
+#include "host.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+void setup();
+void read_voltages();
+uint8_t crc8_message_calc(uint8_t *msg, uint8_t len);
+uint16_t config_hash_Int();
+uint16_t filter_value(Filter *filter, uint8_t config, uint16_t value);
+uint16_t soc_of_voltage(uint16_t voltage);
+extern "C" void WDT_vect(void);
+
+static const uint32_t ITERATIONS = 100000;
+
+/*
+   The time stamp in host cycles, nanoseconds if there is no cycle counter
+*/
+static uint64_t timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/*
+   Runs body ITERATIONS times and prints the average time per call. sink keeps the
+   compiler from removing calls whose result is unused.
+*/
+static volatile uint32_t sink;
+
+template <typename Body> static void bench(const char *name, Body body) {
+  body();                                  // warm up the caches
+  uint64_t start = timestamp();
+  for (uint32_t i = 0; i < ITERATIONS; i++) {
+    body();
+  }
+  uint64_t elapsed = timestamp() - start;
+  printf("%-28s %10.1f\n", name, (double) elapsed / ITERATIONS);
+}
+
+int main() {
+  memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+  setup();
+
+  uint8_t message[16];
+  for (uint8_t i = 0; i < sizeof(message); i++) {
+    message[i] = i * 37;
+  }
+  std::vector<uint8_t> write_timeout = { static_cast<uint8_t>(Register::timeout), 60 };
+  Filter filter = {};
+
+#if defined(__x86_64__) || defined(__i386__)
+  printf("%-28s %10s\n", "benchmark", "cycles");
+#else
+  printf("%-28s %10s\n", "benchmark", "ns");
+#endif
+  bench("WDT_vect", [] () { WDT_vect(); });
+  bench("I2C read bat_voltage", [] () {
+    sink = i2c_read(static_cast<uint8_t>(Register::bat_voltage), 3)[0];
+  });
+  bench("I2C read snapshot", [] () {
+    sink = i2c_read(static_cast<uint8_t>(Register::snapshot), sizeof(Snapshot) + 1)[0];
+  });
+  bench("I2C write timeout", [&write_timeout] () { sink = i2c_write(write_timeout); });
+  bench("read_voltages", [] () { read_voltages(); });
+  bench("crc8_message_calc 16 bytes", [&message] () { sink = crc8_message_calc(message, sizeof(message)); });
+  bench("config_hash_Int", [] () { sink = config_hash_Int(); });
+  bench("filter_value ema", [&filter] () { sink = filter_value(&filter, Filter_Mode::ema | 3, 4000); });
+  bench("filter_value median", [&filter] () { sink = filter_value(&filter, Filter_Mode::median, 4000); });
+  bench("soc_of_voltage", [] () { sink = soc_of_voltage(3700); });
+  return 0;
+}
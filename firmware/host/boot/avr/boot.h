@@ -0,0 +1,11 @@
+#pragma once
+/*
+   The self programming of the flash: a page is erased, its words are filled into the
+   temporary page buffer and the buffer is written to the page. Like the hardware a write
+   only clears bits, without the erase the page holds the AND of both.
+*/
+#include <stdint.h>
+void boot_page_erase(uint16_t address);
+void boot_page_fill(uint16_t address, uint16_t word);
+void boot_page_write(uint16_t address);
+#define boot_spm_busy_wait()
@@ -0,0 +1,3 @@
+#pragma once
+#include <stdint.h>
+uint8_t eeprom_read_byte(const uint8_t *address);
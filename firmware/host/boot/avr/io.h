@@ -0,0 +1,41 @@
+#pragma once
+/*
+   The I/O registers used by the bootloader (see ../../bootsim.cpp). The bootloader polls
+   the USI instead of using its interrupts, so unlike in the model of the firmware
+   (../../include/avr/io.h) USISR behaves like the hardware: writing a flag with 1 clears
+   it. A read of USISR without a pending flag lets the bus continue until the master
+   causes the next flag.
+*/
+#include <stdint.h>
+
+struct Host_USISR {
+  uint8_t value;
+  Host_USISR &operator=(uint8_t written);  // a write of the bootloader
+  Host_USISR &operator|=(uint8_t flags);   // the bus sets a flag (used by the master)
+  operator uint8_t();                      // a read of the bootloader
+};
+
+extern volatile uint8_t PORTB, DDRB, PINB, USICR, USIDR, MCUSR, GPIOR0;
+extern Host_USISR USISR;
+
+#define PB0 0
+#define PB2 2
+#define USISIE 7
+#define USIOIE 6
+#define USIWM1 5
+#define USIWM0 4
+#define USICS1 3
+#define USICS0 2
+#define USICLK 1
+#define USITC 0
+#define USISIF 7
+#define USIOIF 6
+#define USIPF 5
+#define USIDC 4
+#define WDRF 3
+#define BORF 2
+#define EXTRF 1
+#define PORF 0
+#define SPM_PAGESIZE 64
+#define RAMEND 0x25F
+#define _BV(b) (1 << (b))
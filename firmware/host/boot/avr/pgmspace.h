@@ -0,0 +1,4 @@
+#pragma once
+#include <stdint.h>
+uint8_t pgm_read_byte(uint16_t address);
+uint16_t pgm_read_word(uint16_t address);
@@ -0,0 +1,6 @@
+#pragma once
+#include <stdint.h>
+#define WDTO_15MS 0
+#define WDTO_8S   9
+void wdt_enable(uint8_t timeout);
+void wdt_reset(void);
@@ -0,0 +1,536 @@
+/*
+   The simulator of the bootloader replays a trace of I2C accesses and resets against
+   ../ATTinyBoot/ATTinyBoot.c and logs the starts of the bootloader and the firmware. The
+   bootloader runs in a context of its own on a model of the USI, the flash, the EEPROM and
+   the watchdog (the headers in boot/). The I2C master of the firmware simulator
+   (i2c_master.h) switches to the bootloader whenever the bus sets a flag of the USI, the
+   bootloader switches back when it polls USISR without a pending flag. The firmware itself
+   is not simulated: after the jump to its reset vector the ATTiny doesn't answer on I2C
+   until the firmware jumps to the bootloader or the next reset. A trace has the format of
+   sim.cpp:
+
+     <time in s> <command> <arguments>      # comment
+
+   Commands:
+     reset                                  a power-on reset
+     jump                                   the firmware jumps to the bootloader with BOOTLOADER_MAGIC in GPIOR0
+     eeprom <address> <value>               set a byte of the EEPROM (e.g. the I2C address)
+     address <address>                      the following I2C accesses use this address (default 0x37)
+     write <register> <byte>...             write a frame, the CRC is appended
+     corrupt <register> <byte>...           write a frame with a wrong CRC
+     read <register> <n>                    read n bytes and the CRC
+     chunk <offset> <value>                 write the 16 bytes at offset of the page pattern of value
+     commit <page> <value>                  write the page buffer to page with the CRC of the pattern of value
+     page <page> <value>                    write a page with the pattern of value (4 chunks and the commit)
+     erase <page>                           write a page of 0xFF
+     vector <word>                          write the reset page: 0xFF and a jump to word as its last word
+     expect <variable> <op> <value>         check a variable, op is one of == != < <= > >=
+     expect word <address> <op> <value>     check a word of the flash
+     end                                    end of the simulation (default: 1 s after the last event)
+
+   The pattern of value is a page of the bytes value, value + 1, value + 2 ... Registers
+   are numbers or the names ident, chunk, page and exit. The variables are bootloader (1
+   while it runs), firmware (the starts of the firmware), resets, ack (the last transfer has
+   been acknowledged), crc (the CRC of the last read is right) and read0 ... read3 (the bytes
+   of the last read). The exit code is the number of failed expectations.
+*/
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+#define bit(b) (1UL << (b))
+#define FIRMWARE_ENTRY host_firmware_entry
+static void host_firmware_entry(void);
+
+#include "ATTinyBoot.c"
+#include "i2c_master.h"
+
+static const uint64_t SECOND = 1000000;
+static const uint32_t WATCHDOG_MIN_PERIOD = 16000;    // us, 2K cycles of the 128kHz oscillator
+static const uint16_t FLASH_SIZE = 0x2000;
+static const uint16_t EEPROM_SIZE = 512;
+static const uint32_t MAX_POLLS = 100000;             // polls of USISR before the bootloader is considered hung
+
+struct Event {
+  uint64_t time;
+  int line;
+  std::vector<std::string> words;          // the command and its arguments
+};
+
+static std::vector<Event> events;
+static const char *trace_name;
+static bool quiet = false;
+static int failures = 0;
+static uint64_t host_now = 0;
+static uint64_t host_end = 0;
+
+/*
+   The simulated ATtiny85
+*/
+volatile uint8_t PORTB, DDRB, PINB, USICR, USIDR, MCUSR, GPIOR0;
+Host_USISR USISR;
+static uint8_t flash[FLASH_SIZE];
+static uint8_t spm_buffer[SPM_PAGESIZE];           // the temporary page buffer of the self programming
+static uint8_t eeprom[EEPROM_SIZE];
+static uint64_t watchdog_start = 0;
+static uint64_t watchdog_period = 0;               // 0 if the watchdog is stopped
+
+/*
+   The context of the bootloader and the observed state
+*/
+static ucontext_t bus_context;
+static ucontext_t boot_context;
+static char boot_stack[64 * 1024];
+static bool bootloader_running = false;
+static uint32_t polls = 0;
+static int firmware_starts = 0;
+static int resets = 0;
+static bool last_ack = false;
+static uint8_t last_register = 0;
+static std::vector<uint8_t> last_read;         // the bytes of the last read including the CRC
+
+static void log_at(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+static void log_at(const char *format, ...) {
+  if (quiet) {
+    return;
+  }
+  printf("%10.3f  ", host_now / (double) SECOND);
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+}
+
+/*
+   The bootloader gives the CPU back to the bus, it is continued by resume() unless it is
+   halted (the firmware has been started or a reset is pending).
+*/
+static void yield_to_bus() {
+  polls = 0;
+  swapcontext(&boot_context, &bus_context);
+}
+
+static void halt() {
+  bootloader_running = false;
+  yield_to_bus();
+  abort();                                 // a halted context is never continued
+}
+
+static void resume() {
+  if (bootloader_running) {
+    swapcontext(&bus_context, &boot_context);
+  }
+}
+
+static void boot_main() {
+  run();
+}
+
+static void start_bootloader() {
+  getcontext(&boot_context);
+  boot_context.uc_stack.ss_sp = boot_stack;
+  boot_context.uc_stack.ss_size = sizeof(boot_stack);
+  boot_context.uc_link = nullptr;
+  makecontext(&boot_context, boot_main, 0);
+  bootloader_running = true;
+  USISR.value = 0;
+  resume();
+  if (bootloader_running) {
+    log_at("bootloader started");
+  }
+}
+
+static void host_firmware_entry(void) {
+  firmware_starts++;
+  log_at("firmware started");
+  // the firmware reconfigures the watchdog and the USI, it is not simulated
+  watchdog_period = 0;
+  DDRB = 0;
+  USICR = 0;
+  halt();
+}
+
+static void reset(uint8_t cause) {
+  resets++;
+  log_at("reset (%s)", cause == WDRF ? "watchdog" : "power on");
+  MCUSR |= _BV(cause);
+  GPIOR0 = 0;
+  PORTB = DDRB = USICR = USIDR = 0;
+  PINB = _BV(PIN_SCL) | _BV(PIN_SDA);
+  // after a watchdog reset the watchdog keeps running with the shortest period
+  watchdog_period = cause == WDRF ? WATCHDOG_MIN_PERIOD : 0;
+  watchdog_start = host_now;
+  start_bootloader();
+}
+
+/*
+   The USI: the flags are cleared by writing 1, the counter bits are written
+*/
+Host_USISR &Host_USISR::operator=(uint8_t written) {
+  value = (value & 0xE0 & ~written) | (written & 0x0F);
+  return *this;
+}
+
+Host_USISR &Host_USISR::operator|=(uint8_t flags) {
+  value |= flags;
+  return *this;
+}
+
+Host_USISR::operator uint8_t() {
+  if (!(value & (_BV(USISIF) | _BV(USIOIF) | _BV(USIPF)))) {
+    yield_to_bus();
+  } else if (++polls > MAX_POLLS) {
+    fprintf(stderr, "%s: the bootloader doesn't clear the USI flags 0x%02x\n", trace_name, value);
+    exit(2);
+  }
+  return value;
+}
+
+extern "C" void USI_START_vect(void) {
+  resume();
+}
+
+extern "C" void USI_OVF_vect(void) {
+  USISR |= _BV(USIOIF);
+  resume();
+}
+
+void handle_I2C() {
+  resume();
+}
+
+/*
+   The flash, the EEPROM and the watchdog
+*/
+void boot_page_erase(uint16_t address) {
+  memset(&flash[address & ~(SPM_PAGESIZE - 1)], 0xFF, SPM_PAGESIZE);
+}
+
+void boot_page_fill(uint16_t address, uint16_t word) {
+  spm_buffer[address & (SPM_PAGESIZE - 2)] = word & 0xFF;
+  spm_buffer[(address & (SPM_PAGESIZE - 2)) + 1] = word >> 8;
+}
+
+void boot_page_write(uint16_t address) {
+  uint8_t *page = &flash[address & ~(SPM_PAGESIZE - 1)];
+  for (uint8_t i = 0; i < SPM_PAGESIZE; i++) {
+    page[i] &= spm_buffer[i];
+  }
+  // the page buffer is erased by the write
+  memset(spm_buffer, 0xFF, sizeof(spm_buffer));
+}
+
+uint8_t pgm_read_byte(uint16_t address) {
+  return flash[address % FLASH_SIZE];
+}
+
+uint16_t pgm_read_word(uint16_t address) {
+  return pgm_read_byte(address) | (pgm_read_byte(address + 1) << 8);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *address) {
+  return eeprom[(uintptr_t) address % EEPROM_SIZE];
+}
+
+void wdt_enable(uint8_t timeout) {
+  watchdog_period = (uint64_t) WATCHDOG_MIN_PERIOD << timeout;
+  watchdog_start = host_now;
+  if (timeout == WDTO_15MS) {
+    // restart() waits for the reset
+    halt();
+  }
+}
+
+void wdt_reset(void) {
+  watchdog_start = host_now;
+}
+
+/*
+   Advance the time, the watchdog resets the ATTiny when it expires
+*/
+static void advance(uint64_t until) {
+  while (watchdog_period > 0 && watchdog_start + watchdog_period <= until) {
+    host_now = watchdog_start + watchdog_period;
+    reset(WDRF);
+  }
+  host_now = until;
+}
+
+/*
+   The trace
+*/
+static void fail(const Event &event, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void fail(const Event &event, const char *format, ...) {
+  fprintf(stderr, "%s:%d: ", trace_name, event.line);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  failures++;
+}
+
+static bool parse_number(const std::string &word, int32_t *value) {
+  char *end;
+  *value = strtol(word.c_str(), &end, 0);
+  return !word.empty() && *end == '\0';
+}
+
+static bool parse_register(const std::string &word, uint8_t *number) {
+  static const struct {
+    const char *name;
+    uint8_t number;
+  } names[] = { { "ident", BOOT_IDENT }, { "chunk", BOOT_CHUNK }, { "page", BOOT_PAGE }, { "exit", BOOT_EXIT } };
+  for (const auto &entry : names) {
+    if (word == entry.name) {
+      *number = entry.number;
+      return true;
+    }
+  }
+  int32_t value;
+  if (parse_number(word, &value) && value >= 0 && value <= UCHAR_MAX) {
+    *number = value;
+    return true;
+  }
+  return false;
+}
+
+/*
+   Parse the bytes from words[first] on, false if one isn't a byte
+*/
+static bool parse_bytes(const Event &event, size_t first, std::vector<uint8_t> *bytes) {
+  for (size_t i = first; i < event.words.size(); i++) {
+    int32_t value;
+    if (!parse_number(event.words[i], &value) || value < 0 || value > UCHAR_MAX) {
+      return false;
+    }
+    bytes->push_back(value);
+  }
+  return true;
+}
+
+static std::vector<uint8_t> pattern(uint8_t value) {
+  std::vector<uint8_t> data;
+  for (uint8_t i = 0; i < SPM_PAGESIZE; i++) {
+    data.push_back(value + i);
+  }
+  return data;
+}
+
+static void write_frame(const std::vector<uint8_t> &frame) {
+  last_ack = i2c_write(frame);
+}
+
+static void write_chunk(const std::vector<uint8_t> &data, uint8_t offset) {
+  std::vector<uint8_t> frame = { BOOT_CHUNK, offset };
+  frame.insert(frame.end(), data.begin() + offset, data.begin() + offset + CHUNK_SIZE);
+  write_frame(frame);
+}
+
+static void write_commit(const std::vector<uint8_t> &data, uint8_t page) {
+  write_frame({ BOOT_PAGE, page, crc8(CRC8INIT, data.data(), SPM_PAGESIZE) });
+}
+
+static void write_page(const std::vector<uint8_t> &data, uint8_t page) {
+  bool ack = true;
+  for (uint8_t offset = 0; offset < SPM_PAGESIZE; offset += CHUNK_SIZE) {
+    write_chunk(data, offset);
+    ack &= last_ack;
+  }
+  write_commit(data, page);
+  last_ack &= ack;
+}
+
+static void run_expect(const Event &event) {
+  int32_t actual;
+  int32_t expected;
+  size_t op_index = 2;
+  const std::string &name = event.words.size() > 1 ? event.words[1] : "";
+  if (name == "word" && event.words.size() == 5) {
+    int32_t address;
+    if (!parse_number(event.words[2], &address) || address < 0 || address >= FLASH_SIZE - 1) {
+      fail(event, "invalid flash address");
+      return;
+    }
+    actual = pgm_read_word(address);
+    op_index = 3;
+  } else if (event.words.size() == 4 && name == "bootloader") {
+    actual = bootloader_running;
+  } else if (event.words.size() == 4 && name == "firmware") {
+    actual = firmware_starts;
+  } else if (event.words.size() == 4 && name == "resets") {
+    actual = resets;
+  } else if (event.words.size() == 4 && name == "ack") {
+    actual = last_ack;
+  } else if (event.words.size() == 4 && name == "crc") {
+    actual = i2c_crc_ok(last_register, last_read);
+  } else if (event.words.size() == 4 && name.size() == 5 && name.compare(0, 4, "read") == 0
+             && name[4] >= '0' && name[4] <= '3') {
+    size_t index = name[4] - '0';
+    actual = index < last_read.size() ? last_read[index] : -1;
+  } else {
+    fail(event, "expect needs a known variable, an operator and a value");
+    return;
+  }
+  if (!parse_number(event.words[op_index + 1], &expected)) {
+    fail(event, "invalid value");
+    return;
+  }
+  const std::string &op = event.words[op_index];
+  bool ok = op == "==" ? actual == expected : op == "!=" ? actual != expected
+          : op == "<"  ? actual <  expected : op == "<=" ? actual <= expected
+          : op == ">"  ? actual >  expected : op == ">=" ? actual >= expected : false;
+  if (!ok) {
+    fail(event, "at %.3fs expected %s %s %d, got %d", host_now / (double) SECOND,
+         name.c_str(), op.c_str(), expected, actual);
+  }
+}
+
+static void run_event(const Event &event) {
+  const std::string &command = event.words[0];
+  int32_t value;
+  int32_t page;
+  uint8_t number;
+  std::vector<uint8_t> bytes;
+
+  if (command == "reset" && event.words.size() == 1) {
+    reset(PORF);
+  } else if (command == "jump" && event.words.size() == 1) {
+    if (bootloader_running) {
+      fail(event, "the firmware is not running");
+      return;
+    }
+    log_at("jump to the bootloader");
+    GPIOR0 = BOOTLOADER_MAGIC;
+    start_bootloader();
+  } else if (command == "eeprom" && event.words.size() == 3 && parse_number(event.words[1], &value)
+             && value >= 0 && value < EEPROM_SIZE && parse_bytes(event, 2, &bytes)) {
+    eeprom[value] = bytes[0];
+  } else if (command == "address" && event.words.size() == 2 && parse_number(event.words[1], &value)) {
+    i2c_target = value;
+  } else if ((command == "write" || command == "corrupt") && event.words.size() >= 2
+             && parse_register(event.words[1], &number) && parse_bytes(event, 2, &bytes)) {
+    std::vector<uint8_t> frame = bytes;
+    frame.insert(frame.begin(), number);
+    if (command == "corrupt") {
+      frame.push_back(i2c_crc(frame) ^ 0xFF);
+    }
+    last_ack = i2c_write(frame, command == "write");
+    log_at("%s 0x%02x (%zu bytes)%s", command.c_str(), number, bytes.size(), last_ack ? "" : " not acknowledged");
+  } else if (command == "read" && event.words.size() == 3 && parse_register(event.words[1], &number)
+             && parse_number(event.words[2], &value) && value > 0) {
+    std::vector<uint8_t> data = i2c_read(number, value + 1);
+    last_ack = !data.empty();
+    last_register = number;
+    last_read = data;
+    if (!last_ack) {
+      log_at("read 0x%02x not acknowledged", number);
+      return;
+    }
+    std::string text;
+    for (uint8_t b : data) {
+      char hex[4];
+      snprintf(hex, sizeof(hex), " %02x", b);
+      text += hex;
+    }
+    log_at("read 0x%02x =%s%s", number, text.c_str(), i2c_crc_ok(number, data) ? "" : ", CRC error");
+  } else if (command == "chunk" && event.words.size() == 3 && parse_number(event.words[1], &value)
+             && value >= 0 && value <= SPM_PAGESIZE - CHUNK_SIZE && parse_bytes(event, 2, &bytes)) {
+    write_chunk(pattern(bytes[0]), value);
+    log_at("chunk %d%s", value, last_ack ? "" : " not acknowledged");
+  } else if ((command == "commit" || command == "page") && event.words.size() == 3
+             && parse_number(event.words[1], &page) && page >= 0 && page <= UCHAR_MAX && parse_bytes(event, 2, &bytes)) {
+    if (command == "commit") {
+      write_commit(pattern(bytes[0]), page);
+    } else {
+      write_page(pattern(bytes[0]), page);
+    }
+    log_at("%s %d%s", command.c_str(), page, last_ack ? "" : " not acknowledged");
+  } else if (command == "erase" && event.words.size() == 2 && parse_number(event.words[1], &page)
+             && page >= 0 && page <= UCHAR_MAX) {
+    write_page(std::vector<uint8_t>(SPM_PAGESIZE, 0xFF), page);
+    log_at("erase %d%s", page, last_ack ? "" : " not acknowledged");
+  } else if (command == "vector" && event.words.size() == 2 && parse_number(event.words[1], &value)) {
+    // rjmp is relative to the word following it
+    std::vector<uint8_t> data(SPM_PAGESIZE, 0xFF);
+    uint16_t rjmp = 0xC000 | ((value - RESET_VECTOR / 2 - 1) & 0x0FFF);
+    data[SPM_PAGESIZE - 2] = rjmp & 0xFF;
+    data[SPM_PAGESIZE - 1] = rjmp >> 8;
+    write_page(data, APP_PAGES - 1);
+    log_at("reset page with a jump to 0x%04x%s", value, last_ack ? "" : " not acknowledged");
+  } else if (command == "expect") {
+    run_expect(event);
+  } else if (command != "end") {
+    fail(event, "invalid command");
+  }
+}
+
+static bool read_trace(const char *name) {
+  std::ifstream file(name);
+  if (!file) {
+    fprintf(stderr, "cannot open %s\n", name);
+    return false;
+  }
+  std::string line;
+  int number = 0;
+  while (std::getline(file, line)) {
+    number++;
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string time;
+    if (!(words >> time)) {
+      continue;
+    }
+    Event event = { (uint64_t) (atof(time.c_str()) * SECOND), number, {} };
+    std::string word;
+    while (words >> word) {
+      event.words.push_back(word);
+    }
+    if (event.words.empty() || (!events.empty() && event.time < events.back().time)) {
+      fprintf(stderr, "%s:%d: missing command or time out of order\n", name, number);
+      return false;
+    }
+    events.push_back(event);
+    host_end = event.words[0] == "end" ? event.time : event.time + SECOND;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-q") == 0) {
+    quiet = true;
+    arg++;
+  }
+  if (arg + 1 != argc) {
+    fprintf(stderr, "usage: %s [-q] trace\n", argv[0]);
+    return 2;
+  }
+  trace_name = argv[arg];
+  if (!read_trace(trace_name)) {
+    return 2;
+  }
+
+  // an erased chip with the bootloader installed, the EEPROM is erased as well
+  memset(flash, 0xFF, sizeof(flash));
+  memset(spm_buffer, 0xFF, sizeof(spm_buffer));
+  memset(eeprom, 0xFF, sizeof(eeprom));
+
+  for (const Event &event : events) {
+    advance(event.time);
+    run_event(event);
+  }
+  advance(host_end);
+
+  printf("%s: %.0fs simulated, %d resets, %d firmware starts, %d failed\n", trace_name,
+         host_now / (double) SECOND, resets, firmware_starts, failures);
+  return failures;
+}
@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+# Concatenates the .ino files of a sketch into a single C++ file the way the Arduino
+# IDE does: the main .ino first, the others in alphabetical order, and the prototypes
+# of all functions inserted after the first #include. Additionally a table of the
+# register names is generated for the trace files of the simulator.
+import os
+import re
+import sys
+
+sketch_dir = sys.argv[1]
+main = os.path.join(sketch_dir, os.path.basename(os.path.normpath(sketch_dir)) + '.ino')
+files = [main] + sorted(os.path.join(sketch_dir, f) for f in os.listdir(sketch_dir)
+                        if f.endswith('.ino') and os.path.join(sketch_dir, f) != main)
+source = ''.join('#line 1 "%s"\n' % f + open(f).read() + '\n' for f in files)
+
+# remove the comments (keeping the line structure) before searching the definitions
+code = re.sub(r'/\*.*?\*/', lambda m: re.sub(r'[^\n]', ' ', m.group(0)), source, flags=re.S)
+code = re.sub(r'//[^\n]*', '', code)
+
+prototypes = []
+for m in re.finditer(r'^([A-Za-z_][\w\s\*&:<>,]*?[\s\*&])([A-Za-z_]\w*)\s*\(([^;{}()]*)\)\s*\{', code, flags=re.M):
+    result, name, args = m.group(1).strip(), m.group(2), m.group(3)
+    if name in ('if', 'while', 'for', 'switch', 'ISR') or \
+       result.startswith(('return', 'else', 'struct', 'class', 'namespace', 'enum')):
+        continue
+    prototypes.append('%s %s(%s);' % (result, name, ' '.join(args.split())))
+
+header = open(os.path.join(sketch_dir, 'ATTinyDaemon.h')).read()
+registers = re.search(r'enum class Register : uint8_t \{(.*?)\};', header, flags=re.S).group(1)
+names = re.findall(r'^\s*(\w+)\s*=\s*(0x[0-9A-Fa-f]+)', registers, flags=re.M)
+
+include = '#include "ATTinyDaemon.h"'
+pos = source.index(include) + len(include)
+print('#include <Arduino.h>')
+print(source[:pos])
+print('\n'.join(prototypes))
+print('#include "register_names.h"')
+print('const Register_Name register_names[] = {')
+for name, number in names:
+    print('  { "%s", %s },' % (name, number))
+print('  { nullptr, 0 }\n};')
+print('#line 2 "%s"' % main)
+print(source[pos:])
@@ -0,0 +1,120 @@
+#pragma once
+/*
+   A byte level I2C master that drives the USI interrupts of the firmware the way the
+   bus does: the start condition, then two overflow interrupts per byte (the byte and
+   the ACK bit). The stop condition is polled by handle_I2C() in the main loop, the
+   simulator calls it right away. Include after ATTinyDaemon.h.
+*/
+#include <stdint.h>
+#include <vector>
+
+extern "C" void USI_START_vect(void);
+extern "C" void USI_OVF_vect(void);
+void handle_I2C();
+
+/*
+   The CRC8 used by the protocol (polynomial 0x31), calculated independently of the
+   firmware to catch errors there.
+*/
+static uint8_t i2c_crc(const std::vector<uint8_t> &data) {
+  uint8_t crc = 0;
+  for (uint8_t b : data) {
+    crc ^= b;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/*
+   The address the master talks to, the firmware starts with I2C_ADDRESS.
+*/
+static uint8_t i2c_target = I2C_ADDRESS;
+
+static void i2c_start() {
+  PINB &= ~(bit(PIN_SCL) | bit(PIN_SDA));
+  USISR |= bit(USISIF);
+  USI_START_vect();
+}
+
+static void i2c_stop() {
+  USISR |= bit(USIPF);
+  handle_I2C();
+}
+
+/*
+   Send a byte, returns true if the slave acknowledged it.
+*/
+static bool i2c_send(uint8_t data) {
+  USIDR = data;
+  USI_OVF_vect();
+  bool ack = (DDRB & bit(PIN_SDA)) && USIDR == 0;
+  USI_OVF_vect();
+  return ack;
+}
+
+/*
+   Receive the byte the slave has loaded and acknowledge it (or not for the last one).
+*/
+static uint8_t i2c_receive(bool ack) {
+  uint8_t data = USIDR;
+  USI_OVF_vect();
+  USIDR = ack ? 0 : 1;
+  USI_OVF_vect();
+  return data;
+}
+
+/*
+   Write the register number and the data, the CRC is appended unless with_crc is false.
+   Returns true if all bytes have been acknowledged. Without an ACK of the address
+   the transfer ends, the slave ignores the rest.
+*/
+static bool i2c_write(std::vector<uint8_t> frame, bool with_crc = true) {
+  if (with_crc) {
+    frame.push_back(i2c_crc(frame));
+  }
+  i2c_start();
+  bool ack = i2c_send(i2c_target << 1);
+  for (uint8_t b : frame) {
+    if (!ack) {
+      break;
+    }
+    ack &= i2c_send(b);
+  }
+  i2c_stop();
+  return ack;
+}
+
+/*
+   Read n bytes (including the CRC) from a register, empty if the address is not
+   acknowledged.
+*/
+static std::vector<uint8_t> i2c_read(uint8_t reg, int n) {
+  std::vector<uint8_t> data;
+  i2c_start();
+  if (!i2c_send(i2c_target << 1)) {
+    i2c_stop();
+    return data;
+  }
+  i2c_send(reg);
+  i2c_start();
+  i2c_send((i2c_target << 1) | 1);
+  for (int i = 0; i < n; i++) {
+    data.push_back(i2c_receive(i < n - 1));
+  }
+  i2c_stop();
+  return data;
+}
+
+/*
+   Check the CRC of data read from a register, the CRC covers the register number.
+*/
+static bool i2c_crc_ok(uint8_t reg, const std::vector<uint8_t> &data) {
+  if (data.empty()) {
+    return false;
+  }
+  std::vector<uint8_t> covered(data.begin(), data.end() - 1);
+  covered.insert(covered.begin(), reg);
+  return i2c_crc(covered) == data.back();
+}
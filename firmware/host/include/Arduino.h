@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <avr/io.h>
+typedef bool boolean;
+typedef uint8_t byte;
+#define bit(b) (1UL << (b))
+#define F(s) (s)
+#define HEX 16
+#define LOW 0
+#define HIGH 1
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long);
+void delayMicroseconds(unsigned int);
+void interrupts(void);
+void noInterrupts(void);
+void cli(void);
+void sei(void);
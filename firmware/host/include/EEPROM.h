@@ -0,0 +1,26 @@
+#pragma once
+/*
+   The EEPROM of the ATtiny85, see mock.cpp.
+*/
+#include <stdint.h>
+
+extern uint8_t host_eeprom[512];
+extern void host_eeprom_write(int idx, uint8_t value);
+
+struct EEPROMClass {
+  uint8_t read(int idx) { return host_eeprom[idx]; }
+  void write(int idx, uint8_t value) { host_eeprom_write(idx, value); }
+  void update(int idx, uint8_t value) { if (host_eeprom[idx] != value) write(idx, value); }
+  uint16_t length() { return sizeof(host_eeprom); }
+  template<typename T> T &get(int idx, T &t) {
+    uint8_t *p = (uint8_t *) &t;
+    for (unsigned i = 0; i < sizeof(T); i++) p[i] = read(idx + i);
+    return t;
+  }
+  template<typename T> const T &put(int idx, const T &t) {
+    const uint8_t *p = (const uint8_t *) &t;
+    for (unsigned i = 0; i < sizeof(T); i++) update(idx + i, p[i]);
+    return t;
+  }
+};
+extern EEPROMClass EEPROM;
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+#define GET_LOW_FUSE_BITS 0
+#define GET_HIGH_FUSE_BITS 3
+#define GET_EXTENDED_FUSE_BITS 2
+#define FUSE_SUT0 (unsigned char)~_BV(4)
+#define FUSE_SUT1 (unsigned char)~_BV(5)
+uint8_t boot_lock_fuse_bits_get(uint8_t);
+// the jump of the firmware to the I2C bootloader (see handleBootloader.ino and mock.cpp)
+void host_bootloader_entry(void);
+#define BOOTLOADER_ENTRY host_bootloader_entry
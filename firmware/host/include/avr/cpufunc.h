@@ -0,0 +1,2 @@
+#pragma once
+#define _NOP() do {} while (0)
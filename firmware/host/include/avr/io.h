@@ -0,0 +1,112 @@
+#pragma once
+/*
+   The I/O registers of the ATtiny85 are plain variables (see mock.cpp), the bit numbers
+   are the ones of the data sheet. The interrupt vectors are ordinary functions which are
+   called by the simulation.
+*/
+#include <stdint.h>
+#define HOST_REGISTER(n) extern volatile uint8_t n;
+HOST_REGISTER(PORTB) HOST_REGISTER(DDRB) HOST_REGISTER(PINB) HOST_REGISTER(ADCSRA) HOST_REGISTER(ADCSRB) HOST_REGISTER(ADMUX)
+HOST_REGISTER(ADCL) HOST_REGISTER(ADCH) HOST_REGISTER(MCUSR) HOST_REGISTER(WDTCR) HOST_REGISTER(GIMSK) HOST_REGISTER(GIFR)
+HOST_REGISTER(PCMSK) HOST_REGISTER(PRR) HOST_REGISTER(DIDR0) HOST_REGISTER(ACSR) HOST_REGISTER(USICR) HOST_REGISTER(USISR)
+HOST_REGISTER(USIDR) HOST_REGISTER(USIBR) HOST_REGISTER(SREG) HOST_REGISTER(MCUCR) HOST_REGISTER(SPMCSR) HOST_REGISTER(EECR)
+HOST_REGISTER(TCCR1) HOST_REGISTER(GTCCR) HOST_REGISTER(OCR1A) HOST_REGISTER(OCR1C) HOST_REGISTER(TIMSK) HOST_REGISTER(TIFR) HOST_REGISTER(TCNT1)
+HOST_REGISTER(GPIOR0) HOST_REGISTER(GPIOR1) HOST_REGISTER(GPIOR2)
+extern volatile uint16_t ADC;
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PINB0 0
+#define PINB2 2
+#define DDB0 0
+#define DDB2 2
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define REFS2 4
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+#define ACME 6
+#define ADC0D 5
+#define ADC2D 4
+#define ADC3D 3
+#define ADC1D 2
+#define AIN1D 1
+#define AIN0D 0
+#define ACD 7
+#define ACBG 6
+#define ACO 5
+#define ACI 4
+#define ACIE 3
+#define ACIS1 1
+#define ACIS0 0
+#define WDIF 7
+#define WDIE 6
+#define WDP3 5
+#define WDCE 4
+#define WDE 3
+#define WDP2 2
+#define WDP1 1
+#define WDP0 0
+#define WDRF 3
+#define BORF 2
+#define EXTRF 1
+#define PORF 0
+#define INT0 6
+#define PCIE 5
+#define INTF0 6
+#define PCIF 5
+#define PRTIM1 3
+#define PRTIM0 2
+#define PRUSI 1
+#define PRADC 0
+#define USISIE 7
+#define USIOIE 6
+#define USIWM1 5
+#define USIWM0 4
+#define USICS1 3
+#define USICS0 2
+#define USICLK 1
+#define USITC 0
+#define USISIF 7
+#define USIOIF 6
+#define USIPF 5
+#define USIDC 4
+#define USICNT0 0
+#define SPMEN 0
+#define PGERS 1
+#define PGWRT 2
+#define CTPB 4
+#define SPM_PAGESIZE 64
+#define FLASHEND 0x1FFF
+#define E2END 0x1FF
+#define RAMEND 0x25F
+#define _BV(b) (1 << (b))
+// polling a bit lets the simulated hardware (e.g., a running ADC conversion) continue
+uint8_t host_bit_is_set(volatile uint8_t *reg, uint8_t b);
+#define bit_is_set(r, b) host_bit_is_set(&(r), (b))
+#define bit_is_clear(r, b) (!bit_is_set(r, b))
+#define loop_until_bit_is_clear(r, b) do { } while (bit_is_set(r, b))
+#define ISR(v) extern "C" void v(void); extern "C" void v(void)
+#define EMPTY_INTERRUPT(v) extern "C" void v(void) {}
+#define PCINT0_vect   isr_pcint0
+#define WDT_vect      isr_wdt
+#define ADC_vect      isr_adc
+#define ANA_COMP_vect isr_ana_comp
+#define USI_START_vect isr_usi_start
+#define USI_OVF_vect  isr_usi_ovf
+#define TIMER1_COMPA_vect isr_timer1_compa
+#define TIMER0_OVF_vect isr_timer0_ovf
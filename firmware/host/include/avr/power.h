@@ -0,0 +1,14 @@
+#pragma once
+#include <avr/io.h>
+typedef enum { clock_div_1 = 0 } clock_div_t;
+void clock_prescale_set(clock_div_t);
+#define power_adc_enable()     (PRR &= (uint8_t)~(1 << PRADC))
+#define power_adc_disable()    (PRR |= (uint8_t)(1 << PRADC))
+#define power_usi_enable()     (PRR &= (uint8_t)~(1 << PRUSI))
+#define power_usi_disable()    (PRR |= (uint8_t)(1 << PRUSI))
+#define power_timer0_enable()  (PRR &= (uint8_t)~(1 << PRTIM0))
+#define power_timer0_disable() (PRR |= (uint8_t)(1 << PRTIM0))
+#define power_timer1_enable()  (PRR &= (uint8_t)~(1 << PRTIM1))
+#define power_timer1_disable() (PRR |= (uint8_t)(1 << PRTIM1))
+#define power_all_enable()     (PRR &= (uint8_t)~((1<<PRADC)|(1<<PRUSI)|(1<<PRTIM0)|(1<<PRTIM1)))
+#define power_all_disable()    (PRR |= (uint8_t)((1<<PRADC)|(1<<PRUSI)|(1<<PRTIM0)|(1<<PRTIM1)))
@@ -0,0 +1,10 @@
+#pragma once
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC 1
+#define SLEEP_MODE_PWR_DOWN 2
+void set_sleep_mode(int);
+void sleep_enable(void);
+void sleep_disable(void);
+void sleep_cpu(void);
+void sleep_bod_disable(void);
+void sleep_mode(void);
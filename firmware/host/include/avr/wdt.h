@@ -0,0 +1,3 @@
+#pragma once
+void wdt_reset(void);
+void wdt_disable(void);
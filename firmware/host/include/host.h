@@ -0,0 +1,65 @@
+#pragma once
+/*
+   The interface of the simulated ATtiny85 (see mock.cpp) used by the simulator and the
+   benchmarks. Times are microseconds of simulated time. The firmware itself runs in
+   zero time, time only passes while the CPU sleeps, in delay() and during ADC
+   conversions.
+*/
+#include <stdint.h>
+
+/*
+   The analog inputs: battery voltage (Vcc) and external voltage in mV, temperature in
+   degrees Celsius. The ADC results are calculated from these values by inverting the
+   conversions of read_voltages() with the default calibration.
+*/
+struct Host_Analog {
+  uint16_t bat_voltage;
+  uint16_t ext_voltage;
+  int16_t  temperature;
+};
+
+/*
+   The environment of the ATTiny (I2C transfers, button presses, voltage changes). The
+   simulated CPU sleeps until the next event or the next watchdog interrupt. If there
+   is neither, time stops at host_end.
+*/
+struct Host_Events {
+  uint64_t (*next)(void);                  // the time of the next event, UINT64_MAX if none
+  void (*run)(uint64_t now);               // execute the events due at now
+  void (*update_analog)(uint64_t now);     // called before each ADC conversion
+  void (*observe)(uint64_t now);           // called before sleeping and after each interrupt
+};
+
+/*
+   The counters of the simulation. The times (in us) partition the simulated time into
+   the time the CPU runs and the time spent in each sleep mode, adc_on_time is the time
+   the ADC is enabled.
+*/
+struct Host_Counters {
+  uint32_t wakeups;                        // wake-ups from IDLE or PWR_DOWN sleep
+  uint32_t wdt_interrupts;
+  uint32_t adc_conversions;
+  uint32_t eeprom_writes;
+  uint64_t active_time;                    // delays and polling of the ADC
+  uint64_t idle_time;
+  uint64_t adc_sleep_time;                 // ADC noise reduction mode
+  uint64_t power_down_time;
+  uint64_t adc_on_time;
+};
+
+extern uint64_t host_now;
+extern uint64_t host_end;
+extern Host_Analog host_analog;
+extern Host_Events host_events;
+extern Host_Counters host_counters;
+
+/*
+   The jumps of the firmware to the I2C bootloader (option I2C_BOOTLOADER)
+*/
+extern uint32_t host_bootloader_jumps;
+
+/*
+   Let time pass until the given time, executing the watchdog interrupts and events
+   that fall into this time.
+*/
+void host_advance(uint64_t until);
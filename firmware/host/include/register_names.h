@@ -0,0 +1,13 @@
+#pragma once
+/*
+   The names of the registers, generated from enum class Register by gen_sketch.py.
+   The table ends with a nullptr name.
+*/
+#include <stdint.h>
+
+struct Register_Name {
+  const char *name;
+  uint8_t     number;
+};
+
+extern const Register_Name register_names[];
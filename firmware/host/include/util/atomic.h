@@ -0,0 +1,9 @@
+#pragma once
+/*
+   The simulation is single threaded and interrupts are only executed while the CPU
+   sleeps or waits in delay(), so the atomic blocks need no protection.
+*/
+#define ATOMIC_FORCEON 1
+#define ATOMIC_RESTORESTATE 1
+#define NONATOMIC_BLOCK(x) for (int __nt = 1; __nt; __nt = 0)
+#define ATOMIC_BLOCK(x) for (int __t = 1; __t; __t = 0)
@@ -0,0 +1,251 @@
+/*
+   The simulated ATtiny85: I/O registers, EEPROM, ADC, watchdog, sleep modes and time.
+   Only the behavior the firmware relies on is modelled. The watchdog runs in interrupt
+   mode with the nominal periods (16ms << WDP), an ADC conversion takes 13 ADC cycles at
+   125kHz and its result is calculated from host_analog. The analog comparator is evaluated
+   after every watchdog interrupt and event.
+*/
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <avr/boot.h>
+#include <avr/power.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <algorithm>
+#include "host.h"
+
+volatile uint8_t PORTB, DDRB, PINB, ADCSRA, ADCSRB, ADMUX, ADCL, ADCH, MCUSR, WDTCR, GIMSK, GIFR,
+  PCMSK, PRR, DIDR0, ACSR, USICR, USISR, USIDR, USIBR, SREG, MCUCR, SPMCSR, EECR, TCCR1, GTCCR,
+  OCR1A, OCR1C, TIMSK, TIFR, TCNT1, GPIOR0, GPIOR1, GPIOR2;
+volatile uint16_t ADC;
+
+uint64_t host_now = 0;
+uint64_t host_end = UINT64_MAX;
+Host_Analog host_analog = { 4100, 5100, 25 };
+Host_Events host_events = { nullptr, nullptr, nullptr, nullptr };
+Host_Counters host_counters;
+uint32_t host_bootloader_jumps = 0;
+
+uint8_t host_eeprom[512];
+EEPROMClass EEPROM;
+
+extern "C" void WDT_vect(void);
+extern "C" void ANA_COMP_vect(void) __attribute__ ((weak));   // only with EXT_VOLTAGE_COMPARATOR
+
+static const uint32_t ADC_CONVERSION_TIME = 104;      // us, 13 ADC cycles at 125kHz
+static const uint32_t WATCHDOG_MIN_PERIOD = 16000;    // us, 2K cycles of the 128kHz oscillator
+static const uint8_t  EXT_VOLTAGE_CHANNEL = 3;        // EXT_VOLTAGE in ATTinyDaemon.h
+
+static uint64_t watchdog_start = 0;
+static uint64_t conversion_end = 0;
+static int selected_sleep_mode = SLEEP_MODE_IDLE;
+static bool sleep_enabled = false;
+static uint64_t *cpu_time = &host_counters.active_time;  // the counter of the current sleep mode
+
+void host_eeprom_write(int idx, uint8_t value) {
+  host_eeprom[idx] = value;
+  host_counters.eeprom_writes++;
+}
+
+/*
+   Time
+*/
+unsigned long millis() { return host_now / 1000; }
+unsigned long micros() { return host_now; }
+void delay(unsigned long ms) { host_advance(host_now + ms * 1000); }
+void delayMicroseconds(unsigned int us) { host_advance(host_now + us); }
+void interrupts() {}
+void noInterrupts() {}
+void cli() {}
+void sei() {}
+
+/*
+   Fuses, 8MHz internal oscillator without divider
+*/
+uint8_t boot_lock_fuse_bits_get(uint8_t fuse) {
+  switch (fuse) {
+    case GET_LOW_FUSE_BITS:
+      return 0xE2;
+    case GET_HIGH_FUSE_BITS:
+      return 0xDF;
+    default:
+      return 0xFF;
+  }
+}
+void clock_prescale_set(clock_div_t) {}
+
+/*
+   The I2C bootloader is simulated by bootsim.cpp, the jump only is counted. It returns and
+   the firmware continues as if the bootloader had started it again.
+*/
+void host_bootloader_entry() {
+  host_bootloader_jumps++;
+}
+
+/*
+   Watchdog
+*/
+static void observe() {
+  if (host_events.observe) {
+    host_events.observe(host_now);
+  }
+}
+
+static uint64_t watchdog_expiry() {
+  if (!(WDTCR & bit(WDIE))) {
+    return UINT64_MAX;
+  }
+  uint8_t index = (WDTCR & 0b0111) | ((WDTCR & bit(WDP3)) ? 0b1000 : 0);
+  return watchdog_start + ((uint64_t) WATCHDOG_MIN_PERIOD << index);
+}
+
+void wdt_reset() { watchdog_start = host_now; }
+void wdt_disable() { WDTCR = 0; }
+
+/*
+   Analog comparator, only the configuration used by the firmware: the band gap against the
+   external voltage pin through the ADC multiplexer, with an interrupt on the rising output.
+*/
+static void update_comparator() {
+  bool multiplexed = (ADCSRB & bit(ACME)) && !(ADCSRA & bit(ADEN)) && !(PRR & bit(PRADC));
+  if ((ACSR & bit(ACD)) || !(ACSR & bit(ACBG)) || !multiplexed || (ADMUX & 0x0F) != EXT_VOLTAGE_CHANNEL) {
+    return;
+  }
+  if (host_events.update_analog) {
+    host_events.update_analog(host_now);
+  }
+  // the pin voltage in mV behind the divider (see complete_conversion())
+  int32_t pin = host_analog.ext_voltage > 700 ? (host_analog.ext_voltage - 700) / 2 : 0;
+  bool output = pin < 1100;
+  bool rising = output && !(ACSR & bit(ACO));
+  ACSR = output ? ACSR | bit(ACO) : ACSR & ~bit(ACO);
+  if (rising && (ACSR & bit(ACIE)) && (ACSR & (bit(ACIS1) | bit(ACIS0))) == (bit(ACIS1) | bit(ACIS0))
+      && ANA_COMP_vect) {
+    ANA_COMP_vect();
+  }
+}
+
+/*
+   Advance to the earliest of until, the next watchdog interrupt and the next event, and
+   execute the interrupt or the event. Returns false if nothing happened before until.
+*/
+static bool advance_step(uint64_t until) {
+  uint64_t watchdog = watchdog_expiry();
+  uint64_t event = host_events.next ? host_events.next() : UINT64_MAX;
+  uint64_t next = std::min(until, std::min(watchdog, event));
+  if (next > host_now) {
+    *cpu_time += next - host_now;
+    if ((ADCSRA & bit(ADEN)) && !(PRR & bit(PRADC))) {
+      host_counters.adc_on_time += next - host_now;
+    }
+    host_now = next;
+  }
+  if (watchdog <= next) {
+    // the watchdog keeps running in interrupt mode
+    watchdog_start = watchdog;
+    host_counters.wdt_interrupts++;
+    WDT_vect();
+    update_comparator();
+    observe();
+    return true;
+  }
+  if (event <= next) {
+    host_events.run(host_now);
+    update_comparator();
+    observe();
+    return true;
+  }
+  return false;
+}
+
+void host_advance(uint64_t until) {
+  while (host_now < until) {
+    advance_step(until);
+  }
+}
+
+/*
+   ADC
+*/
+static void complete_conversion() {
+  if (host_events.update_analog) {
+    host_events.update_analog(host_now);
+  }
+
+  int32_t value = 0;
+  uint8_t channel = ADMUX & 0x0F;
+  uint16_t vcc = std::max<uint16_t>(host_analog.bat_voltage, 1);
+  if (channel == 0x0F) {
+    // temperature sensor, about 1 LSB per degree (see temperature_constant)
+    value = host_analog.temperature + 270;
+  } else if (channel == 0x0C) {
+    // band gap measured against Vcc
+    value = 1126400L / vcc;
+  } else if (channel == EXT_VOLTAGE_CHANNEL && host_analog.ext_voltage > 700) {
+    // voltage divider 1:2 and diode drop (see ext_voltage_coefficient and ext_voltage_constant)
+    value = (int32_t) (host_analog.ext_voltage - 700) / 2 * 1024 / vcc;
+  }
+  value = std::min<int32_t>(std::max<int32_t>(value, 0), 1023);
+  if (PRR & bit(PRADC)) {
+    // the clock of the ADC is stopped by the power reduction register
+    value = 0;
+  }
+
+  ADC = value;
+  ADCL = value & 0xFF;
+  ADCH = value >> 8;
+  ADCSRA &= ~bit(ADSC);
+  host_counters.adc_conversions++;
+}
+
+/*
+   Start a conversion if none is running and wait until it is complete.
+*/
+static void run_conversion() {
+  if (!(ADCSRA & bit(ADSC)) || conversion_end <= host_now) {
+    ADCSRA |= bit(ADSC);
+    conversion_end = host_now + ADC_CONVERSION_TIME;
+  }
+  host_advance(conversion_end);
+  complete_conversion();
+}
+
+uint8_t host_bit_is_set(volatile uint8_t *reg, uint8_t b) {
+  if (reg == &ADCSRA && b == ADSC && (ADCSRA & bit(ADSC))) {
+    run_conversion();
+  }
+  return *reg & bit(b);
+}
+
+/*
+   Sleep modes. The ADC noise reduction mode starts a conversion and wakes up when it is
+   complete, the other modes wake up with the next watchdog interrupt or event.
+*/
+void set_sleep_mode(int mode) { selected_sleep_mode = mode; }
+void sleep_enable() { sleep_enabled = true; }
+void sleep_disable() { sleep_enabled = false; }
+void sleep_bod_disable() {}
+
+void sleep_cpu() {
+  if (!sleep_enabled) {
+    return;
+  }
+  if (selected_sleep_mode == SLEEP_MODE_ADC && (ADCSRA & bit(ADEN))) {
+    cpu_time = &host_counters.adc_sleep_time;
+    run_conversion();
+    cpu_time = &host_counters.active_time;
+    return;
+  }
+  observe();
+  host_counters.wakeups++;
+  cpu_time = selected_sleep_mode == SLEEP_MODE_PWR_DOWN ? &host_counters.power_down_time
+                                                        : &host_counters.idle_time;
+  advance_step(host_end);
+  cpu_time = &host_counters.active_time;
+}
+
+void sleep_mode() {
+  sleep_enable();
+  sleep_cpu();
+  sleep_disable();
+}
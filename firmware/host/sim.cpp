@@ -0,0 +1,496 @@
+/*
+   The simulator replays a trace of voltages, I2C accesses and button presses against the
+   firmware and logs the changes of the state, should_shutdown and the switch pin. A trace
+   is a text file with one event per line:
+
+     <time in s> <command> <arguments>      # comment
+
+   Commands:
+     bat <mV>, ext <mV>, temp <C>           set the battery voltage, external voltage or temperature
+     ramp bat|ext|temp <value> <s>          change a value linearly to value within s seconds
+     rpi <s>                                the RPi reads the snapshot register every s seconds, 0 stops
+     write <register> <value>               write a register via I2C (name or number)
+     read <register>                        read a register via I2C and log the value
+     address <address>                      the following I2C accesses use this address (default 0x37)
+     eeprom <address> <value>               set a byte of the EEPROM, at 0s before the firmware starts
+                                            (e.g. the content written by another firmware version)
+     button [ms]                            press the button for ms milliseconds (default 100)
+     expect <variable> <op> <value>         check a variable of the firmware, op is one of == != < <= > >=
+     measure                                restart the counters, e.g. after the startup
+     end                                    end of the simulation (default: 1 s after the last event)
+
+   Values are decimal or hexadecimal (0x...). The exit code is the number of failed
+   expectations, so traces can be used as regression tests. With -p the power budget of
+   the measured time is printed (see print_power_budget()).
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <Arduino.h>
+#include "ATTinyDaemon.h"
+#include "i2c_master.h"
+#include "host.h"
+#include "register_names.h"
+
+void setup();
+void loop();
+extern "C" void PCINT0_vect(void);
+const Register_Descriptor *find_register(Register number);
+extern volatile bool pending_ups_on;
+
+static const uint64_t SECOND = 1000000;
+
+struct Event {
+  uint64_t time;
+  int line;
+  std::vector<std::string> words;          // the command and its arguments
+};
+
+struct Ramp {
+  uint64_t start;
+  uint64_t end;
+  int32_t  from;
+  int32_t  to;
+};
+
+static std::vector<Event> events;
+static size_t next_event = 0;
+static uint64_t rpi_interval = 0;
+static uint64_t rpi_next = UINT64_MAX;
+static uint64_t button_release = UINT64_MAX;
+static Ramp ramps[3];                      // bat, ext, temp
+static bool ramping[3] = { false, false, false };
+static const char *trace_name;
+static bool quiet = false;
+static bool power_budget = false;
+static int failures = 0;
+static uint32_t i2c_transfers = 0;
+static uint64_t measure_start = 0;
+
+/*
+   The observed values, a change is logged
+*/
+static int last_state = -1;
+static int last_should_shutdown = -1;
+static int last_switch = -1;
+static uint32_t last_bootloader_jumps = 0;
+
+static void log_at(uint64_t now, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void log_at(uint64_t now, const char *format, ...) {
+  if (quiet) {
+    return;
+  }
+  printf("%10.3f  ", now / (double) SECOND);
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+}
+
+static const char *state_name(uint8_t value) {
+  switch (static_cast<State>(value)) {
+    case State::running_state:       return "running_state";
+    case State::unclear_state:       return "unclear_state";
+    case State::warn_to_running:     return "warn_to_running";
+    case State::shutdown_to_running: return "shutdown_to_running";
+    case State::warn_state:          return "warn_state";
+    case State::warn_to_shutdown:    return "warn_to_shutdown";
+    case State::shutdown_state:      return "shutdown_state";
+  }
+  return "unknown";
+}
+
+static int switch_level() {
+  return (PORTB >> PIN_SWITCH) & 1;
+}
+
+static void observe(uint64_t now) {
+  int current = static_cast<uint8_t>(state);
+  if (current != last_state) {
+    log_at(now, "state %s", state_name(current));
+    last_state = current;
+  }
+  if (should_shutdown != last_should_shutdown) {
+    log_at(now, "should_shutdown 0x%02x", should_shutdown);
+    last_should_shutdown = should_shutdown;
+  }
+  if (switch_level() != last_switch) {
+    log_at(now, "switch pin %s", switch_level() ? "high" : "low");
+    last_switch = switch_level();
+  }
+  if (host_bootloader_jumps != last_bootloader_jumps) {
+    log_at(now, "jump to the bootloader, GPIOR0 0x%02x", GPIOR0);
+    last_bootloader_jumps = host_bootloader_jumps;
+  }
+}
+
+/*
+   The variables that can be checked with expect
+*/
+struct Variable {
+  const char *name;
+  int32_t (*get)(void);
+};
+
+static const Variable variables[] = {
+  { "state",            [] () -> int32_t { return static_cast<uint8_t>(state); } },
+  { "should_shutdown",  [] () -> int32_t { return should_shutdown; } },
+  { "primed",           [] () -> int32_t { return primed; } },
+  { "seconds",          [] () -> int32_t { return seconds; } },
+  { "bat_voltage",      [] () -> int32_t { return bat_voltage; } },
+  { "ext_voltage",      [] () -> int32_t { return ext_voltage; } },
+  { "temperature",      [] () -> int32_t { return (int16_t) temperature; } },
+  { "wakeup_interval",  [] () -> int32_t { return wakeup_interval; } },
+  { "state_of_charge",  [] () -> int32_t { return state_of_charge; } },
+  { "time_to_shutdown", [] () -> int32_t { return time_to_shutdown; } },
+  { "switch",           [] () -> int32_t { return switch_level(); } },
+  { "button_gesture",   [] () -> int32_t { return button_gesture; } },
+  { "i2c_address",      [] () -> int32_t { return i2c_address; } },
+  { "pending_ups_on",   [] () -> int32_t { return pending_ups_on; } },
+  { "bootloader",       [] () -> int32_t { return host_bootloader_jumps; } },
+  { "gpior0",           [] () -> int32_t { return GPIOR0; } },
+  { "adc_clock",        [] () -> int32_t { return !(PRR & bit(PRADC)); } },
+  { nullptr,            nullptr },
+};
+
+static void fail(const Event &event, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void fail(const Event &event, const char *format, ...) {
+  fprintf(stderr, "%s:%d: ", trace_name, event.line);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  failures++;
+}
+
+static bool parse_number(const std::string &word, int32_t *value) {
+  char *end;
+  *value = strtol(word.c_str(), &end, 0);
+  return !word.empty() && *end == '\0';
+}
+
+static bool parse_register(const std::string &word, uint8_t *number) {
+  for (const Register_Name *entry = register_names; entry->name != nullptr; entry++) {
+    if (word == entry->name) {
+      *number = entry->number;
+      return true;
+    }
+  }
+  int32_t value;
+  if (parse_number(word, &value) && value >= 0 && value <= UCHAR_MAX) {
+    *number = value;
+    return true;
+  }
+  return false;
+}
+
+static uint8_t register_size(uint8_t number) {
+  return pgm_read_byte(&find_register(static_cast<Register>(number))->size);
+}
+
+static int analog_channel(const std::string &word) {
+  if (word == "bat") {
+    return 0;
+  }
+  if (word == "ext") {
+    return 1;
+  }
+  if (word == "temp") {
+    return 2;
+  }
+  return -1;
+}
+
+static void set_analog(int channel, int32_t value) {
+  switch (channel) {
+    case 0:
+      host_analog.bat_voltage = value;
+      break;
+    case 1:
+      host_analog.ext_voltage = value;
+      break;
+    default:
+      host_analog.temperature = value;
+      break;
+  }
+}
+
+static void update_analog(uint64_t now) {
+  for (int channel = 0; channel < 3; channel++) {
+    if (!ramping[channel]) {
+      continue;
+    }
+    const Ramp &ramp = ramps[channel];
+    if (now >= ramp.end) {
+      set_analog(channel, ramp.to);
+      ramping[channel] = false;
+    } else {
+      set_analog(channel, ramp.from + (int64_t) (ramp.to - ramp.from) * (int64_t) (now - ramp.start)
+                                      / (int64_t) (ramp.end - ramp.start));
+    }
+  }
+}
+
+static void run_expect(const Event &event, uint64_t now) {
+  if (event.words.size() != 4) {
+    fail(event, "expect needs a variable, an operator and a value");
+    return;
+  }
+  const Variable *variable = variables;
+  while (variable->name != nullptr && event.words[1] != variable->name) {
+    variable++;
+  }
+  int32_t expected;
+  if (variable->name == nullptr || !parse_number(event.words[3], &expected)) {
+    fail(event, "unknown variable or invalid value");
+    return;
+  }
+  int32_t actual = variable->get();
+  const std::string &op = event.words[2];
+  bool ok = op == "==" ? actual == expected : op == "!=" ? actual != expected
+          : op == "<"  ? actual <  expected : op == "<=" ? actual <= expected
+          : op == ">"  ? actual >  expected : op == ">=" ? actual >= expected : false;
+  if (!ok) {
+    fail(event, "at %.3fs expected %s %s %d, got %d", now / (double) SECOND,
+         variable->name, op.c_str(), expected, actual);
+  }
+}
+
+/*
+   The button pulls the pin low, the pin change interrupt fires if it is enabled
+*/
+static void set_button(bool released) {
+  PINB = released ? PINB | bit(LED_BUTTON) : PINB & ~bit(LED_BUTTON);
+  if ((GIMSK & bit(PCIE)) && (PCMSK & bit(LED_BUTTON))) {
+    PCINT0_vect();
+  }
+}
+
+static void run_event(const Event &event, uint64_t now) {
+  const std::string &command = event.words[0];
+  int32_t value, data;
+  uint8_t number;
+
+  if (analog_channel(command) >= 0 && event.words.size() == 2 && parse_number(event.words[1], &value)) {
+    ramping[analog_channel(command)] = false;
+    set_analog(analog_channel(command), value);
+  } else if (command == "ramp" && event.words.size() == 4 && analog_channel(event.words[1]) >= 0) {
+    int channel = analog_channel(event.words[1]);
+    int32_t seconds_value;
+    update_analog(now);
+    int32_t from = channel == 0 ? host_analog.bat_voltage : channel == 1 ? host_analog.ext_voltage
+                                                                         : host_analog.temperature;
+    if (!parse_number(event.words[2], &value) || !parse_number(event.words[3], &seconds_value)) {
+      fail(event, "invalid ramp");
+      return;
+    }
+    ramps[channel] = { now, now + seconds_value * SECOND, from, value };
+    ramping[channel] = true;
+  } else if (command == "rpi" && event.words.size() == 2) {
+    double interval = atof(event.words[1].c_str());
+    rpi_interval = interval * SECOND;
+    rpi_next = rpi_interval > 0 ? now : UINT64_MAX;
+  } else if (command == "write" && event.words.size() == 3 && parse_register(event.words[1], &number)
+             && parse_number(event.words[2], &value)) {
+    std::vector<uint8_t> frame = { number };
+    for (uint8_t i = 0; i < register_size(number); i++) {
+      frame.push_back((value >> (8 * i)) & 0xFF);
+    }
+    i2c_transfers++;
+    if (!i2c_write(frame)) {
+      fail(event, "write not acknowledged");
+    }
+    log_at(now, "write %s = %d", event.words[1].c_str(), value);
+  } else if (command == "read" && event.words.size() == 2 && parse_register(event.words[1], &number)) {
+    std::vector<uint8_t> data = i2c_read(number, register_size(number) + 1);
+    i2c_transfers++;
+    if (data.empty()) {
+      log_at(now, "read %s not acknowledged", event.words[1].c_str());
+      return;
+    }
+    uint32_t result = 0;
+    for (size_t i = 0; i + 1 < data.size() && i < sizeof(result); i++) {
+      result |= (uint32_t) data[i] << (8 * i);
+    }
+    log_at(now, "read %s = %u (0x%x)%s", event.words[1].c_str(), result, result,
+           i2c_crc_ok(number, data) ? "" : ", CRC error");
+  } else if (command == "address" && event.words.size() == 2 && parse_number(event.words[1], &value)) {
+    i2c_target = value;
+    log_at(now, "address 0x%02x", i2c_target);
+  } else if (command == "eeprom" && event.words.size() == 3 && parse_number(event.words[1], &value)
+             && value >= 0 && value < (int32_t) sizeof(host_eeprom) && parse_number(event.words[2], &data) && data >= 0 && data <= UCHAR_MAX) {
+    host_eeprom[value] = data;
+  } else if (command == "button" && event.words.size() <= 2) {
+    value = 100;
+    if (event.words.size() == 2 && !parse_number(event.words[1], &value)) {
+      fail(event, "invalid duration");
+      return;
+    }
+    log_at(now, "button pressed for %dms", value);
+    set_button(false);
+    button_release = now + (uint64_t) value * 1000;
+  } else if (command == "expect") {
+    run_expect(event, now);
+  } else if (command == "measure" && event.words.size() == 1) {
+    host_counters = Host_Counters();
+    i2c_transfers = 0;
+    measure_start = now;
+  } else if (command != "end") {
+    fail(event, "invalid command");
+  }
+}
+
+/*
+   The event interface of the simulated hardware
+*/
+static uint64_t next_event_time() {
+  uint64_t next = next_event < events.size() ? events[next_event].time : UINT64_MAX;
+  next = next < rpi_next ? next : rpi_next;
+  return next < button_release ? next : button_release;
+}
+
+static void run_events(uint64_t now) {
+  if (button_release <= now) {
+    log_at(now, "button released");
+    set_button(true);
+    button_release = UINT64_MAX;
+  }
+  while (next_event < events.size() && events[next_event].time <= now) {
+    run_event(events[next_event++], now);
+  }
+  if (rpi_next <= now) {
+    i2c_read(static_cast<uint8_t>(Register::snapshot), sizeof(Snapshot) + 1);
+    i2c_transfers++;
+    rpi_next = now + rpi_interval;
+  }
+}
+
+/*
+   The supply currents of the ATtiny85 at 8MHz and a Vcc of about 4V (typical values read
+   from the charts in data sheet ch. 22). The firmware runs in zero simulated time, the
+   code executed per wake-up is estimated with CODE_CYCLES_PER_WAKEUP. An EEPROM write
+   keeps the CPU busy for the programming time (ch. 5.3.1, table 5-1). The absolute
+   values depend on the individual chip, the budget is meant to compare builds.
+*/
+static const double ACTIVE_CURRENT          = 3500;    // uA
+static const double IDLE_CURRENT            = 1000;    // uA
+static const double ADC_SLEEP_CURRENT       =  500;    // uA, ADC noise reduction mode without the ADC
+static const double POWER_DOWN_CURRENT      =    5;    // uA, watchdog enabled, BOD disabled
+static const double ADC_CURRENT             =  300;    // uA, in addition while the ADC is enabled
+static const uint32_t CODE_CYCLES_PER_WAKEUP = 2000;
+static const uint32_t EEPROM_WRITE_TIME     = 3400;    // us
+static const uint32_t CPU_FREQUENCY         =    8;    // MHz
+
+static void print_power_budget(uint64_t duration) {
+  const Host_Counters &counters = host_counters;
+  uint64_t code_time = (uint64_t) counters.wakeups * CODE_CYCLES_PER_WAKEUP / CPU_FREQUENCY;
+  uint64_t eeprom_time = (uint64_t) counters.eeprom_writes * EEPROM_WRITE_TIME;
+  uint64_t awake_time = counters.active_time + code_time + eeprom_time;
+
+  struct Part {
+    const char *name;
+    uint64_t time;                         // us
+    double current;                        // uA
+  } parts[] = {
+    { "active (delays, ADC polling)", counters.active_time,     ACTIVE_CURRENT },
+    { "active (code, estimated)",     code_time,                 ACTIVE_CURRENT },
+    { "active (EEPROM writes)",       eeprom_time,               ACTIVE_CURRENT },
+    { "idle",                         counters.idle_time,        IDLE_CURRENT },
+    { "ADC noise reduction",          counters.adc_sleep_time,   ADC_SLEEP_CURRENT },
+    { "power-down",                   counters.power_down_time,  POWER_DOWN_CURRENT },
+    { "ADC enabled",                  counters.adc_on_time,      ADC_CURRENT },
+  };
+
+  double total = 0;
+  printf("power budget of %.0fs: %.3fs awake (%.2fM cycles), %u wake-ups\n", duration / (double) SECOND,
+         awake_time / (double) SECOND, awake_time * CPU_FREQUENCY / 1e6, counters.wakeups);
+  for (const Part &part : parts) {
+    double average = part.current * part.time / duration;
+    total += average;
+    printf("  %-30s %10.3fs %8.2fuA\n", part.name, part.time / (double) SECOND, average);
+  }
+  printf("  %-30s %20.2fuA, %.3fmAh per hour\n", "estimated average", total, total / 1000);
+}
+
+static bool read_trace(const char *name) {
+  std::ifstream file(name);
+  if (!file) {
+    fprintf(stderr, "cannot open %s\n", name);
+    return false;
+  }
+  host_end = 0;
+  std::string line;
+  int number = 0;
+  while (std::getline(file, line)) {
+    number++;
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string time;
+    if (!(words >> time)) {
+      continue;
+    }
+    Event event = { (uint64_t) (atof(time.c_str()) * SECOND), number, {} };
+    std::string word;
+    while (words >> word) {
+      event.words.push_back(word);
+    }
+    if (event.words.empty() || (!events.empty() && event.time < events.back().time)) {
+      fprintf(stderr, "%s:%d: missing command or time out of order\n", name, number);
+      return false;
+    }
+    events.push_back(event);
+    host_end = event.words[0] == "end" ? event.time : event.time + SECOND;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "-q") == 0) {
+      quiet = true;
+    } else if (strcmp(argv[arg], "-p") == 0) {
+      power_budget = true;
+    } else {
+      break;
+    }
+  }
+  if (arg + 1 != argc) {
+    fprintf(stderr, "usage: %s [-q] [-p] trace\n", argv[0]);
+    return 2;
+  }
+  trace_name = argv[arg];
+  if (!read_trace(trace_name)) {
+    return 2;
+  }
+
+  // an erased EEPROM, the firmware initializes it with the defaults
+  memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+  while (next_event < events.size() && events[next_event].time == 0 && events[next_event].words[0] == "eeprom") {
+    run_event(events[next_event++], 0);
+  }
+  host_events = { next_event_time, run_events, update_analog, observe };
+  PINB = bit(LED_BUTTON);                  // the pull-up of the button
+
+  setup();
+  while (host_now < host_end) {
+    loop();
+    observe(host_now);
+  }
+
+  printf("%s: %.0fs simulated, %u wake-ups, %u watchdog interrupts, %u ADC conversions, "
+         "%u EEPROM writes, %u I2C transfers, %d failed\n", trace_name, (host_now - measure_start) / (double) SECOND,
+         host_counters.wakeups, host_counters.wdt_interrupts, host_counters.adc_conversions,
+         host_counters.eeprom_writes, i2c_transfers, failures);
+  if (power_budget && host_now > measure_start) {
+    print_power_budget(host_now - measure_start);
+  }
+  return failures;
+}